@@ -0,0 +1,245 @@
+#include "Arduino.h"
+#include "Broker.h"
+#include "ESP8266WiFi.h"
+#include "Fiber.h"
+#include "HostSim.h"
+
+#include <algorithm>
+#include <vector>
+
+HardwareSerial Serial;
+
+namespace sim {
+
+uint64_t loopTime = 100;
+FILE* serialOutput = stdout;
+
+namespace {
+
+struct Pin {
+	uint8_t mode = INPUT; // Pin mode
+	int level = LOW; // Current level
+	double duty = 0.0; // Duty cycle of analogWrite(), follows the level otherwise
+	void (*handler)(void) = nullptr; // Attached interrupt handler
+	int trigger = 0; // Interrupt trigger
+};
+
+Pin pins[NUM_DIGITAL_PINS];
+std::vector<std::function<void(uint8_t, int)>> writeHandlers;
+uint32_t analogRange = 255; // Range of analogWrite() values
+
+void writeLevel(uint8_t pin, int level) { // Change an output level and notify the observers
+	if (pins[pin].level == level) {
+		return;
+	}
+	pins[pin].level = level;
+	for (auto& handler : writeHandlers) {
+		handler(pin, level);
+	}
+}
+
+} // namespace
+
+int pinLevel(uint8_t pin) {
+	return (pin < NUM_DIGITAL_PINS) ? pins[pin].level : LOW;
+}
+
+void setPinLevel(uint8_t pin, int level) {
+	if (pin >= NUM_DIGITAL_PINS || pins[pin].level == level) { // No edge
+		return;
+	}
+	pins[pin].level = level;
+	int edge = (level == HIGH) ? RISING : FALLING;
+	if (pins[pin].handler && (pins[pin].trigger == edge || pins[pin].trigger == CHANGE)) { // Interrupt triggered
+		pins[pin].handler();
+	}
+}
+
+void onPinWrite(std::function<void(uint8_t, int)> handler) {
+	writeHandlers.push_back(handler);
+}
+
+double pinDuty(uint8_t pin) {
+	return (pin < NUM_DIGITAL_PINS) ? pins[pin].duty : 0.0;
+}
+
+bool interruptAttached(uint8_t pin) {
+	return pin < NUM_DIGITAL_PINS && pins[pin].handler;
+}
+
+void reset() {
+	for (Pin& pin : pins) {
+		pin = Pin();
+	}
+	writeHandlers.clear();
+	analogRange = 255;
+	Serial.end();
+	virtualClock.reset();
+	resetNetwork();
+	broker.reset();
+}
+
+bool run(uint64_t duration, std::function<bool()> until) {
+	uint64_t end = virtualClock.now() + duration;
+	while (virtualClock.now() < end) {
+		loop();
+		if (until && until()) {
+			return true;
+		}
+		virtualClock.advance(loopTime);
+	}
+	return false;
+}
+
+} // namespace sim
+
+unsigned long millis() {
+	return sim::virtualClock.now() / 1000;
+}
+
+unsigned long micros() {
+	return sim::virtualClock.now();
+}
+
+void delay(unsigned long ms) {
+	sim::sleepUntil(sim::virtualClock.now() + (uint64_t) ms * 1000);
+}
+
+void delayMicroseconds(unsigned int us) {
+	sim::sleepUntil(sim::virtualClock.now() + us);
+}
+
+void yield() {
+	sim::sleepUntil(sim::virtualClock.now()); // Execute events which are already due
+}
+
+void pinMode(uint8_t pin, uint8_t mode) {
+	if (pin < NUM_DIGITAL_PINS) {
+		sim::pins[pin].mode = mode;
+	}
+}
+
+void digitalWrite(uint8_t pin, uint8_t value) {
+	if (pin >= NUM_DIGITAL_PINS) {
+		return;
+	}
+	sim::pins[pin].duty = (value == HIGH) ? 1.0 : 0.0; // Stops PWM like on the ESP8266
+	sim::writeLevel(pin, value);
+}
+
+void analogWrite(uint8_t pin, int value) {
+	if (pin >= NUM_DIGITAL_PINS) {
+		return;
+	}
+	sim::pins[pin].duty = std::min(std::max(value, 0), (int) sim::analogRange) / (double) sim::analogRange;
+	sim::writeLevel(pin, (value > 0) ? HIGH : LOW); // Observers see a PWM output as switched on
+}
+
+void analogWriteRange(uint32_t range) {
+	sim::analogRange = std::max<uint32_t>(range, 1);
+}
+
+void analogWriteFreq(uint32_t) { // The plant model uses the mean drive
+}
+
+int digitalRead(uint8_t pin) {
+	return sim::pinLevel(pin);
+}
+
+void attachInterrupt(uint8_t pin, void (*handler)(void), int mode) {
+	if (pin < NUM_DIGITAL_PINS) {
+		sim::pins[pin].handler = handler;
+		sim::pins[pin].trigger = mode;
+	}
+}
+
+void detachInterrupt(uint8_t pin) {
+	if (pin < NUM_DIGITAL_PINS) {
+		sim::pins[pin].handler = nullptr;
+	}
+}
+
+static char* formatNumber(unsigned long value, char* buffer, int base, bool negative) {
+	char digits[sizeof(unsigned long) * 8 + 1];
+	int n = 0;
+	do {
+		int digit = value % base;
+		digits[n++] = (digit < 10) ? '0' + digit : 'a' + digit - 10;
+		value /= base;
+	} while (value);
+	char* out = buffer;
+	if (negative) {
+		*out++ = '-';
+	}
+	while (n) {
+		*out++ = digits[--n];
+	}
+	*out = '\0';
+	return buffer;
+}
+
+char* itoa(int value, char* buffer, int base) {
+	return ltoa(value, buffer, base);
+}
+
+char* ltoa(long value, char* buffer, int base) {
+	bool negative = value < 0 && base == 10;
+	return formatNumber(negative ? -(unsigned long) value : (unsigned long) value, buffer, base, negative);
+}
+
+char* ultoa(unsigned long value, char* buffer, int base) {
+	return formatNumber(value, buffer, base, false);
+}
+
+size_t Print::write(const uint8_t* buffer, size_t size) {
+	size_t n = 0;
+	while (size--) {
+		n += write(*buffer++);
+	}
+	return n;
+}
+
+size_t Print::print(long value, int base) {
+	char buffer[sizeof(long) * 8 + 2];
+	return write(ltoa(value, buffer, base));
+}
+
+size_t Print::print(unsigned long value, int base) {
+	char buffer[sizeof(long) * 8 + 1];
+	return write(ultoa(value, buffer, base));
+}
+
+size_t Print::print(double value, int digits) {
+	char buffer[64];
+	snprintf(buffer, sizeof(buffer), "%.*f", digits, value);
+	return write(buffer);
+}
+
+void HardwareSerial::begin(unsigned long) {
+	started = true;
+}
+
+void HardwareSerial::end() {
+	started = false;
+}
+
+void HardwareSerial::flush() {
+	if (started && sim::serialOutput) {
+		fflush(sim::serialOutput);
+	}
+}
+
+int HardwareSerial::availableForWrite() {
+	return 128; // Size of the UART FIFO, the host never blocks
+}
+
+size_t HardwareSerial::write(uint8_t c) {
+	return write(&c, 1);
+}
+
+size_t HardwareSerial::write(const uint8_t* buffer, size_t size) {
+	if (!started || !sim::serialOutput) { // Output is discarded before Serial.begin()
+		return size;
+	}
+	return fwrite(buffer, 1, size, sim::serialOutput);
+}
@@ -0,0 +1,159 @@
+/*
+ * Arduino core for the host simulation
+ *
+ * This header provides the subset of the ESP8266 Arduino core
+ * used by the firmware. Time is taken from the virtual clock,
+ * pins and interrupts are simulated and the serial interface
+ * is written to the standard output.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+using std::min;
+using std::max;
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+// Pin levels, modes and interrupt triggers
+#define LOW 0x0
+#define HIGH 0x1
+#define INPUT 0x00
+#define INPUT_PULLUP 0x02
+#define INPUT_PULLDOWN_16 0x04
+#define OUTPUT 0x01
+#define RISING 0x01
+#define FALLING 0x02
+#define CHANGE 0x03
+#define NUM_DIGITAL_PINS 17
+#define NOT_AN_INTERRUPT -1
+#define digitalPinToInterrupt(p) (((p) < NUM_DIGITAL_PINS) ? (p) : NOT_AN_INTERRUPT)
+
+// Number bases for printing
+#define DEC 10
+#define HEX 16
+
+// Code and data placement attributes have no meaning on the host
+#define ICACHE_RAM_ATTR
+#define IRAM_ATTR
+#define PROGMEM
+#define PSTR(s) (s)
+#define PGM_P const char*
+
+class __FlashStringHelper;
+#define F(s) (reinterpret_cast<const __FlashStringHelper*>(s))
+#define FPSTR(p) (reinterpret_cast<const __FlashStringHelper*>(p))
+
+// Access to data in flash, which is ordinary memory on the host
+#define pgm_read_byte(addr) (*reinterpret_cast<const uint8_t*>(addr))
+#define pgm_read_word(addr) (*reinterpret_cast<const uint16_t*>(addr))
+#define pgm_read_dword(addr) (*reinterpret_cast<const uint32_t*>(addr))
+#define pgm_read_float(addr) (*reinterpret_cast<const float*>(addr))
+#define pgm_read_ptr(addr) (*reinterpret_cast<const void* const*>(addr))
+inline size_t strlen_P(PGM_P s) { return strlen(s); }
+inline int strcmp_P(const char* a, PGM_P b) { return strcmp(a, b); }
+inline int strncmp_P(const char* a, PGM_P b, size_t n) { return strncmp(a, b, n); }
+inline char* strcpy_P(char* dest, PGM_P src) { return strcpy(dest, src); }
+inline size_t strlcpy_P(char* dest, PGM_P src, size_t size) {
+	size_t length = strlen(src);
+	if (size > 0) {
+		size_t copied = std::min(length, size - 1);
+		memcpy(dest, src, copied);
+		dest[copied] = '\0';
+	}
+	return length;
+}
+inline void* memcpy_P(void* dest, const void* src, size_t n) { return memcpy(dest, src, n); }
+#define snprintf_P snprintf
+#define vsnprintf_P vsnprintf
+
+// Time
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+void yield();
+
+// Digital I/O and interrupts
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+int digitalRead(uint8_t pin);
+void analogWrite(uint8_t pin, int value);
+void analogWriteRange(uint32_t range);
+void analogWriteFreq(uint32_t frequency);
+void attachInterrupt(uint8_t pin, void (*handler)(void), int mode);
+void detachInterrupt(uint8_t pin);
+inline void interrupts() {} // Interrupt handlers only run between two statements of the firmware
+inline void noInterrupts() {}
+
+// Number conversion
+char* itoa(int value, char* buffer, int base);
+char* ltoa(long value, char* buffer, int base);
+char* ultoa(unsigned long value, char* buffer, int base);
+
+class Print;
+
+class Printable {
+public:
+	virtual ~Printable() {}
+	virtual size_t printTo(Print& p) const = 0;
+};
+
+class Print {
+public:
+	virtual ~Print() {}
+	virtual size_t write(uint8_t c) = 0;
+	virtual size_t write(const uint8_t* buffer, size_t size);
+	size_t write(const char* str) { return (str) ? write((const uint8_t*) str, strlen(str)) : 0; }
+
+	size_t print(const __FlashStringHelper* str) { return write((const char*) str); }
+	size_t print(const char* str) { return write(str); }
+	size_t print(char c) { return write((uint8_t) c); }
+	size_t print(unsigned char value, int base = DEC) { return print((unsigned long) value, base); }
+	size_t print(int value, int base = DEC) { return print((long) value, base); }
+	size_t print(unsigned int value, int base = DEC) { return print((unsigned long) value, base); }
+	size_t print(long value, int base = DEC);
+	size_t print(unsigned long value, int base = DEC);
+	size_t print(double value, int digits = 2);
+	size_t print(const Printable& value) { return value.printTo(*this); }
+
+	size_t println() { return write("\r\n"); }
+	size_t println(const __FlashStringHelper* str) { return print(str) + println(); }
+	size_t println(const char* str) { return print(str) + println(); }
+	size_t println(char c) { return print(c) + println(); }
+	size_t println(unsigned char value, int base = DEC) { return print(value, base) + println(); }
+	size_t println(int value, int base = DEC) { return print(value, base) + println(); }
+	size_t println(unsigned int value, int base = DEC) { return print(value, base) + println(); }
+	size_t println(long value, int base = DEC) { return print(value, base) + println(); }
+	size_t println(unsigned long value, int base = DEC) { return print(value, base) + println(); }
+	size_t println(double value, int digits = 2) { return print(value, digits) + println(); }
+	size_t println(const Printable& value) { return print(value) + println(); }
+};
+
+class HardwareSerial : public Print {
+public:
+	void begin(unsigned long baud); // Start writing to the standard output
+	void end();
+	void flush();
+	int available() { return 0; }
+	int read() { return -1; }
+	int availableForWrite();
+	size_t write(uint8_t c) override;
+	size_t write(const uint8_t* buffer, size_t size) override;
+	using Print::write;
+	operator bool() const { return started; }
+
+private:
+	bool started = false; // Serial interface has been started
+};
+
+extern HardwareSerial Serial;
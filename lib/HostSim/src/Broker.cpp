@@ -0,0 +1,396 @@
+#include "Broker.h"
+#include "Mqtt.h"
+#include "VirtualClock.h"
+
+#include <algorithm>
+
+namespace sim {
+
+Broker broker;
+
+/*
+ * MQTT 3.1.1 connection of a client
+ *
+ * Parses the packets arriving on the socket and maps them to
+ * the session interface of the broker. Only QoS 0 and 1 are
+ * supported, as PubSubClient does not publish with QoS 2. The
+ * connection is dropped with the last will if no packet arrives
+ * for one and a half times the keep alive interval.
+ */
+class Broker::Endpoint : public Session, public std::enable_shared_from_this<Endpoint> {
+public:
+	Endpoint(Broker& broker, Socket socket) : broker(broker), socket(socket) {}
+
+	void start(); // Start receiving packets
+	bool finished() const { return done; } // Connection is closed
+	void deliver(const Message& message) override;
+	void dropped() override;
+
+private:
+	void receive(); // Process received bytes
+	void process(const mqtt::Packet& packet); // Process a complete packet
+	void send(uint8_t header, const std::string& body); // Send a packet
+	void fail(); // Drop the connection after a protocol error or timeout
+	void watch(); // Schedule the next keep alive check
+
+	Broker& broker; // Broker the connection belongs to
+	Socket socket; // Connection to the client
+	std::string inbound; // Received bytes not forming a complete packet yet
+	bool connected = false; // CONNECT has been accepted
+	bool done = false; // Connection is closed
+	uint16_t keepAlive = 0; // Keep alive interval in s, 0 if disabled
+	uint64_t activity = 0; // Virtual time of the last received packet in us
+};
+
+void Broker::Endpoint::start() {
+	std::weak_ptr<Endpoint> self = shared_from_this();
+	socket.onReceive([self]() {
+		if (auto endpoint = self.lock()) {
+			endpoint->receive();
+		}
+	});
+}
+
+void Broker::Endpoint::deliver(const Message& message) {
+	std::string body;
+	mqtt::appendString(body, message.topic);
+	send(mqtt::PUBLISH | (message.retained ? 1 : 0), body + message.payload);
+}
+
+void Broker::Endpoint::dropped() {
+	connected = false;
+	done = true;
+	socket.close();
+}
+
+void Broker::Endpoint::receive() {
+	while (socket.available()) {
+		inbound += (char) socket.read();
+		broker.statistics.bytesIn++;
+	}
+	while (!done) {
+		mqtt::Packet packet;
+		size_t length = mqtt::parse(inbound, packet);
+		if (length == 0) {
+			break;
+		}
+		if (length == mqtt::MALFORMED) {
+			fail();
+			return;
+		}
+		inbound.erase(0, length);
+		activity = virtualClock.now();
+		broker.statistics.packetsIn++;
+		process(packet);
+	}
+	if (!done && !socket.open()) { // Closed or reset without DISCONNECT
+		fail();
+	}
+}
+
+void Broker::Endpoint::process(const mqtt::Packet& packet) {
+	mqtt::Reader reader(packet.body);
+	if (!connected && packet.type() != mqtt::CONNECT) { // First packet must be CONNECT
+		fail();
+		return;
+	}
+	switch (packet.type()) {
+	case mqtt::CONNECT: {
+		std::string protocol = reader.string();
+		uint8_t level = reader.byte();
+		uint8_t flags = reader.byte();
+		keepAlive = reader.word();
+		std::string clientId = reader.string();
+		Message will;
+		will.retained = flags & mqtt::WILL_RETAIN;
+		if (flags & mqtt::WILL) {
+			will.topic = reader.string();
+			will.payload = reader.string();
+		}
+		if (flags & mqtt::USERNAME) {
+			reader.string();
+		}
+		if (flags & mqtt::PASSWORD) {
+			reader.string();
+		}
+		if (connected || !reader.valid()) { // Second CONNECT or truncated packet
+			fail();
+		} else if (protocol != "MQTT" || level != 4) { // Unacceptable protocol version
+			send(mqtt::CONNACK, std::string("\0\x01", 2));
+			fail();
+		} else if (!broker.connect(this, clientId, (flags & mqtt::WILL) ? &will : nullptr)) { // Server unavailable
+			send(mqtt::CONNACK, std::string("\0\x03", 2));
+			fail();
+		} else {
+			connected = true;
+			broker.statistics.connects++;
+			send(mqtt::CONNACK, std::string("\0\0", 2));
+			watch();
+		}
+		break;
+	}
+	case mqtt::PUBLISH: {
+		uint8_t qos = (packet.header >> 1) & 3;
+		Message message;
+		message.topic = reader.string();
+		message.retained = packet.header & 1;
+		uint16_t id = (qos > 0) ? reader.word() : 0;
+		message.payload = reader.rest();
+		if (!reader.valid() || qos > 1) {
+			fail();
+			break;
+		}
+		if (qos == 1) {
+			std::string body;
+			mqtt::appendWord(body, id);
+			send(mqtt::PUBACK, body);
+		}
+		broker.statistics.publishesIn++;
+		broker.publish(this, message);
+		break;
+	}
+	case mqtt::SUBSCRIBE:
+	case mqtt::UNSUBSCRIBE: {
+		std::string body;
+		mqtt::appendWord(body, reader.word());
+		std::vector<std::string> filters;
+		while (reader.valid() && !reader.empty()) {
+			filters.push_back(reader.string());
+			if (packet.type() == mqtt::SUBSCRIBE) {
+				reader.byte(); // Requested QoS, QoS 0 is granted
+				body += '\0';
+			}
+		}
+		if (!reader.valid() || filters.empty()) {
+			fail();
+			break;
+		}
+		send((packet.type() == mqtt::SUBSCRIBE) ? mqtt::SUBACK : mqtt::UNSUBACK, body);
+		for (const std::string& filter : filters) { // Retained messages follow the SUBACK
+			if (packet.type() == mqtt::SUBSCRIBE) {
+				broker.subscribe(this, filter);
+			} else {
+				broker.unsubscribe(this, filter);
+			}
+		}
+		break;
+	}
+	case mqtt::PINGREQ:
+		send(mqtt::PINGRESP, "");
+		break;
+	case mqtt::DISCONNECT:
+		broker.disconnect(this);
+		break;
+	default: // Packets a client must not send
+		fail();
+	}
+}
+
+void Broker::Endpoint::send(uint8_t header, const std::string& body) {
+	std::string packet = mqtt::encode(header, body);
+	broker.statistics.packetsOut++;
+	broker.statistics.publishesOut += (header & 0xf0) == mqtt::PUBLISH;
+	broker.statistics.bytesOut += packet.size();
+	socket.write((const uint8_t*) packet.data(), packet.size());
+}
+
+void Broker::Endpoint::fail() {
+	if (connected) {
+		broker.drop(this); // Last will is sent, the session closes the socket
+	} else {
+		dropped();
+	}
+}
+
+void Broker::Endpoint::watch() {
+	if (keepAlive == 0) {
+		return;
+	}
+	std::weak_ptr<Endpoint> self = shared_from_this();
+	virtualClock.schedule(activity + keepAlive * 1500000ULL, [self]() {
+		auto endpoint = self.lock();
+		if (!endpoint || endpoint->done) {
+			return;
+		}
+		if (virtualClock.now() >= endpoint->activity + endpoint->keepAlive * 1500000ULL) { // Client is gone
+			endpoint->fail();
+		} else {
+			endpoint->watch();
+		}
+	});
+}
+
+void Broker::publish(const std::string& topic, const std::string& payload, bool retained) {
+	route({topic, payload, retained});
+}
+
+void Broker::observe(const std::string& filter, Handler handler) {
+	observers.push_back({filter, handler});
+}
+
+const Message* Broker::retained(const std::string& topic) const {
+	auto it = retainedMessages.find(topic);
+	return (it != retainedMessages.end()) ? &it->second : nullptr;
+}
+
+void Broker::setOnline(bool online) {
+	up = online;
+	if (!up) { // Connections are lost without last wills
+		while (!clients.empty()) {
+			close(clients.begin()->first, false);
+		}
+		for (auto& endpoint : endpoints) {
+			if (!endpoint->finished()) {
+				endpoint->dropped();
+			}
+		}
+	}
+}
+
+bool Broker::drop(const std::string& clientId) {
+	for (auto& client : clients) {
+		if (client.second.clientId == clientId) {
+			close(client.first, true);
+			return true;
+		}
+	}
+	return false;
+}
+
+void Broker::reset() {
+	up = true;
+	statistics = Statistics();
+	clients.clear();
+	endpoints.clear();
+	retainedMessages.clear();
+	observers.clear();
+}
+
+void Broker::accept(Socket socket) {
+	endpoints.erase(std::remove_if(endpoints.begin(), endpoints.end(), [](const std::shared_ptr<Endpoint>& endpoint) {
+		return endpoint->finished();
+	}), endpoints.end());
+	endpoints.push_back(std::make_shared<Endpoint>(*this, socket));
+	endpoints.back()->start();
+}
+
+bool Broker::connect(Session* session, const std::string& clientId, const Message* will) {
+	if (!up) {
+		return false;
+	}
+	for (auto& client : clients) { // Take over an existing session with the same client ID
+		if (client.second.clientId == clientId) {
+			close(client.first, false);
+			break;
+		}
+	}
+	Client& client = clients[session];
+	client = Client();
+	client.clientId = clientId;
+	if (will) {
+		client.hasWill = true;
+		client.will = *will;
+	}
+	return true;
+}
+
+void Broker::disconnect(Session* session) {
+	if (clients.count(session)) {
+		close(session, false);
+	}
+}
+
+void Broker::drop(Session* session) {
+	if (clients.count(session)) {
+		close(session, true);
+	}
+}
+
+void Broker::publish(Session* session, const Message& message) {
+	if (clients.count(session)) {
+		route(message);
+	}
+}
+
+void Broker::subscribe(Session* session, const std::string& filter) {
+	auto it = clients.find(session);
+	if (it == clients.end()) {
+		return;
+	}
+	it->second.filters.push_back(filter);
+	for (auto& retained : retainedMessages) { // Send matching retained messages
+		if (matches(filter, retained.first)) {
+			session->deliver(retained.second);
+		}
+	}
+}
+
+void Broker::unsubscribe(Session* session, const std::string& filter) {
+	auto it = clients.find(session);
+	if (it == clients.end()) {
+		return;
+	}
+	auto& filters = it->second.filters;
+	for (auto f = filters.begin(); f != filters.end(); ++f) {
+		if (*f == filter) {
+			filters.erase(f);
+			break;
+		}
+	}
+}
+
+bool Broker::matches(const std::string& filter, const std::string& topic) {
+	size_t f = 0, t = 0; // Start of the current level in filter and topic
+	for (;;) {
+		size_t fEnd = std::min(filter.find('/', f), filter.size());
+		size_t tEnd = std::min(topic.find('/', t), topic.size());
+		if (filter.compare(f, fEnd - f, "#") == 0) { // Matches all remaining levels
+			return true;
+		}
+		if (filter.compare(f, fEnd - f, "+") != 0 && filter.compare(f, fEnd - f, topic, t, tEnd - t) != 0) { // Level differs
+			return false;
+		}
+		bool filterEnd = fEnd == filter.size(), topicEnd = tEnd == topic.size();
+		if (filterEnd || topicEnd) {
+			return (filterEnd && topicEnd) || (topicEnd && filter.compare(fEnd, std::string::npos, "/#") == 0); // "a/#" also matches "a"
+		}
+		f = fEnd + 1;
+		t = tEnd + 1;
+	}
+}
+
+void Broker::route(const Message& message) {
+	if (message.retained) {
+		if (message.payload.empty()) { // Empty retained message clears the topic
+			retainedMessages.erase(message.topic);
+		} else {
+			retainedMessages[message.topic] = message;
+		}
+	}
+	for (auto& observer : observers) {
+		if (matches(observer.first, message.topic)) {
+			observer.second(message);
+		}
+	}
+	Message forwarded = message;
+	forwarded.retained = false; // Retain flag is only set for messages sent on subscription
+	for (auto& client : clients) {
+		for (auto& filter : client.second.filters) {
+			if (matches(filter, message.topic)) {
+				client.first->deliver(forwarded);
+				break;
+			}
+		}
+	}
+}
+
+void Broker::close(Session* session, bool sendWill) {
+	Client client = clients[session];
+	clients.erase(session);
+	session->dropped();
+	if (sendWill && client.hasWill) {
+		route(client.will);
+	}
+}
+
+} // namespace sim
@@ -0,0 +1,107 @@
+/*
+ * In-process MQTT broker for the host simulation
+ *
+ * The broker routes messages between the simulated firmware
+ * and the simulation tools. The firmware connects through a
+ * simulated TCP connection and speaks MQTT 3.1.1, so every hop
+ * takes the network latency of virtual time. Retained messages,
+ * last wills, keep alive timeouts and wildcard subscriptions
+ * behave as on a real MQTT broker. The simulation tools publish
+ * and observe messages directly at the broker.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Socket.h"
+
+namespace sim {
+
+struct Message {
+	std::string topic; // Topic name
+	std::string payload; // Payload, may contain binary data
+	bool retained = false; // Retain flag
+};
+
+/*
+ * Connection of a client at the broker
+ */
+class Session {
+public:
+	virtual ~Session() {}
+	virtual void deliver(const Message& message) = 0; // Send a message to the client
+	virtual void dropped() = 0; // Connection was closed by the broker
+};
+
+/*
+ * Traffic counters of all network connections
+ */
+struct Statistics {
+	uint64_t connects = 0; // Accepted CONNECT packets
+	uint64_t packetsIn = 0; // Packets received from clients
+	uint64_t packetsOut = 0; // Packets sent to clients
+	uint64_t publishesIn = 0; // PUBLISH packets received from clients
+	uint64_t publishesOut = 0; // PUBLISH packets sent to clients
+	uint64_t bytesIn = 0; // Bytes received from clients
+	uint64_t bytesOut = 0; // Bytes sent to clients
+};
+
+class Broker {
+public:
+	using Handler = std::function<void(const Message&)>;
+
+	Statistics statistics; // Traffic counters, reset by reset()
+
+	// Interface for the simulation tools
+	void publish(const std::string& topic, const std::string& payload, bool retained = false); // Publish as an external client
+	void observe(const std::string& filter, Handler handler); // Observe all messages matching the given filter
+	const Message* retained(const std::string& topic) const; // Retained message of the given topic, nullptr if none
+	bool online() const { return up; } // Broker accepts connections
+	void setOnline(bool online); // Start or stop the broker, stopping drops all sessions
+	bool drop(const std::string& clientId); // Drop a session without a clean disconnect
+	size_t sessions() const { return clients.size(); } // Number of connected clients
+	size_t retainedCount() const { return retainedMessages.size(); } // Number of retained messages
+	void reset(); // Drop all sessions, observers and retained messages
+
+	// Interface for the network
+	void accept(Socket socket); // Accept a TCP connection speaking MQTT 3.1.1
+
+	// Interface for the sessions
+	bool connect(Session* session, const std::string& clientId, const Message* will); // Open a session
+	void disconnect(Session* session); // Close a session cleanly
+	void drop(Session* session); // Connection of a session was lost, the last will is sent
+	void publish(Session* session, const Message& message); // Publish a message of a session
+	void subscribe(Session* session, const std::string& filter); // Subscribe a session
+	void unsubscribe(Session* session, const std::string& filter); // Unsubscribe a session
+
+	static bool matches(const std::string& filter, const std::string& topic); // Topic matches the subscription filter
+
+private:
+	class Endpoint; // MQTT 3.1.1 connection
+
+	struct Client {
+		std::string clientId; // MQTT client ID
+		std::vector<std::string> filters; // Subscriptions
+		bool hasWill = false; // Last will is set
+		Message will; // Last will
+	};
+
+	void route(const Message& message); // Deliver a message which arrived at the broker
+	void close(Session* session, bool sendWill); // Remove a session
+
+	bool up = true; // Broker accepts connections
+	std::vector<std::shared_ptr<Endpoint>> endpoints; // Open network connections
+	std::map<Session*, Client> clients; // Connected sessions
+	std::map<std::string, Message> retainedMessages; // Retained messages by topic
+	std::vector<std::pair<std::string, Handler>> observers; // Observers with their filters
+};
+
+extern Broker broker;
+
+} // namespace sim
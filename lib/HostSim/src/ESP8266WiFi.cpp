@@ -0,0 +1,271 @@
+#include "ESP8266WiFi.h"
+#include "Broker.h"
+#include "Fiber.h"
+#include "HostSim.h"
+#include "flash_hal.h"
+
+ESP8266WiFiClass WiFi;
+EspClass ESP;
+
+namespace sim {
+
+Network network;
+Memory memory;
+Flash flash;
+uint32_t chipId = 0x00c0ffee;
+
+namespace {
+
+const uint8_t BSSID[6] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x01}; // BSSID of the simulated access point
+const int32_t CHANNEL = 6; // Channel of the simulated access point
+
+bool associated = false; // Station is associated with the access point
+uint64_t attempt = 0; // Number of the current association attempt
+WiFiSleepType_t sleepMode = WIFI_MODEM_SLEEP; // Default of the ESP8266 SDK
+uint32_t rtcMemory[128]; // RTC user memory, 512 bytes
+uint8_t flashMemory[FS_PHYS_SIZE]; // File system region of the flash
+
+bool flashRange(uint32_t address, size_t size) { // Access lies within the simulated region and is word aligned
+	return address >= FS_PHYS_ADDR && address - FS_PHYS_ADDR + size <= sizeof(flashMemory) && address % 4 == 0 && size % 4 == 0;
+}
+
+} // namespace
+
+void resetNetwork() {
+	network = Network();
+	memory = Memory();
+	flash = Flash();
+	associated = false;
+	attempt++;
+	sleepMode = WIFI_MODEM_SLEEP;
+	memset(rtcMemory, 0xff, sizeof(rtcMemory)); // Undefined content after power-up
+	memset(flashMemory, 0xff, sizeof(flashMemory)); // Erased flash of a new module
+}
+
+void stallNetwork(uint64_t duration) {
+	uint64_t until = virtualClock.now() + duration;
+	if (until > network.stalledUntil) {
+		network.stalledUntil = until;
+	}
+}
+
+uint64_t networkDelay() {
+	if (virtualClock.now() >= network.stalledUntil) { // Stall is over, buffered data has been sent
+		network.unacknowledged = 0;
+		return 0;
+	}
+	return network.stalledUntil - virtualClock.now();
+}
+
+uint64_t association() {
+	return (associated && network.available) ? attempt : 0;
+}
+
+bool linkUp(uint64_t id) {
+	return id != 0 && association() == id;
+}
+
+} // namespace sim
+
+size_t IPAddress::printTo(Print& p) const {
+	size_t n = 0;
+	for (int i = 0; i < 4; i++) {
+		n += p.print(bytes[i], DEC);
+		if (i < 3) {
+			n += p.print('.');
+		}
+	}
+	return n;
+}
+
+bool ESP8266WiFiClass::mode(WiFiMode_t) {
+	return true;
+}
+
+wl_status_t ESP8266WiFiClass::begin(const char*, const char*, int32_t channel, const uint8_t* bssid, bool connect) {
+	sim::associated = false;
+	uint64_t attempt = ++sim::attempt; // Later attempts cancel this one
+	if (!connect) {
+		return WL_DISCONNECTED;
+	}
+	bool known = channel == sim::CHANNEL && bssid && memcmp(bssid, sim::BSSID, sizeof(sim::BSSID)) == 0; // Scan can be skipped
+	if (channel != 0 && !known) { // Wrong access point never answers
+		return WL_DISCONNECTED;
+	}
+	sim::virtualClock.scheduleIn(known ? sim::network.fastConnectTime : sim::network.connectTime, [attempt]() {
+		if (attempt == sim::attempt && sim::network.available) {
+			sim::associated = true;
+		}
+	});
+	return WL_DISCONNECTED;
+}
+
+bool ESP8266WiFiClass::disconnect(bool) {
+	sim::associated = false;
+	sim::attempt++;
+	return true;
+}
+
+wl_status_t ESP8266WiFiClass::status() {
+	return (sim::associated && sim::network.available) ? WL_CONNECTED : WL_DISCONNECTED;
+}
+
+IPAddress ESP8266WiFiClass::localIP() {
+	return (status() == WL_CONNECTED) ? IPAddress(192, 168, 0, 100) : IPAddress();
+}
+
+int32_t ESP8266WiFiClass::channel() {
+	return sim::CHANNEL;
+}
+
+uint8_t* ESP8266WiFiClass::BSSID() {
+	return const_cast<uint8_t*>(sim::BSSID);
+}
+
+int32_t ESP8266WiFiClass::RSSI() {
+	return sim::network.rssi;
+}
+
+bool ESP8266WiFiClass::setSleepMode(WiFiSleepType_t type, uint8_t) {
+	sim::sleepMode = type;
+	return true;
+}
+
+WiFiSleepType_t ESP8266WiFiClass::getSleepMode() {
+	return sim::sleepMode;
+}
+
+bool EspClass::rtcUserMemoryRead(uint32_t offset, uint32_t* data, size_t size) {
+	if (offset * 4 + size > sizeof(sim::rtcMemory) || size % 4) {
+		return false;
+	}
+	memcpy(data, sim::rtcMemory + offset, size);
+	return true;
+}
+
+bool EspClass::rtcUserMemoryWrite(uint32_t offset, uint32_t* data, size_t size) {
+	if (offset * 4 + size > sizeof(sim::rtcMemory) || size % 4) {
+		return false;
+	}
+	memcpy(sim::rtcMemory + offset, data, size);
+	return true;
+}
+
+void EspClass::deepSleep(uint64_t time_us, RFMode) {
+	throw sim::DeepSleep(time_us);
+}
+
+uint64_t EspClass::deepSleepMax() {
+	return 12000000000ULL; // Depends on the RTC calibration, about 3.3 h
+}
+
+uint32_t EspClass::getChipId() {
+	return sim::chipId;
+}
+
+uint32_t EspClass::getCycleCount() {
+	return sim::virtualClock.now() * getCpuFreqMHz();
+}
+
+uint32_t EspClass::getFreeHeap() {
+	return sim::memory.freeHeap;
+}
+
+uint32_t EspClass::getMaxFreeBlockSize() {
+	return sim::memory.maxFreeBlock;
+}
+
+uint8_t EspClass::getHeapFragmentation() {
+	return (sim::memory.freeHeap > 0) ? 100 - (uint64_t) sim::memory.maxFreeBlock * 100 / sim::memory.freeHeap : 0;
+}
+
+uint32_t EspClass::getFreeContStack() {
+	return sim::memory.freeContStack;
+}
+
+bool EspClass::flashEraseSector(uint32_t sector) {
+	if (!sim::flashRange(sector * FLASH_SECTOR_SIZE, FLASH_SECTOR_SIZE)) {
+		return false;
+	}
+	sim::sleepUntil(sim::virtualClock.now() + sim::flash.eraseTime); // The CPU waits for the flash
+	memset(sim::flashMemory + sector * FLASH_SECTOR_SIZE - FS_PHYS_ADDR, 0xff, FLASH_SECTOR_SIZE);
+	sim::flash.erases++;
+	return true;
+}
+
+bool EspClass::flashWrite(uint32_t address, const uint32_t* data, size_t size) {
+	if (!sim::flashRange(address, size)) {
+		return false;
+	}
+	const uint8_t* bytes = (const uint8_t*) data;
+	for (size_t i = 0; i < size; i++) {
+		sim::flashMemory[address - FS_PHYS_ADDR + i] &= bytes[i]; // Programming only clears bits
+	}
+	sim::flash.writes++;
+	return true;
+}
+
+bool EspClass::flashRead(uint32_t address, uint32_t* data, size_t size) {
+	if (!sim::flashRange(address, size)) {
+		return false;
+	}
+	memcpy(data, sim::flashMemory + address - FS_PHYS_ADDR, size);
+	return true;
+}
+
+void EspClass::restart() {
+	throw sim::DeepSleep(0);
+}
+
+int WiFiClient::connect(const char*, uint16_t) {
+	socket.close();
+	uint64_t link = sim::association();
+	if (!link) {
+		return 0;
+	}
+	sim::sleepUntil(sim::virtualClock.now() + 2 * sim::network.latency + sim::networkDelay()); // SYN and SYN-ACK round trip
+	if (!sim::linkUp(link) || !sim::broker.online()) { // Connection refused
+		return 0;
+	}
+	sim::Socket server;
+	sim::Socket::pair(socket, server, {[link]() { return sim::linkUp(link); }, []() { return sim::network.latency + sim::networkDelay(); }});
+	sim::broker.accept(server);
+	return 1;
+}
+
+size_t WiFiClient::write(const uint8_t* buffer, size_t size) {
+	if (!connected()) {
+		return 0;
+	}
+	if (sim::networkDelay() > 0) { // Network stalled, the bytes wait in the TCP send buffer
+		sim::network.unacknowledged += size;
+		if (sim::network.unacknowledged > sim::network.sendBuffer) { // Send buffer full, write blocks until the stall ends
+			sim::sleepUntil(sim::network.stalledUntil);
+		}
+	}
+	return socket.write(buffer, size);
+}
+
+int WiFiClient::available() {
+	return socket.available();
+}
+
+int WiFiClient::read() {
+	return socket.read();
+}
+
+int WiFiClient::read(uint8_t* buffer, size_t size) {
+	return socket.read(buffer, size);
+}
+
+int WiFiClient::peek() {
+	return socket.peek();
+}
+
+void WiFiClient::stop() {
+	socket.close();
+}
+
+uint8_t WiFiClient::connected() {
+	return socket.open() || socket.available(); // Received bytes can still be read after the connection was closed
+}
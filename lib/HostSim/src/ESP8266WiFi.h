@@ -0,0 +1,174 @@
+/*
+ * ESP8266 WiFi and system interface for the host simulation
+ *
+ * The simulated access point is controlled by sim::network.
+ * Associating takes virtual time, which is shorter if the
+ * channel and BSSID are known, as on the real hardware.
+ * WiFiClient connects to the in-process broker through a
+ * simulated TCP connection.
+ */
+
+#pragma once
+
+#include "Arduino.h"
+#include "Socket.h"
+
+typedef enum WiFiMode {
+	WIFI_OFF = 0,
+	WIFI_STA = 1,
+	WIFI_AP = 2,
+	WIFI_AP_STA = 3
+} WiFiMode_t;
+
+typedef enum WiFiSleepType {
+	WIFI_NONE_SLEEP = 0,
+	WIFI_LIGHT_SLEEP = 1,
+	WIFI_MODEM_SLEEP = 2
+} WiFiSleepType_t;
+
+typedef enum {
+	WL_IDLE_STATUS = 0,
+	WL_NO_SSID_AVAIL = 1,
+	WL_CONNECTED = 3,
+	WL_CONNECT_FAILED = 4,
+	WL_DISCONNECTED = 6
+} wl_status_t;
+
+enum RFMode {
+	RF_DEFAULT = 0,
+	RF_CAL = 1,
+	RF_NO_CAL = 2,
+	RF_DISABLED = 4
+};
+#define WAKE_RF_DEFAULT RF_DEFAULT
+#define WAKE_RFCAL RF_CAL
+#define WAKE_NO_RFCAL RF_NO_CAL
+#define WAKE_RF_DISABLED RF_DISABLED
+
+class IPAddress : public Printable {
+public:
+	IPAddress() : IPAddress(0, 0, 0, 0) {}
+	IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) : bytes{a, b, c, d} {}
+	uint8_t operator[](int index) const { return bytes[index]; }
+	uint8_t* raw_address() { return bytes; }
+	size_t printTo(Print& p) const override;
+
+private:
+	uint8_t bytes[4];
+};
+
+class ESP8266WiFiClass {
+public:
+	bool mode(WiFiMode_t mode);
+	wl_status_t begin(const char* ssid, const char* passphrase = nullptr, int32_t channel = 0, const uint8_t* bssid = nullptr, bool connect = true);
+	bool disconnect(bool wifioff = false);
+	wl_status_t status();
+	IPAddress localIP();
+	int32_t channel();
+	uint8_t* BSSID();
+	int32_t RSSI();
+	bool setSleepMode(WiFiSleepType_t type, uint8_t listenInterval = 0);
+	WiFiSleepType_t getSleepMode();
+	void persistent(bool) {}
+};
+
+extern ESP8266WiFiClass WiFi;
+
+class EspClass {
+public:
+	bool rtcUserMemoryRead(uint32_t offset, uint32_t* data, size_t size);
+	bool rtcUserMemoryWrite(uint32_t offset, uint32_t* data, size_t size);
+	[[noreturn]] void deepSleep(uint64_t time_us, RFMode mode = RF_DEFAULT);
+	uint64_t deepSleepMax();
+	uint32_t getChipId();
+	uint32_t getCycleCount(); // CPU cycles at 80 MHz derived from the virtual clock
+	uint8_t getCpuFreqMHz() { return 80; }
+	uint32_t getFreeHeap(); // Heap figures are taken from sim::memory
+	uint32_t getMaxFreeBlockSize();
+	uint8_t getHeapFragmentation();
+	uint32_t getFreeContStack();
+	bool flashEraseSector(uint32_t sector); // Only the file system region is simulated, see sim::flash
+	bool flashWrite(uint32_t address, const uint32_t* data, size_t size);
+	bool flashRead(uint32_t address, uint32_t* data, size_t size);
+	void restart();
+};
+
+extern EspClass ESP;
+
+class WiFiClient {
+public:
+	int connect(const char* host, uint16_t port); // Connect to the in-process broker, the port is ignored
+	size_t write(uint8_t byte) { return write(&byte, 1); }
+	size_t write(const uint8_t* buffer, size_t size);
+	int available();
+	int read();
+	int read(uint8_t* buffer, size_t size);
+	int peek();
+	void flush() {}
+	void stop();
+	uint8_t connected();
+	operator bool() { return connected(); }
+
+private:
+	sim::Socket socket; // Connection to the broker
+};
+
+namespace sim {
+
+/*
+ * Simulated access point
+ */
+struct Network {
+	bool available = true; // Access point is reachable
+	uint64_t connectTime = 1500000; // Time to associate including a scan in us
+	uint64_t fastConnectTime = 300000; // Time to associate with known channel and BSSID in us
+	int32_t rssi = -60; // Signal strength in dBm
+	uint64_t latency = 2000; // One-way latency between station and broker in us
+	uint64_t stalledUntil = 0; // All traffic is held back until this virtual time in us
+	uint32_t sendBuffer = 2920; // TCP send buffer, writes block once it is filled during a stall
+	uint32_t unacknowledged = 0; // Bytes written during the current stall
+};
+
+extern Network network;
+
+/*
+ * Memory figures of the simulated ESP8266
+ *
+ * The firmware runs in the memory of the host, so the figures
+ * reported by ESP are not measured. They default to typical
+ * values of the firmware on an ESP-01 and can be set by the
+ * simulation tools.
+ */
+struct Memory {
+	uint32_t freeHeap = 42000; // Free heap in bytes
+	uint32_t maxFreeBlock = 36000; // Largest free heap block in bytes
+	uint32_t freeContStack = 2600; // Minimum free stack of loop() since boot in bytes
+};
+
+extern Memory memory;
+extern uint32_t chipId; // Value returned by ESP.getChipId()
+
+/*
+ * Flash of the simulated ESP8266
+ *
+ * Only the file system region given by flash_hal.h is simulated.
+ * As on the real flash, erasing sets a sector to 0xff and writing
+ * can only clear bits. Erasing blocks the firmware for the given
+ * virtual time, writes take a few us and are not modelled. The
+ * content survives deep sleep and is erased by resetNetwork().
+ */
+struct Flash {
+	uint64_t eraseTime = 40000; // Time to erase a sector in us
+	uint32_t erases = 0; // Number of sector erases
+	uint32_t writes = 0; // Number of write operations
+};
+
+extern Flash flash;
+
+void resetNetwork(); // Reset access point, WiFi state, RTC memory, flash and memory figures
+void stallNetwork(uint64_t duration); // Hold back all traffic for the given duration in us
+uint64_t networkDelay(); // Remaining stall time in us
+uint64_t association(); // Identifies the current WiFi association, 0 if not associated
+bool linkUp(uint64_t association); // The given WiFi association is still up
+
+} // namespace sim
@@ -0,0 +1,73 @@
+#include "Fiber.h"
+#include "VirtualClock.h"
+
+#include <algorithm>
+
+namespace sim {
+
+namespace {
+
+Fiber* running = nullptr; // Fiber currently executing
+
+} // namespace
+
+Fiber::Fiber(std::function<void()> body, size_t stackSize) : body(body), stack(new char[stackSize]), stackSize(stackSize) {
+}
+
+void Fiber::start(uint64_t at) {
+	getcontext(&context);
+	context.uc_stack.ss_sp = stack.get();
+	context.uc_stack.ss_size = stackSize;
+	context.uc_link = &caller; // Return to the event loop when the body finishes
+	makecontext(&context, entry, 0);
+	virtualClock.schedule(at, [this]() { resume(); });
+}
+
+Fiber* Fiber::current() {
+	return running;
+}
+
+void Fiber::entry() {
+	running->body();
+	running->done = true;
+	running = nullptr;
+}
+
+void Fiber::resume() {
+	running = this;
+	swapcontext(&caller, &context);
+	running = nullptr;
+}
+
+void Fiber::suspend() {
+	swapcontext(&context, &caller);
+}
+
+void sleepUntil(uint64_t at) {
+	Fiber* fiber = running;
+	if (!fiber) { // Event loop, advance the clock
+		virtualClock.advanceTo(at);
+		return;
+	}
+	virtualClock.schedule(at, [fiber]() { fiber->resume(); });
+	fiber->suspend();
+}
+
+bool waitUntil(std::function<bool()> ready, uint64_t deadline) {
+	while (!ready()) {
+		if (virtualClock.now() >= deadline) {
+			return false;
+		}
+		if (running) { // Let the other fibers run until something may have changed, time must move on for waiting fibers
+			sleepUntil(std::min(deadline, std::max(virtualClock.nextEvent(), virtualClock.now() + 1)));
+		} else if (virtualClock.nextEvent() > deadline) { // Nothing will change in time
+			virtualClock.advanceTo(deadline);
+			return ready();
+		} else {
+			virtualClock.step();
+		}
+	}
+	return true;
+}
+
+} // namespace sim
@@ -0,0 +1,50 @@
+/*
+ * Cooperative fibers on the virtual clock
+ *
+ * The fleet simulation runs many copies of the firmware in one
+ * process, each in a fiber with its own stack. Waiting inside a
+ * fiber suspends it until the virtual clock reaches the wake up
+ * time, so the other fibers and events keep running. Outside of
+ * a fiber, waiting advances the virtual clock instead.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+
+#include <ucontext.h>
+
+namespace sim {
+
+class Fiber {
+public:
+	explicit Fiber(std::function<void()> body, size_t stackSize = 256 * 1024);
+	Fiber(const Fiber&) = delete;
+	Fiber& operator=(const Fiber&) = delete;
+
+	void start(uint64_t at); // Start the fiber at the given virtual time in us
+	bool finished() const { return done; } // Body has returned
+	static Fiber* current(); // Running fiber, nullptr outside of fibers
+
+private:
+	friend void sleepUntil(uint64_t at);
+
+	static void entry(); // First function executed on the fiber stack
+	void resume(); // Switch to the fiber until it waits or finishes
+	void suspend(); // Switch back to the event loop
+
+	std::function<void()> body; // Function executed by the fiber
+	std::unique_ptr<char[]> stack; // Fiber stack, left uninitialized so unused pages are not committed
+	size_t stackSize; // Size of the stack in bytes
+	ucontext_t context; // Saved state of the fiber
+	ucontext_t caller; // Saved state of the event loop
+	bool done = false; // Body has returned
+};
+
+void sleepUntil(uint64_t at); // Wait until the given virtual time in us
+bool waitUntil(std::function<bool()> ready, uint64_t deadline); // Wait until ready() holds or the deadline passes, returns ready()
+
+} // namespace sim
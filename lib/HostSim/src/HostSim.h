@@ -0,0 +1,56 @@
+/*
+ * Host simulation control
+ *
+ * This header is used by the simulation tools to drive the
+ * firmware. The firmware itself only sees the Arduino, WiFi
+ * and MQTT interfaces and runs unmodified.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <stdexcept>
+
+#include "VirtualClock.h"
+
+// Firmware entry points
+void setup();
+void loop();
+
+namespace sim {
+
+/*
+ * Deep sleep request of the firmware
+ *
+ * ESP.deepSleep() never returns on the ESP8266. On the host,
+ * it throws this exception to end the simulated boot.
+ */
+struct DeepSleep : std::runtime_error {
+	uint64_t duration; // Requested sleep duration in us
+	explicit DeepSleep(uint64_t duration) : std::runtime_error("deep sleep"), duration(duration) {}
+};
+
+extern uint64_t loopTime; // Virtual time consumed by each loop() iteration in us
+extern FILE* serialOutput; // Destination of the serial interface, nullptr to discard
+
+// Pins
+int pinLevel(uint8_t pin); // Level of the given pin
+double pinDuty(uint8_t pin); // Duty cycle of the given pin, 0 or 1 without PWM
+void setPinLevel(uint8_t pin, int level); // Drive an input pin, triggering attached interrupts
+void onPinWrite(std::function<void(uint8_t pin, int level)> handler); // Observe output pin changes
+bool interruptAttached(uint8_t pin); // An interrupt handler is attached to the given pin
+
+/*
+ * Run the firmware loop
+ *
+ * Calls loop() repeatedly for the given virtual duration or
+ * until the given condition is met. Each iteration consumes
+ * loopTime. Returns true if the condition was met.
+ */
+bool run(uint64_t duration, std::function<bool()> until = nullptr);
+
+void reset(); // Reset clock, pins, network and broker
+
+} // namespace sim
@@ -0,0 +1,84 @@
+#include "Mqtt.h"
+
+#include <algorithm>
+
+namespace sim {
+namespace mqtt {
+
+std::string encode(uint8_t header, const std::string& body) {
+	std::string packet(1, (char) header);
+	size_t length = body.size();
+	do { // Remaining length, 7 bits per byte with continuation bit
+		uint8_t digit = length % 128;
+		length /= 128;
+		packet += (char) (digit | ((length > 0) ? 0x80 : 0));
+	} while (length > 0);
+	return packet + body;
+}
+
+size_t parse(const std::string& data, Packet& packet) {
+	size_t length = 0, multiplier = 1, position = 1;
+	for (;;) {
+		if (position >= data.size()) {
+			return 0;
+		}
+		uint8_t digit = data[position++];
+		length += (digit & 0x7f) * multiplier;
+		if (!(digit & 0x80)) {
+			break;
+		}
+		multiplier *= 128;
+		if (position > 4) { // Remaining length has at most four bytes
+			return MALFORMED;
+		}
+	}
+	if (data.size() < position + length) {
+		return 0;
+	}
+	packet.header = data[0];
+	packet.body.assign(data, position, length);
+	return position + length;
+}
+
+void appendWord(std::string& body, uint16_t value) {
+	body += (char) (value >> 8);
+	body += (char) (value & 0xff);
+}
+
+void appendString(std::string& body, const std::string& value) {
+	appendWord(body, value.size());
+	body += value;
+}
+
+uint8_t Reader::byte() {
+	if (position >= body.size()) {
+		ok = false;
+		return 0;
+	}
+	return body[position++];
+}
+
+uint16_t Reader::word() {
+	uint16_t high = byte();
+	return (high << 8) | byte();
+}
+
+std::string Reader::string() {
+	size_t length = word();
+	if (position + length > body.size()) {
+		ok = false;
+		position = body.size();
+		return "";
+	}
+	position += length;
+	return body.substr(position - length, length);
+}
+
+std::string Reader::rest() {
+	std::string remaining = body.substr(std::min(position, body.size()));
+	position = body.size();
+	return remaining;
+}
+
+} // namespace mqtt
+} // namespace sim
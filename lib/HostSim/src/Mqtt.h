@@ -0,0 +1,75 @@
+/*
+ * MQTT 3.1.1 packet encoding for the host simulation
+ *
+ * The simulated PubSubClient and the in-process broker exchange
+ * MQTT 3.1.1 packets over the simulated TCP connection, so the
+ * packet sizes and the framing match the real protocol.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace sim {
+namespace mqtt {
+
+// Control packet types, upper nibble of the fixed header
+const uint8_t CONNECT = 0x10;
+const uint8_t CONNACK = 0x20;
+const uint8_t PUBLISH = 0x30;
+const uint8_t PUBACK = 0x40;
+const uint8_t SUBSCRIBE = 0x80;
+const uint8_t SUBACK = 0x90;
+const uint8_t UNSUBSCRIBE = 0xa0;
+const uint8_t UNSUBACK = 0xb0;
+const uint8_t PINGREQ = 0xc0;
+const uint8_t PINGRESP = 0xd0;
+const uint8_t DISCONNECT = 0xe0;
+
+// CONNECT flags
+const uint8_t CLEAN_SESSION = 0x02;
+const uint8_t WILL = 0x04;
+const uint8_t WILL_RETAIN = 0x20;
+const uint8_t PASSWORD = 0x40;
+const uint8_t USERNAME = 0x80;
+
+const size_t MALFORMED = SIZE_MAX; // Result of parse() for an invalid fixed header
+
+struct Packet {
+	uint8_t header = 0; // First byte of the fixed header
+	std::string body; // Variable header and payload
+	uint8_t type() const { return header & 0xf0; }
+};
+
+std::string encode(uint8_t header, const std::string& body); // Add the fixed header to the body
+size_t parse(const std::string& data, Packet& packet); // Bytes consumed by the first complete packet, 0 if incomplete
+void appendWord(std::string& body, uint16_t value); // Append a two byte integer
+void appendString(std::string& body, const std::string& value); // Append a length prefixed string
+
+/*
+ * Reader for the fields of a packet body
+ *
+ * Reading beyond the end of the body yields empty values
+ * and clears the valid flag.
+ */
+class Reader {
+public:
+	explicit Reader(const std::string& body) : body(body) {}
+
+	uint8_t byte(); // Read a byte
+	uint16_t word(); // Read a two byte integer
+	std::string string(); // Read a length prefixed string
+	std::string rest(); // Read all remaining bytes
+	bool empty() const { return position >= body.size(); } // All bytes have been read
+	bool valid() const { return ok; } // No read went beyond the end of the body
+
+private:
+	const std::string& body; // Packet body
+	size_t position = 0; // Read position
+	bool ok = true; // No read went beyond the end of the body
+};
+
+} // namespace mqtt
+} // namespace sim
@@ -0,0 +1,90 @@
+#include "PlantModel.h"
+
+#include <cmath>
+
+#include "Arduino.h"
+#include "HostSim.h"
+
+namespace sim {
+
+PlantModel::PlantModel(const PlantParameters& parameters, uint64_t seed) : parameters(parameters), random(seed) {
+}
+
+void PlantModel::attach(uint8_t pump, uint8_t meter) {
+	pumpPin = pump;
+	meterPin = meter;
+	setPinLevel(meterPin, HIGH); // Open collector output with pull-up
+	onPinWrite([this](uint8_t pin, int level) {
+		if (pin == pumpPin && level == HIGH && !running) { // Pump started
+			running = true;
+			virtualClock.scheduleIn(0, [this]() { step(); });
+		}
+	});
+}
+
+void PlantModel::resetCounters() {
+	pumped = 0.0;
+	delivered = 0.0;
+	pulseCount = 0;
+	firstPulse = 0;
+}
+
+double PlantModel::flowAt(double speed) const {
+	double ratio = speed * speed - parameters.head / parameters.shutoffHead; // Affinity laws: head scales with the speed squared
+	return (ratio > 0.0) ? parameters.maxFlow * std::sqrt(ratio) : 0.0;
+}
+
+double PlantModel::kFactorAt(double flow) const {
+	double linear = 1.0 + parameters.kFactorSlope * (flow - parameters.nominalFlow);
+	double lowFlow = 1.0 - parameters.lowFlowLoss * std::exp(-flow / parameters.lowFlowKnee);
+	double nominal = 1.0 - parameters.lowFlowLoss * std::exp(-parameters.nominalFlow / parameters.lowFlowKnee);
+	return parameters.kFactor * linear * lowFlow / nominal; // Equals the nominal K-factor at the nominal flow
+}
+
+void PlantModel::step() {
+	double dt = parameters.step / 1e6; // Step in s
+	double drive = pinDuty(pumpPin); // Mean drive of the PWM output
+	double timeConstant = (drive > currentSpeed) ? parameters.spinUpTime : parameters.coastDownTime;
+	currentSpeed += (drive - currentSpeed) * (1.0 - std::exp(-dt / timeConstant));
+	currentFlow = flowAt(currentSpeed);
+
+	double volume = currentFlow / 60.0 * 1000.0 * dt; // Volume pumped during this step in ml
+	pumped += volume;
+	double filling = std::min(volume, parameters.primingVolume - tubing); // Water filling the tubing
+	tubing += filling;
+	delivered += volume - filling;
+
+	if (currentFlow >= parameters.minFlow) { // Rotor turns
+		double increment = volume / 1000.0 * kFactorAt(currentFlow); // Rotor movement during this step in pulses
+		uint64_t start = virtualClock.now();
+		std::normal_distribution<double> jitter(0.0, parameters.jitter);
+		phase += increment;
+		while (phase >= 1.0) { // Pulse within this step
+			phase -= 1.0;
+			double period = parameters.step / increment; // Pulse period in us
+			double at = start + parameters.step * (1.0 - phase / increment) + jitter(random) * period;
+			uint64_t time = std::max<uint64_t>(std::max(at, (double) start), lastPulse + 1); // Pulses keep their order
+			lastPulse = time;
+			virtualClock.schedule(time, [this]() {
+				setPinLevel(meterPin, LOW); // Falling edge triggers the interrupt
+				setPinLevel(meterPin, HIGH);
+				pulseCount++;
+				if (!firstPulse) {
+					firstPulse = virtualClock.now();
+				}
+			});
+		}
+	}
+
+	if (drive == 0.0 && currentFlow == 0.0 && currentSpeed < 0.01) { // Pump stopped
+		currentSpeed = 0.0;
+		running = false;
+		if (parameters.drainBack) { // Tubing runs empty
+			tubing = 0.0;
+		}
+		return;
+	}
+	virtualClock.scheduleIn(parameters.step, [this]() { step(); });
+}
+
+} // namespace sim
@@ -0,0 +1,86 @@
+/*
+ * Hydraulic plant model for the host simulation
+ *
+ * The model simulates the pump, the tubing and the flow meter
+ * on the virtual clock and generates falling edges on the flow
+ * meter pin, which trigger the interrupt handler of the firmware.
+ *
+ * Pump: the speed follows the drive level, the duty cycle of a
+ *   PWM output, with separate time constants for spin-up and
+ *   coast-down. The flow follows the
+ *   pump curve H = H0 * s^2 * (1 - (Q / Qmax)^2) for the speed s
+ *   against the static head of the installation.
+ * Tubing: the first water pumped fills the tubing behind the flow
+ *   meter and does not reach the plant. The tubing optionally drains
+ *   back after every run.
+ * Flow meter: the K-factor depends on the flow rate and drops at low
+ *   flow, below a minimum flow the rotor stalls. Pulse times are
+ *   subject to normally distributed jitter.
+ *
+ * All random numbers are drawn from a seeded generator, so every
+ * simulation run is reproducible.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <random>
+
+namespace sim {
+
+struct PlantParameters {
+	double maxFlow = 2.0; // Flow at full speed without head in l/min
+	double shutoffHead = 3.0; // Head at full speed without flow in m
+	double head = 0.5; // Static head of the installation in m
+	double spinUpTime = 0.15; // Time constant of the pump speed when starting in s
+	double coastDownTime = 0.4; // Time constant of the pump speed when stopping in s
+	double primingVolume = 15.0; // Volume of the tubing behind the flow meter in ml
+	bool drainBack = true; // Tubing drains after every run
+	double kFactor = 1925.0; // Nominal flow meter pulses per liter (DIGMESA FHKSC)
+	double kFactorSlope = 0.02; // Relative change of the K-factor per l/min above nominalFlow
+	double nominalFlow = 1.5; // Flow of the nominal K-factor in l/min
+	double lowFlowLoss = 0.15; // Relative K-factor loss towards zero flow
+	double lowFlowKnee = 0.3; // Flow at which the low flow loss decays by 1/e in l/min
+	double minFlow = 0.05; // Flow below which the rotor stalls in l/min
+	double jitter = 0.05; // Standard deviation of the pulse times relative to the pulse period
+	uint64_t step = 1000; // Integration step in us
+};
+
+class PlantModel {
+public:
+	explicit PlantModel(const PlantParameters& parameters = PlantParameters(), uint64_t seed = 1);
+
+	void attach(uint8_t pumpPin, uint8_t meterPin); // Connect the model to the pins of the firmware
+	void resetCounters(); // Reset all volume and pulse counters
+
+	double flowAt(double speed) const; // Flow for the given pump speed in l/min
+	double kFactorAt(double flow) const; // Flow meter pulses per liter at the given flow in l/min
+
+	double speed() const { return currentSpeed; } // Pump speed relative to full speed
+	double flow() const { return currentFlow; } // Current flow in l/min
+	uint64_t pulses() const { return pulseCount; } // Flow meter pulses generated
+	double pumpedVolume() const { return pumped; } // Volume through the flow meter in ml
+	double deliveredVolume() const { return delivered; } // Volume which reached the plant in ml
+	uint64_t firstPulseTime() const { return firstPulse; } // Virtual time of the first pulse in us, 0 if none
+
+	const PlantParameters parameters; // Model parameters
+
+private:
+	void step(); // Integrate the model over one step and schedule the pulses within it
+
+	uint8_t pumpPin = 0; // Pin driving the pump
+	uint8_t meterPin = 0; // Pin of the flow meter
+	bool running = false; // Integration steps are scheduled
+	double currentSpeed = 0.0; // Pump speed relative to full speed
+	double currentFlow = 0.0; // Flow in l/min
+	double phase = 0.0; // Rotor position in pulses since the last pulse
+	double tubing = 0.0; // Water in the tubing behind the flow meter in ml
+	double pumped = 0.0; // Volume through the flow meter in ml
+	double delivered = 0.0; // Volume which reached the plant in ml
+	uint64_t pulseCount = 0; // Flow meter pulses generated
+	uint64_t lastPulse = 0; // Virtual time of the last pulse in us
+	uint64_t firstPulse = 0; // Virtual time of the first pulse in us
+	std::mt19937_64 random; // Random number generator for the pulse jitter
+};
+
+} // namespace sim
@@ -0,0 +1,296 @@
+#include "PubSubClient.h"
+#include "Fiber.h"
+#include "Mqtt.h"
+#include "VirtualClock.h"
+
+namespace sim {
+
+MqttIdentity mqttIdentity;
+
+} // namespace sim
+
+PubSubClient& PubSubClient::setServer(const char* domain, uint16_t port) {
+	this->domain = domain ? domain : "";
+	this->port = port;
+	return *this;
+}
+
+PubSubClient& PubSubClient::setCallback(MQTT_CALLBACK_SIGNATURE) {
+	this->callback = callback;
+	return *this;
+}
+
+PubSubClient& PubSubClient::setKeepAlive(uint16_t keepAlive) {
+	this->keepAlive = keepAlive;
+	return *this;
+}
+
+PubSubClient& PubSubClient::setSocketTimeout(uint16_t timeout) {
+	socketTimeout = timeout;
+	return *this;
+}
+
+bool PubSubClient::setBufferSize(uint16_t size) {
+	if (size == 0) {
+		return false;
+	}
+	bufferSize = size;
+	buffer.resize(size);
+	return true;
+}
+
+bool PubSubClient::connect(const char* id) {
+	return connect(id, nullptr, nullptr, nullptr, 0, false, nullptr);
+}
+
+bool PubSubClient::connect(const char* id, const char* user, const char* pass) {
+	return connect(id, user, pass, nullptr, 0, false, nullptr);
+}
+
+bool PubSubClient::connect(const char* id, const char* user, const char* pass, const char* willTopic, uint8_t willQos, bool willRetain, const char* willMessage, bool cleanSession) {
+	if (connected()) {
+		return true;
+	}
+	if (!client->connect(domain.c_str(), port)) { // No TCP connection
+		currentState = MQTT_CONNECT_FAILED;
+		return false;
+	}
+	uint8_t flags = cleanSession ? sim::mqtt::CLEAN_SESSION : 0;
+	std::string body;
+	sim::mqtt::appendString(body, "MQTT");
+	body += (char) MQTT_VERSION_3_1_1;
+	if (willTopic) {
+		flags |= sim::mqtt::WILL | (willQos << 3) | (willRetain ? sim::mqtt::WILL_RETAIN : 0);
+	}
+	if (user) {
+		flags |= sim::mqtt::USERNAME | (pass ? sim::mqtt::PASSWORD : 0);
+	}
+	body += (char) flags;
+	sim::mqtt::appendWord(body, keepAlive);
+	sim::mqtt::appendString(body, id + sim::mqttIdentity.clientIdSuffix);
+	if (willTopic) {
+		sim::mqtt::appendString(body, outbound(willTopic));
+		sim::mqtt::appendString(body, willMessage ? willMessage : "");
+	}
+	if (user) {
+		sim::mqtt::appendString(body, user);
+		if (pass) {
+			sim::mqtt::appendString(body, pass);
+		}
+	}
+	if (MQTT_MAX_HEADER_SIZE + body.size() > bufferSize) { // CONNECT does not fit into the buffer
+		client->stop();
+		return false;
+	}
+	send(sim::mqtt::CONNECT, body);
+	lastInActivity = millis();
+	if (!waitForData()) {
+		currentState = MQTT_CONNECTION_TIMEOUT;
+		client->stop();
+		return false;
+	}
+	size_t length = readPacket();
+	if (length == 4 && (buffer[0] & 0xf0) == sim::mqtt::CONNACK) {
+		if (buffer[3] == 0) {
+			lastInActivity = millis();
+			pingOutstanding = false;
+			currentState = MQTT_CONNECTED;
+			return true;
+		}
+		currentState = buffer[3];
+	}
+	client->stop();
+	return false;
+}
+
+void PubSubClient::disconnect() {
+	send(sim::mqtt::DISCONNECT, "");
+	currentState = MQTT_DISCONNECTED;
+	client->flush();
+	client->stop();
+	lastInActivity = lastOutActivity = millis();
+}
+
+bool PubSubClient::publish(const char* topic, const char* payload) {
+	return publish(topic, (const uint8_t*) payload, payload ? strlen(payload) : 0, false);
+}
+
+bool PubSubClient::publish(const char* topic, const char* payload, bool retained) {
+	return publish(topic, (const uint8_t*) payload, payload ? strlen(payload) : 0, retained);
+}
+
+bool PubSubClient::publish(const char* topic, const uint8_t* payload, unsigned int length) {
+	return publish(topic, payload, length, false);
+}
+
+bool PubSubClient::publish(const char* topic, const uint8_t* payload, unsigned int length, bool retained) {
+	if (!connected()) {
+		return false;
+	}
+	if (MQTT_MAX_HEADER_SIZE + 2 + strlen(topic) + length > bufferSize) { // Packet does not fit into the buffer
+		return false;
+	}
+	std::string body;
+	sim::mqtt::appendString(body, outbound(topic));
+	body.append((const char*) payload, length);
+	return send(sim::mqtt::PUBLISH | (retained ? 1 : 0), body);
+}
+
+bool PubSubClient::subscribe(const char* topic, uint8_t qos) {
+	if (!connected() || qos > 1 || MQTT_MAX_HEADER_SIZE + 2 + 2 + strlen(topic) + 1 > bufferSize) {
+		return false;
+	}
+	std::string body;
+	sim::mqtt::appendWord(body, messageId());
+	sim::mqtt::appendString(body, outbound(topic));
+	body += (char) qos;
+	return send(sim::mqtt::SUBSCRIBE | 0x02, body);
+}
+
+bool PubSubClient::unsubscribe(const char* topic) {
+	if (!connected() || MQTT_MAX_HEADER_SIZE + 2 + 2 + strlen(topic) > bufferSize) {
+		return false;
+	}
+	std::string body;
+	sim::mqtt::appendWord(body, messageId());
+	sim::mqtt::appendString(body, outbound(topic));
+	return send(sim::mqtt::UNSUBSCRIBE | 0x02, body);
+}
+
+bool PubSubClient::loop() {
+	if (!connected()) {
+		return false;
+	}
+	unsigned long now = millis();
+	if (keepAlive && (now - lastInActivity > keepAlive * 1000UL || now - lastOutActivity > keepAlive * 1000UL)) {
+		if (pingOutstanding) { // Broker did not answer the last PINGREQ
+			currentState = MQTT_CONNECTION_TIMEOUT;
+			client->stop();
+			return false;
+		}
+		send(sim::mqtt::PINGREQ, "");
+		lastInActivity = now;
+		pingOutstanding = true;
+	}
+	if (!client->available()) {
+		return true;
+	}
+	size_t length = readPacket(); // Process one packet per call
+	if (length == 0) {
+		return true;
+	}
+	lastInActivity = now;
+	uint8_t type = buffer[0] & 0xf0;
+	if (type == sim::mqtt::PUBLISH) {
+		size_t header = 1; // Fixed header length
+		while (buffer[header] & 0x80) {
+			header++;
+		}
+		header++;
+		size_t topicLength = (buffer[header] << 8) | buffer[header + 1];
+		uint8_t qos = (buffer[0] >> 1) & 3;
+		size_t payloadStart = header + 2 + topicLength + ((qos > 0) ? 2 : 0);
+		if (payloadStart > length) {
+			return true;
+		}
+		uint16_t id = (qos > 0) ? (buffer[header + 2 + topicLength] << 8) | buffer[header + 3 + topicLength] : 0;
+		std::string topic = inbound(std::string((const char*) buffer.data() + header + 2, topicLength));
+		std::string payload((const char*) buffer.data() + payloadStart, length - payloadStart);
+		if (topic.size() + 1 + payload.size() <= bufferSize && callback) { // Topic and terminator in front of the payload
+			memcpy(buffer.data(), topic.c_str(), topic.size() + 1);
+			memcpy(buffer.data() + topic.size() + 1, payload.data(), payload.size());
+			callback((char*) buffer.data(), buffer.data() + topic.size() + 1, payload.size());
+		}
+		if (qos == 1) {
+			std::string body;
+			sim::mqtt::appendWord(body, id);
+			send(sim::mqtt::PUBACK, body);
+		}
+	} else if (type == sim::mqtt::PINGREQ) {
+		send(sim::mqtt::PINGRESP, "");
+	} else if (type == sim::mqtt::PINGRESP) {
+		pingOutstanding = false;
+	}
+	return true;
+}
+
+bool PubSubClient::connected() {
+	if (!client->connected()) {
+		if (currentState == MQTT_CONNECTED) { // Network lost
+			currentState = MQTT_CONNECTION_LOST;
+			client->flush();
+			client->stop();
+		}
+		return false;
+	}
+	return currentState == MQTT_CONNECTED;
+}
+
+bool PubSubClient::send(uint8_t header, const std::string& body) {
+	std::string packet = sim::mqtt::encode(header, body);
+	lastOutActivity = millis();
+	return client->write((const uint8_t*) packet.data(), packet.size()) == packet.size();
+}
+
+std::string PubSubClient::outbound(const char* topic) {
+	const sim::MqttIdentity& identity = sim::mqttIdentity;
+	if (identity.topicPrefix.empty() || strncmp(topic, identity.topicPrefix.c_str(), identity.topicPrefix.size()) != 0) {
+		return topic;
+	}
+	return identity.devicePrefix + (topic + identity.topicPrefix.size());
+}
+
+std::string PubSubClient::inbound(const std::string& topic) {
+	const sim::MqttIdentity& identity = sim::mqttIdentity;
+	if (identity.topicPrefix.empty() || topic.compare(0, identity.devicePrefix.size(), identity.devicePrefix) != 0) {
+		return topic;
+	}
+	return identity.topicPrefix + topic.substr(identity.devicePrefix.size());
+}
+
+uint16_t PubSubClient::messageId() {
+	if (++nextMessageId == 0) { // Packet identifier must not be 0
+		nextMessageId = 1;
+	}
+	return nextMessageId;
+}
+
+bool PubSubClient::waitForData() {
+	sim::waitUntil([this]() { return client->available() || !client->connected(); }, sim::virtualClock.now() + socketTimeout * 1000000ULL);
+	return client->available();
+}
+
+size_t PubSubClient::readPacket() {
+	size_t length = 0; // Bytes of the packet
+	size_t remaining = 0; // Remaining length of the packet
+	uint32_t multiplier = 1;
+	for (int i = 0; i < 5; i++) { // Fixed header and remaining length
+		if (!waitForData()) {
+			return 0;
+		}
+		uint8_t byte = client->read();
+		if (length < bufferSize) {
+			buffer[length] = byte;
+		}
+		length++;
+		if (i == 0) {
+			continue;
+		}
+		remaining += (byte & 0x7f) * multiplier;
+		multiplier *= 128;
+		if (!(byte & 0x80)) {
+			break;
+		}
+	}
+	for (size_t i = 0; i < remaining; i++) { // Variable header and payload
+		if (!waitForData()) {
+			return 0;
+		}
+		uint8_t byte = client->read();
+		if (length < bufferSize) {
+			buffer[length] = byte;
+		}
+		length++;
+	}
+	return (length > bufferSize) ? 0 : length; // Oversized packets are dropped
+}
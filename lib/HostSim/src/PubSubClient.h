@@ -0,0 +1,109 @@
+/*
+ * PubSubClient for the host simulation
+ *
+ * This class provides the interface of the PubSubClient library
+ * and speaks MQTT 3.1.1 over the WiFiClient, which connects to
+ * the in-process broker. Connection states, the packet size
+ * limit, keep alive pings, timeouts and the one-packet-per-loop()
+ * processing behave like the original library. Waiting for a
+ * packet advances the virtual clock instead of spinning.
+ */
+
+#pragma once
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "Arduino.h"
+#include "ESP8266WiFi.h"
+
+#define MQTT_VERSION_3_1_1 4
+#define MQTT_MAX_PACKET_SIZE 256
+#define MQTT_KEEPALIVE 15
+#define MQTT_SOCKET_TIMEOUT 15
+#define MQTT_MAX_HEADER_SIZE 5
+
+// Possible values for client.state()
+#define MQTT_CONNECTION_TIMEOUT -4
+#define MQTT_CONNECTION_LOST -3
+#define MQTT_CONNECT_FAILED -2
+#define MQTT_DISCONNECTED -1
+#define MQTT_CONNECTED 0
+#define MQTT_CONNECT_BAD_PROTOCOL 1
+#define MQTT_CONNECT_BAD_CLIENT_ID 2
+#define MQTT_CONNECT_UNAVAILABLE 3
+#define MQTT_CONNECT_BAD_CREDENTIALS 4
+#define MQTT_CONNECT_UNAUTHORIZED 5
+
+#define MQTT_CALLBACK_SIGNATURE std::function<void(char*, uint8_t*, unsigned int)> callback
+
+namespace sim {
+
+/*
+ * Identity of a simulated device
+ *
+ * All copies of the firmware in the fleet simulation use the
+ * client ID and topics of config.h. The client appends the suffix
+ * to the client ID and replaces the topic prefix in both
+ * directions, so every copy appears as a separate device.
+ */
+struct MqttIdentity {
+	std::string clientIdSuffix; // Appended to the client ID
+	std::string topicPrefix; // Prefix of the topics used by the firmware, empty to disable the rewriting
+	std::string devicePrefix; // Prefix of the topics on the broker
+};
+
+extern MqttIdentity mqttIdentity;
+
+} // namespace sim
+
+class PubSubClient {
+public:
+	explicit PubSubClient(WiFiClient& client) : client(&client) {}
+
+	PubSubClient& setServer(const char* domain, uint16_t port);
+	PubSubClient& setCallback(MQTT_CALLBACK_SIGNATURE);
+	PubSubClient& setKeepAlive(uint16_t keepAlive);
+	PubSubClient& setSocketTimeout(uint16_t timeout);
+	bool setBufferSize(uint16_t size);
+	uint16_t getBufferSize() { return bufferSize; }
+
+	bool connect(const char* id);
+	bool connect(const char* id, const char* user, const char* pass);
+	bool connect(const char* id, const char* user, const char* pass, const char* willTopic, uint8_t willQos, bool willRetain, const char* willMessage, bool cleanSession = true);
+	void disconnect();
+
+	bool publish(const char* topic, const char* payload);
+	bool publish(const char* topic, const char* payload, bool retained);
+	bool publish(const char* topic, const uint8_t* payload, unsigned int length);
+	bool publish(const char* topic, const uint8_t* payload, unsigned int length, bool retained);
+	bool subscribe(const char* topic, uint8_t qos = 0);
+	bool unsubscribe(const char* topic);
+
+	bool loop();
+	bool connected();
+	int state() { return currentState; }
+
+private:
+	bool send(uint8_t header, const std::string& body); // Write a packet to the network
+	static std::string outbound(const char* topic); // Topic on the broker for a topic of the firmware
+	static std::string inbound(const std::string& topic); // Topic of the firmware for a topic on the broker
+	uint16_t messageId(); // Next packet identifier for SUBSCRIBE and UNSUBSCRIBE
+	bool waitForData(); // Wait up to the socket timeout for received bytes
+	size_t readPacket(); // Read a packet into the buffer, 0 if it is invalid or too large
+
+	WiFiClient* client; // Network connection
+	MQTT_CALLBACK_SIGNATURE; // Message handler
+	std::string domain; // Broker host name
+	uint16_t port = 1883; // Broker port
+	uint16_t keepAlive = MQTT_KEEPALIVE; // Keep alive interval in s
+	uint16_t socketTimeout = MQTT_SOCKET_TIMEOUT; // Timeout for reading a packet in s
+	uint16_t bufferSize = MQTT_MAX_PACKET_SIZE; // Maximum packet size
+	std::vector<uint8_t> buffer = std::vector<uint8_t>(MQTT_MAX_PACKET_SIZE); // Packet buffer
+	uint16_t nextMessageId = 0; // Last packet identifier
+	unsigned long lastOutActivity = 0; // Time of the last sent packet in ms
+	unsigned long lastInActivity = 0; // Time of the last received packet in ms
+	bool pingOutstanding = false; // PINGREQ has not been answered yet
+	int currentState = MQTT_DISCONNECTED; // Connection state
+};
@@ -0,0 +1,107 @@
+#include "Socket.h"
+
+#include <algorithm>
+
+#include "VirtualClock.h"
+
+namespace sim {
+
+struct Socket::Connection {
+	Link link; // Network path of the connection
+	bool reset = false; // Connection was reset because the link went down
+	bool closed[2] = {false, false}; // End has closed its direction
+	bool finished[2] = {false, false}; // End received the close of the other direction
+	std::deque<uint8_t> received[2]; // Bytes received by each end
+	Handler handlers[2]; // Receive handlers of each end
+};
+
+void Socket::pair(Socket& client, Socket& server, const Link& link) {
+	auto connection = std::make_shared<Socket::Connection>();
+	connection->link = link;
+	client.connection = connection;
+	client.side = 0;
+	server.connection = connection;
+	server.side = 1;
+}
+
+size_t Socket::write(const uint8_t* data, size_t size) {
+	if (!open() || size == 0) {
+		return 0;
+	}
+	std::shared_ptr<Connection> shared = connection;
+	int peer = 1 - side;
+	std::deque<uint8_t> bytes(data, data + size);
+	virtualClock.scheduleIn(connection->link.delay(), [shared, peer, bytes]() { // Bytes travel to the other end
+		if (shared->reset) {
+			return;
+		}
+		if (!shared->link.up()) { // Link lost, the connection is reset
+			shared->reset = true;
+		} else {
+			shared->received[peer].insert(shared->received[peer].end(), bytes.begin(), bytes.end());
+		}
+		if (shared->handlers[peer]) {
+			shared->handlers[peer]();
+		}
+	});
+	return size;
+}
+
+size_t Socket::available() const {
+	return connection ? connection->received[side].size() : 0;
+}
+
+int Socket::read() {
+	if (!available()) {
+		return -1;
+	}
+	uint8_t byte = connection->received[side].front();
+	connection->received[side].pop_front();
+	return byte;
+}
+
+size_t Socket::read(uint8_t* data, size_t size) {
+	size = std::min(size, available());
+	std::deque<uint8_t>& received = connection->received[side];
+	std::copy(received.begin(), received.begin() + size, data);
+	received.erase(received.begin(), received.begin() + size);
+	return size;
+}
+
+int Socket::peek() const {
+	return available() ? connection->received[side].front() : -1;
+}
+
+void Socket::close() {
+	if (!connection || connection->closed[side]) {
+		return;
+	}
+	connection->closed[side] = true;
+	connection->handlers[side] = nullptr;
+	std::shared_ptr<Connection> shared = connection;
+	int peer = 1 - side;
+	virtualClock.scheduleIn(connection->link.delay(), [shared, peer]() { // FIN travels to the other end
+		if (!shared->link.up()) {
+			shared->reset = true;
+		}
+		shared->finished[peer] = true;
+		if (shared->handlers[peer]) {
+			shared->handlers[peer]();
+		}
+	});
+}
+
+bool Socket::open() const {
+	if (!connection || connection->reset || connection->closed[side] || connection->finished[side]) {
+		return false;
+	}
+	return side == 1 || connection->link.up(); // Station drops its connections when the link goes down
+}
+
+void Socket::onReceive(Handler handler) {
+	if (connection) {
+		connection->handlers[side] = handler;
+	}
+}
+
+} // namespace sim
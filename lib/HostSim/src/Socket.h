@@ -0,0 +1,52 @@
+/*
+ * Simulated TCP connection for the host simulation
+ *
+ * A socket pair connects the WiFiClient of the firmware to
+ * the in-process broker. Written bytes arrive at the other end
+ * after the delay of the link, in the order they were written.
+ * Bytes in flight are lost and the connection is reset if the
+ * link goes down before they arrive. The link is provided by
+ * the WiFi simulation of the station.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+
+namespace sim {
+
+/*
+ * Network path of a connection
+ */
+struct Link {
+	std::function<bool()> up; // Link is still up
+	std::function<uint64_t()> delay; // Transit time of bytes sent now in us
+};
+
+class Socket {
+public:
+	using Handler = std::function<void()>;
+
+	static void pair(Socket& client, Socket& server, const Link& link); // Connect two sockets over the given link
+
+	size_t write(const uint8_t* data, size_t size); // Send bytes to the other end, 0 if the connection is closed
+	size_t available() const; // Number of received bytes
+	int read(); // Read one received byte, -1 if none is available
+	size_t read(uint8_t* data, size_t size); // Read up to size received bytes
+	int peek() const; // Next received byte without removing it, -1 if none is available
+	void close(); // Close the connection, the other end is notified after the latency
+	bool open() const; // Connection is open in both directions
+	void onReceive(Handler handler); // Called when bytes or the end of the connection arrive
+
+private:
+	struct Connection; // State shared by both ends
+
+	std::shared_ptr<Connection> connection; // Connection this socket belongs to, nullptr if never connected
+	int side = 0; // End of the connection, 0 for the client and 1 for the server
+};
+
+} // namespace sim
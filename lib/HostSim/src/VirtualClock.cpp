@@ -0,0 +1,41 @@
+#include "VirtualClock.h"
+
+namespace sim {
+
+VirtualClock virtualClock;
+
+void VirtualClock::schedule(uint64_t at, Callback callback) {
+	events.push({(at < time) ? time : at, sequence++, callback}); // Events in the past are due immediately
+}
+
+void VirtualClock::advanceTo(uint64_t target) {
+	while (!events.empty() && events.top().time <= target) { // Execute all events due until target
+		step();
+	}
+	if (target > time) { // Time never runs backwards
+		time = target;
+	}
+}
+
+bool VirtualClock::step() {
+	if (events.empty()) { // Nothing to do
+		return false;
+	}
+	Event event = events.top(); // Copy event, the handler may schedule new events
+	events.pop();
+	time = event.time; // Jump to due time
+	event.callback(); // Execute event handler
+	return true;
+}
+
+uint64_t VirtualClock::nextEvent() const {
+	return events.empty() ? UINT64_MAX : events.top().time;
+}
+
+void VirtualClock::reset() {
+	events = decltype(events)();
+	time = 0;
+	sequence = 0;
+}
+
+} // namespace sim
@@ -0,0 +1,57 @@
+/*
+ * Virtual clock for the host simulation
+ *
+ * The virtual clock replaces the system time of the ESP8266.
+ * It is driven by a discrete-event scheduler: time only moves
+ * forward when the simulation advances it, and all scheduled
+ * events are executed in order of their due time. Events due
+ * at the same time are executed in order of scheduling, which
+ * makes every simulation run fully deterministic.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <queue>
+#include <vector>
+
+namespace sim {
+
+class VirtualClock {
+public:
+	using Callback = std::function<void()>;
+
+	uint64_t now() const { return time; } // Current virtual time in us
+
+	void schedule(uint64_t at, Callback callback); // Schedule event at given virtual time in us
+	void scheduleIn(uint64_t delay, Callback callback) { schedule(time + delay, callback); } // Schedule event after given delay in us
+
+	void advance(uint64_t duration) { advanceTo(time + duration); } // Advance time by given duration in us
+	void advanceTo(uint64_t target); // Advance time to given virtual time, executing all events due until then
+	bool step(); // Advance time to the next event and execute it, false if no event is scheduled
+
+	bool pending() const { return !events.empty(); } // Events are scheduled
+	uint64_t nextEvent() const; // Due time of the next event, UINT64_MAX if none is scheduled
+	void reset(); // Drop all events and reset time to zero
+
+private:
+	struct Event {
+		uint64_t time; // Due time in us
+		uint64_t sequence; // Scheduling order for events due at the same time
+		Callback callback; // Event handler
+	};
+	struct Later {
+		bool operator()(const Event& a, const Event& b) const {
+			return (a.time != b.time) ? a.time > b.time : a.sequence > b.sequence;
+		}
+	};
+
+	uint64_t time = 0; // Current virtual time in us
+	uint64_t sequence = 0; // Number of scheduled events
+	std::priority_queue<Event, std::vector<Event>, Later> events; // Scheduled events
+};
+
+extern VirtualClock virtualClock; // Clock backing millis(), micros() and delay()
+
+} // namespace sim
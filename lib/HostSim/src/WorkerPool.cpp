@@ -0,0 +1,152 @@
+#include "WorkerPool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace sim {
+
+namespace {
+
+/*
+ * Range of simulations owned by a worker
+ *
+ * Begin and end are packed into one 64 bit word, so the owner
+ * and thieves can update the range with a single CAS.
+ */
+struct alignas(64) Range {
+	std::atomic<uint64_t> bounds;
+};
+
+uint64_t pack(uint32_t begin, uint32_t end) {
+	return ((uint64_t) end << 32) | begin;
+}
+
+bool take(Range& range, uint32_t& index) { // Take the next simulation from the front of the own range
+	uint64_t bounds = range.bounds.load();
+	for (;;) {
+		uint32_t begin = bounds, end = bounds >> 32;
+		if (begin >= end) {
+			return false;
+		}
+		if (range.bounds.compare_exchange_weak(bounds, pack(begin + 1, end))) {
+			index = begin;
+			return true;
+		}
+	}
+}
+
+bool steal(Range& victim, Range& own) { // Move the back half of the victim range to the own range
+	uint64_t bounds = victim.bounds.load();
+	for (;;) {
+		uint32_t begin = bounds, end = bounds >> 32;
+		if (begin >= end) {
+			return false;
+		}
+		uint32_t split = end - (end - begin + 1) / 2;
+		if (victim.bounds.compare_exchange_weak(bounds, pack(begin, split))) {
+			own.bounds.store(pack(split, end));
+			return true;
+		}
+	}
+}
+
+void execute(size_t index, const std::function<double(size_t)>& simulation, double& result) { // Run one simulation in a fresh process
+	pid_t pid = fork();
+	if (pid == 0) { // Fresh process with pristine firmware state
+		result = simulation(index); // Result lies in shared memory
+		_exit(0);
+	}
+	int status = 0;
+	if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) { // Not started or failed
+		result = NAN;
+	}
+}
+
+} // namespace
+
+int workerCount(int jobs) {
+	return (jobs > 0) ? jobs : std::max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+}
+
+std::vector<double> parallel(size_t count, int jobs, const std::function<double(size_t)>& simulation, bool progress) {
+	if (count == 0) {
+		return {};
+	}
+	if (count >= UINT32_MAX) {
+		fprintf(stderr, "too many simulations\n");
+		exit(1);
+	}
+	jobs = workerCount(jobs);
+
+	// Shared memory for the ranges, results and progress of all workers
+	size_t size = jobs * sizeof(Range) + count * sizeof(double) + sizeof(std::atomic<uint64_t>);
+	void* shared = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shared == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	Range* ranges = new (shared) Range[jobs];
+	double* results = (double*) (ranges + jobs);
+	std::atomic<uint64_t>* done = new (results + count) std::atomic<uint64_t>(0);
+	for (int j = 0; j < jobs; j++) {
+		ranges[j].bounds.store(pack(count * j / jobs, count * (j + 1) / jobs));
+	}
+
+	std::vector<pid_t> workers;
+	for (int j = 0; j < jobs; j++) {
+		pid_t pid = fork();
+		if (pid < 0) { // The ranges of missing workers are stolen by the others
+			perror("fork");
+			break;
+		}
+		if (pid == 0) { // Worker
+			uint32_t index;
+			for (;;) {
+				if (!take(ranges[j], index)) {
+					bool stolen = false;
+					for (int k = 1; k < jobs && !stolen; k++) {
+						stolen = steal(ranges[(j + k) % jobs], ranges[j]);
+					}
+					if (!stolen) { // All ranges are exhausted
+						_exit(0);
+					}
+					continue;
+				}
+				execute(index, simulation, results[index]);
+				done->fetch_add(1);
+			}
+		}
+		workers.push_back(pid);
+	}
+	if (workers.empty()) {
+		fprintf(stderr, "no worker process started\n");
+		exit(1);
+	}
+
+	for (pid_t worker : workers) {
+		while (progress && waitpid(worker, nullptr, WNOHANG) == 0) {
+			fprintf(stderr, "\r%llu / %zu runs", (unsigned long long) done->load(), count);
+			sleep(1);
+		}
+		if (!progress) {
+			waitpid(worker, nullptr, 0);
+		}
+	}
+	if (progress) {
+		fprintf(stderr, "\r%llu / %zu runs\n", (unsigned long long) done->load(), count);
+	}
+	std::vector<double> values(results, results + count);
+	munmap(shared, size);
+	return values;
+}
+
+} // namespace sim
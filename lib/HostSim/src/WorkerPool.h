@@ -0,0 +1,33 @@
+/*
+ * Parallel execution of simulations for the host simulation
+ *
+ * The firmware keeps its state in global variables, so every
+ * simulation is executed in a freshly forked process with
+ * pristine firmware state. The simulations are distributed over
+ * one worker process per job. Each worker owns a range of
+ * simulations in shared memory and steals half of the remaining
+ * range of another worker once its own range is exhausted.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <vector>
+
+namespace sim {
+
+int workerCount(int jobs); // Worker processes for the given job option, one per core for 0
+
+/*
+ * Run simulations in parallel
+ *
+ * Calls the simulation for every index from 0 to count - 1,
+ * each in its own process, and returns the results by index.
+ * A simulation which crashes, exits with an error or cannot be
+ * started gives NaN. With progress, the number of finished
+ * simulations is printed to stderr every second.
+ */
+std::vector<double> parallel(size_t count, int jobs, const std::function<double(size_t index)>& simulation, bool progress = false);
+
+} // namespace sim
@@ -0,0 +1,15 @@
+/*
+ * Flash layout for the host simulation
+ *
+ * Matches the file system region of the ESP8266 core for a
+ * 512 KB module with eagle.flash.512k32.ld. Only this region
+ * is simulated, see sim::flash.
+ */
+
+#pragma once
+
+#define FLASH_SECTOR_SIZE 0x1000 // Erase unit of the flash
+#define FS_PHYS_ADDR 0x73000 // Start of the file system region
+#define FS_PHYS_SIZE 0x8000 // Size of the file system region, 8 sectors
+#define FS_PHYS_PAGE 0x100
+#define FS_PHYS_BLOCK 0x1000
@@ -0,0 +1,277 @@
+/*
+ * Microbenchmarks of the firmware hot paths
+ *
+ * Measures the time and the heap allocations per call of the
+ * functions executed for every MQTT message and every flow
+ * meter pulse. Each benchmark is repeated until it ran for the
+ * minimum time, the result is reported as ns/op together with
+ * the number of allocations and bytes allocated per call.
+ *
+ * The document benchmarks run the former command parser, which
+ * deserializes the message into an ArduinoJson document and
+ * looks up the keys in it, as reference for processJson(). The
+ * msgpack benchmarks decode the valid payloads converted to
+ * MessagePack and a command with key indices, and encode the
+ * state as MessagePack.
+ *
+ * The MQTT client is not connected, so publishing returns right
+ * after the message has been serialized and the numbers only
+ * contain the cost of the firmware itself. Times are host times
+ * and only meaningful relative to each other and to earlier
+ * results on the same machine, the allocations are the same as
+ * on the device.
+ *
+ * Usage: pio run -e bench && .pio/build/bench/program [options]
+ *   --filter <text>        Only run benchmarks containing the text
+ *   --time <s>             Minimum time per benchmark (default 0.5)
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <ESP8266WiFi.h>
+#include <HostSim.h>
+
+#include "config.h"
+
+// Firmware functions and variables under test
+bool processJson(char* message);
+bool processMsgPack(const uint8_t* message, size_t length);
+void sendState();
+void callback(char* topic, byte* payload, unsigned int length);
+void pulseCounter();
+void setPowerMode(WiFiSleepType_t mode);
+extern bool state;
+extern uint32_t volumeTarget;
+extern WiFiSleepType_t powerProfile;
+extern bool traceRequested;
+extern bool stateBinary;
+
+namespace {
+
+size_t allocations = 0; // Number of heap allocations
+size_t allocated = 0; // Bytes allocated from the heap
+
+struct Benchmark {
+	const char* name; // Name of the benchmark
+	void (*function)(); // Operation to measure
+};
+
+char message[512]; // Message buffer, the parser modifies the message in place
+std::string payload; // Payload of the current benchmark
+std::string binary; // Payload of the current benchmark encoded as MessagePack
+
+void parse() { // Parse a copy of the payload
+	memcpy(message, payload.c_str(), payload.size() + 1);
+	processJson(message);
+}
+
+bool processDocument(char* message) { // Command parser based on an ArduinoJson document
+	StaticJsonDocument<JSON_OBJECT_SIZE(4)> jsonDocument;
+	if (deserializeJson(jsonDocument, message)) {
+		return false;
+	}
+	if (jsonDocument.containsKey("state")) {
+		if (strcmp(jsonDocument["state"] | "", CONFIG_MQTT_PAYLOAD_ON) == 0) {
+			state = true;
+		} else if (strcmp(jsonDocument["state"] | "", CONFIG_MQTT_PAYLOAD_OFF) == 0) {
+			state = false;
+		}
+	}
+	if (jsonDocument.containsKey("volume")) {
+		volumeTarget = (float) jsonDocument["volume"] * 1000.0;
+	}
+	if (jsonDocument.containsKey("powerProfile")) {
+		const char* const names[] = {"none", "light", "modem"};
+		for (int i = 0; i < 3; i++) {
+			if (strcmp(jsonDocument["powerProfile"] | "", names[i]) == 0) {
+				powerProfile = (WiFiSleepType_t) i;
+			}
+		}
+		if (!state) {
+			setPowerMode(powerProfile);
+		}
+	}
+	if (jsonDocument.containsKey("trace")) {
+		traceRequested = CONFIG_TRACE;
+	}
+	return true;
+}
+
+void parseDocument() { // Parse a copy of the payload with the reference parser
+	memcpy(message, payload.c_str(), payload.size() + 1);
+	processDocument(message);
+}
+
+void parseMsgPack() { // Decode a copy of the MessagePack payload
+	memcpy(message, binary.data(), binary.size());
+	processMsgPack((const uint8_t*) message, binary.size());
+}
+
+void sendStateMsgPack() { // Publish the state encoded as MessagePack
+	stateBinary = true;
+	sendState();
+	stateBinary = false;
+}
+
+std::string msgPack(const std::string& json) { // Payload converted to MessagePack, empty for invalid JSON
+	DynamicJsonDocument document(4096);
+	if (deserializeJson(document, json.c_str(), json.size())) {
+		return "";
+	}
+	std::string encoded(measureMsgPack(document), '\0');
+	serializeMsgPack(document, &encoded[0], encoded.size());
+	return encoded;
+}
+
+void deliver() { // Deliver the payload to the MQTT callback
+	memcpy(message, payload.c_str(), payload.size());
+	callback((char*) CONFIG_MQTT_TOPIC_SET, (byte*) message, payload.size());
+}
+
+std::string nested(int depth) { // Deeply nested object
+	std::string json;
+	for (int i = 0; i < depth; i++) {
+		json += "{\"a\":";
+	}
+	json += "0";
+	json += std::string(depth, '}');
+	return json;
+}
+
+std::string unknownKeys(int count) { // Object with many unknown keys
+	std::string json = "{";
+	for (int i = 0; i < count; i++) {
+		json += (i ? ",\"key" : "\"key") + std::to_string(i) + "\":" + std::to_string(i);
+	}
+	return json + "}";
+}
+
+struct Payload {
+	const char* name; // Name of the payload
+	std::string json; // Message content
+};
+
+const std::vector<Payload> PAYLOADS = {
+	{"command", "{\"state\": \"" CONFIG_MQTT_PAYLOAD_ON "\", \"volume\": 250}"},
+	{"stop", "{\"state\": \"" CONFIG_MQTT_PAYLOAD_OFF "\"}"},
+	{"powerProfile", "{\"powerProfile\": \"modem\"}"},
+	{"invalid", "{\"state\": \"" CONFIG_MQTT_PAYLOAD_ON "\", \"volume\": }"},
+	{"wrongTypes", "{\"state\": 1, \"volume\": \"250\", \"powerProfile\": null}"},
+	{"longString", "{\"state\": \"" + std::string(200, 'x') + "\"}"},
+	{"escaped", "{\"powerProfile\": \"mo\\u0064em\", \"volume\": \"250\"}"},
+	{"unknownKeys", unknownKeys(32)},
+	{"nested", nested(64)},
+};
+
+double measure(void (*function)(), double minTime, size_t& iterations) { // Time per call in ns
+	using clock = std::chrono::steady_clock;
+	iterations = 1;
+	for (;;) {
+		auto start = clock::now();
+		for (size_t i = 0; i < iterations; i++) {
+			function();
+		}
+		double elapsed = std::chrono::duration<double>(clock::now() - start).count();
+		if (elapsed >= minTime) {
+			return elapsed * 1e9 / iterations;
+		}
+		iterations = (elapsed > 0.0) ? std::max<size_t>(iterations * 2, iterations * minTime * 1.2 / elapsed) : iterations * 10;
+	}
+}
+
+void report(const std::string& name, void (*function)(), double minTime) {
+	function(); // Warm up
+	state = false;
+	size_t calls = allocations, bytes = allocated;
+	function(); // Allocations of a single call
+	calls = allocations - calls;
+	bytes = allocated - bytes;
+	size_t iterations;
+	double time = measure(function, minTime, iterations);
+	printf("%-32s %12zu %12.1f %10zu %10zu\n", name.c_str(), iterations, time, calls, bytes);
+}
+
+} // namespace
+
+void* operator new(size_t size) {
+	allocations++;
+	allocated += size;
+	void* pointer = malloc(size ? size : 1);
+	if (!pointer) {
+		throw std::bad_alloc();
+	}
+	return pointer;
+}
+
+void operator delete(void* pointer) noexcept {
+	free(pointer);
+}
+
+void operator delete(void* pointer, size_t) noexcept {
+	free(pointer);
+}
+
+int main(int argc, char** argv) {
+	const char* filter = ""; // Only run matching benchmarks
+	double minTime = 0.5; // Minimum time per benchmark in s
+
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--filter") && i + 1 < argc) {
+			filter = argv[++i];
+		} else if (!strcmp(argv[i], "--time") && i + 1 < argc) {
+			minTime = atof(argv[++i]);
+		} else {
+			fprintf(stderr, "unknown option %s\n", argv[i]);
+			return 1;
+		}
+	}
+
+	sim::reset();
+	sim::serialOutput = nullptr;
+	setup(); // Pins and interrupt, the MQTT client stays disconnected
+
+	printf("%-32s %12s %12s %10s %10s\n", "benchmark", "iterations", "ns/op", "allocs/op", "bytes/op");
+	for (const Payload& current : PAYLOADS) {
+		payload = current.json;
+		std::string name = std::string("processJson/") + current.name;
+		if (name.find(filter) != std::string::npos) {
+			report(name, parse, minTime);
+		}
+		name = std::string("document/") + current.name;
+		if (name.find(filter) != std::string::npos) {
+			report(name, parseDocument, minTime);
+		}
+		binary = msgPack(current.json);
+		name = std::string("msgpack/") + current.name;
+		if (!binary.empty() && binary.size() <= sizeof(message) && name.find(filter) != std::string::npos) {
+			report(name, parseMsgPack, minTime);
+		}
+		name = std::string("callback/") + current.name;
+		if (name.find(filter) != std::string::npos) {
+			report(name, deliver, minTime);
+		}
+	}
+	binary.assign("\x82\x00\xc3\x01\xcc\xfa", 6); // {0: true, 1: 250} with key indices
+	if (strstr("msgpack/compact", filter)) {
+		report("msgpack/compact", parseMsgPack, minTime);
+	}
+	const Benchmark others[] = {
+		{"sendState", sendState},
+		{"sendState/msgpack", sendStateMsgPack},
+		{"pulseCounter", pulseCounter},
+	};
+	for (const Benchmark& benchmark : others) {
+		if (strstr(benchmark.name, filter)) {
+			report(benchmark.name, benchmark.function, minTime);
+		}
+	}
+	return 0;
+}
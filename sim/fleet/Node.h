@@ -0,0 +1,29 @@
+/*
+ * Interface between the fleet simulation and its devices
+ *
+ * The firmware keeps its state in global variables. To run many
+ * devices in one process, the firmware is linked together with
+ * the Arduino, WiFi and PubSubClient stand-ins into a shared
+ * library, which the fleet simulation loads once per device.
+ * Every copy has its own globals, while the virtual clock, the
+ * fibers and the broker are provided by the fleet executable.
+ */
+
+#pragma once
+
+#include <cstdint>
+
+struct NodeConfig {
+	unsigned index; // Number of the device
+	uint64_t seed; // Seed of the plant model
+	double maxFlow; // Pump flow without head in l/min
+	uint64_t loopTime; // Virtual time per loop() iteration in us
+	uint64_t latency; // One-way network latency in us
+	const char* clientIdSuffix; // Appended to the client ID of the firmware
+	const char* topicPrefix; // Prefix of the firmware topics
+	const char* devicePrefix; // Prefix of the topics of this device on the broker
+};
+
+// Run a device until it enters deep sleep, executed in a fiber
+extern "C" void nodeMain(const NodeConfig* config);
+typedef void (*NodeMain)(const NodeConfig* config);
@@ -0,0 +1,265 @@
+/*
+ * Fleet simulation
+ *
+ * Runs many watering devices against one in-process broker to
+ * size the broker and Home Assistant for a large installation.
+ * Every device runs an unmodified copy of the firmware in its own
+ * fiber, with its own client ID, topics, plant model and network
+ * connection. Watering commands arrive at random times, the
+ * resulting traffic is reported per second and in total.
+ *
+ * Usage: pio run -e fleet-node -e fleet && .pio/build/fleet/program [options]
+ *   --nodes <n>            Number of devices (default 500)
+ *   --duration <s>         Simulated time (default 600)
+ *   --device <path>        Device library (default .pio/build/fleet-node/program)
+ *   --boot <s>             Devices boot at random times within this window (default 30)
+ *   --interval <s>         Mean time between watering commands per device (default 300)
+ *   --volume <ml>          Commanded volume (default 250)
+ *   --flow <l/min>         Mean pump flow without head, varies by 20 % between devices (default 2.0)
+ *   --outage <s>:<s>       Broker outage start and duration
+ *   --latency <us>         One-way network latency (default 2000)
+ *   --loop <us>            Virtual time per loop() iteration (default 100)
+ *   --seed <n>             Seed for all random numbers (default 1)
+ *   --timeline <file>      Write the traffic per second as CSV
+ *   --msgpack              Send commands encoded as MessagePack, requires CONFIG_MQTT_BINARY
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <dlfcn.h>
+#include <unistd.h>
+
+#include <Broker.h>
+#include <Fiber.h>
+#include <VirtualClock.h>
+
+#include "Node.h"
+#include "config.h"
+
+namespace {
+
+bool copyFile(const std::string& from, const std::string& to) {
+	FILE* in = fopen(from.c_str(), "rb");
+	FILE* out = in ? fopen(to.c_str(), "wb") : nullptr;
+	char buffer[65536];
+	size_t size;
+	bool ok = in && out;
+	while (ok && (size = fread(buffer, 1, sizeof(buffer), in)) > 0) {
+		ok = fwrite(buffer, 1, size, out) == size;
+	}
+	if (in) {
+		fclose(in);
+	}
+	if (out) {
+		ok &= fclose(out) == 0;
+	}
+	return ok;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+	unsigned nodes = 500; // Number of devices
+	double duration = 600.0; // Simulated time in s
+	std::string device = ".pio/build/fleet-node/program"; // Device library
+	double boot = 30.0; // Boot window in s
+	double interval = 300.0; // Mean time between watering commands in s
+	double volume = 250.0; // Commanded volume in ml
+	double flow = 2.0; // Mean pump flow in l/min
+	double outageStart = -1.0, outageDuration = 0.0; // Broker outage in s
+	uint64_t latency = 2000; // One-way network latency in us
+	uint64_t loopTime = 100; // Virtual time per loop() iteration in us
+	uint64_t seed = 1; // Seed for all random numbers
+	const char* timeline = nullptr; // Traffic per second output
+	bool binary = false; // Commands are encoded as MessagePack
+
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--nodes") && i + 1 < argc) {
+			nodes = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--duration") && i + 1 < argc) {
+			duration = atof(argv[++i]);
+		} else if (!strcmp(argv[i], "--device") && i + 1 < argc) {
+			device = argv[++i];
+		} else if (!strcmp(argv[i], "--boot") && i + 1 < argc) {
+			boot = atof(argv[++i]);
+		} else if (!strcmp(argv[i], "--interval") && i + 1 < argc) {
+			interval = atof(argv[++i]);
+		} else if (!strcmp(argv[i], "--volume") && i + 1 < argc) {
+			volume = atof(argv[++i]);
+		} else if (!strcmp(argv[i], "--flow") && i + 1 < argc) {
+			flow = atof(argv[++i]);
+		} else if (!strcmp(argv[i], "--outage") && i + 1 < argc) {
+			sscanf(argv[++i], "%lf:%lf", &outageStart, &outageDuration);
+		} else if (!strcmp(argv[i], "--latency") && i + 1 < argc) {
+			latency = strtoull(argv[++i], nullptr, 10);
+		} else if (!strcmp(argv[i], "--loop") && i + 1 < argc) {
+			loopTime = strtoull(argv[++i], nullptr, 10);
+		} else if (!strcmp(argv[i], "--seed") && i + 1 < argc) {
+			seed = strtoull(argv[++i], nullptr, 10);
+		} else if (!strcmp(argv[i], "--timeline") && i + 1 < argc) {
+			timeline = argv[++i];
+		} else if (!strcmp(argv[i], "--msgpack")) {
+			binary = true;
+		} else {
+			fprintf(stderr, "unknown option %s\n", argv[i]);
+			return 1;
+		}
+	}
+
+	if (binary && !CONFIG_MQTT_BINARY) {
+		fprintf(stderr, "--msgpack requires CONFIG_MQTT_BINARY\n");
+		return 1;
+	}
+
+	const std::string prefix = CONFIG_MQTT_TOPIC_STATE; // Topics of every device are renamed below this prefix
+	for (const char* topic : {CONFIG_MQTT_TOPIC_SET, CONFIG_MQTT_TOPIC_AVAILABILITY, CONFIG_MQTT_TOPIC_DIAGNOSTICS, CONFIG_MQTT_TOPIC_PING}) {
+		if (strncmp(topic, prefix.c_str(), prefix.size()) != 0) {
+			fprintf(stderr, "topic %s does not start with the state topic %s\n", topic, prefix.c_str());
+			return 1;
+		}
+	}
+
+	// Load one copy of the device library per device, copies of the same file would share their globals
+	char directory[] = "/tmp/fleetXXXXXX";
+	if (!mkdtemp(directory)) {
+		perror("mkdtemp");
+		return 1;
+	}
+	std::vector<NodeMain> entries;
+	for (unsigned i = 0; i < nodes; i++) {
+		std::string path = std::string(directory) + "/device" + std::to_string(i) + ".so";
+		if (!copyFile(device, path)) {
+			fprintf(stderr, "cannot copy %s\n", device.c_str());
+			return 1;
+		}
+		void* library = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+		unlink(path.c_str());
+		NodeMain entry = library ? (NodeMain) dlsym(library, "nodeMain") : nullptr;
+		if (!entry) {
+			fprintf(stderr, "cannot load %s: %s\n", device.c_str(), dlerror());
+			return 1;
+		}
+		entries.push_back(entry);
+	}
+	rmdir(directory);
+
+	std::mt19937_64 random(seed);
+	std::uniform_real_distribution<double> uniform(0.0, 1.0);
+	std::exponential_distribution<double> commandInterval(1.0 / interval);
+	std::vector<NodeConfig> configs(nodes);
+	std::vector<std::string> suffixes(nodes), prefixes(nodes);
+	std::vector<std::unique_ptr<sim::Fiber>> fibers;
+	for (unsigned i = 0; i < nodes; i++) {
+		char name[16];
+		snprintf(name, sizeof(name), "-%04u", i + 1);
+		suffixes[i] = name;
+		prefixes[i] = prefix + name;
+		configs[i] = {i, seed * 1000003 + i, flow * (0.8 + 0.4 * uniform(random)), loopTime, latency, suffixes[i].c_str(), prefix.c_str(),
+			prefixes[i].c_str()};
+		NodeMain entry = entries[i];
+		const NodeConfig* config = &configs[i];
+		fibers.emplace_back(new sim::Fiber([entry, config]() { entry(config); }, 128 * 1024));
+		fibers.back()->start(uniform(random) * boot * 1e6);
+	}
+
+	// Watering commands arrive independently for every device
+	std::string setTopic = std::string(CONFIG_MQTT_TOPIC_SET + prefix.size()) + (binary ? "/msgpack" : "");
+	std::string payload; // Watering command
+	if (binary) { // {0: true, 1: volume}, keys are the indices of state and volume in the firmware
+		float value = volume;
+		uint32_t bits;
+		memcpy(&bits, &value, sizeof(bits));
+		payload.assign("\x82\x00\xc3\x01\xca", 5);
+		for (int shift = 24; shift >= 0; shift -= 8) {
+			payload += (char) (bits >> shift);
+		}
+	} else {
+		char json[64];
+		snprintf(json, sizeof(json), "{\"state\": \"%s\", \"volume\": %g}", CONFIG_MQTT_PAYLOAD_ON, volume);
+		payload = json;
+	}
+	std::function<void(unsigned)> command = [&](unsigned i) {
+		sim::broker.publish(prefixes[i] + setTopic, payload);
+		sim::virtualClock.scheduleIn(commandInterval(random) * 1e6, [&, i]() { command(i); });
+	};
+	for (unsigned i = 0; i < nodes; i++) {
+		sim::virtualClock.schedule((boot + commandInterval(random)) * 1e6, [&, i]() { command(i); });
+	}
+
+	if (outageStart >= 0.0) {
+		sim::virtualClock.schedule(outageStart * 1e6, []() { sim::broker.setOnline(false); });
+		sim::virtualClock.schedule((outageStart + outageDuration) * 1e6, []() { sim::broker.setOnline(true); });
+	}
+
+	// Messages by topic below the device prefix
+	const char* suffixNames[] = {"", CONFIG_MQTT_TOPIC_AVAILABILITY, CONFIG_MQTT_TOPIC_SET, CONFIG_MQTT_TOPIC_DIAGNOSTICS, CONFIG_MQTT_TOPIC_PING};
+	unsigned long topicCount[5] = {0, 0, 0, 0, 0};
+	sim::broker.observe("#", [&](const sim::Message& message) {
+		size_t level = message.topic.find('/', prefix.size());
+		std::string suffix = (level == std::string::npos) ? "" : message.topic.substr(level);
+		if (suffix.size() >= 8 && suffix.compare(suffix.size() - 8, 8, "/msgpack") == 0) { // Counted with the JSON topic
+			suffix.resize(suffix.size() - 8);
+		}
+		for (int k = 0; k < 5; k++) {
+			if (suffix == suffixNames[k] + ((k > 0) ? prefix.size() : 0)) {
+				topicCount[k]++;
+			}
+		}
+	});
+
+	// Traffic per second
+	FILE* csv = timeline ? fopen(timeline, "w") : nullptr;
+	if (csv) {
+		fprintf(csv, "time,sessions,connects,publishes_in,publishes_out,bytes_in,bytes_out\n");
+	}
+	sim::Statistics last, peak;
+	size_t peakSessions = 0;
+	std::function<void()> sample = [&]() {
+		const sim::Statistics& now = sim::broker.statistics;
+		sim::Statistics delta = {now.connects - last.connects, now.packetsIn - last.packetsIn, now.packetsOut - last.packetsOut,
+			now.publishesIn - last.publishesIn, now.publishesOut - last.publishesOut, now.bytesIn - last.bytesIn, now.bytesOut - last.bytesOut};
+		last = now;
+		peak.connects = std::max(peak.connects, delta.connects);
+		peak.publishesIn = std::max(peak.publishesIn, delta.publishesIn);
+		peak.publishesOut = std::max(peak.publishesOut, delta.publishesOut);
+		peak.bytesIn = std::max(peak.bytesIn, delta.bytesIn);
+		peak.bytesOut = std::max(peak.bytesOut, delta.bytesOut);
+		peakSessions = std::max(peakSessions, sim::broker.sessions());
+		if (csv) {
+			fprintf(csv, "%.0f,%zu,%llu,%llu,%llu,%llu,%llu\n", sim::virtualClock.now() / 1e6, sim::broker.sessions(),
+				(unsigned long long) delta.connects, (unsigned long long) delta.publishesIn, (unsigned long long) delta.publishesOut,
+				(unsigned long long) delta.bytesIn, (unsigned long long) delta.bytesOut);
+		}
+		sim::virtualClock.scheduleIn(1000000, sample);
+	};
+	sim::virtualClock.schedule(1000000, sample);
+
+	auto wallStart = std::chrono::steady_clock::now();
+	sim::virtualClock.advanceTo(duration * 1e6);
+	double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+	if (csv) {
+		fclose(csv);
+	}
+
+	const sim::Statistics& total = sim::broker.statistics;
+	printf("%u devices, simulated %.0f s in %.3f s wall-clock time\n", nodes, duration, wall);
+	printf("sessions %zu at the end, %zu peak, %llu connects, %zu retained messages\n", sim::broker.sessions(), peakSessions,
+		(unsigned long long) total.connects, sim::broker.retainedCount());
+	printf("publishes to the broker %llu, %.1f/s average, %llu/s peak\n", (unsigned long long) total.publishesIn, total.publishesIn / duration,
+		(unsigned long long) peak.publishesIn);
+	printf("publishes from the broker %llu, %.1f/s average, %llu/s peak\n", (unsigned long long) total.publishesOut,
+		total.publishesOut / duration, (unsigned long long) peak.publishesOut);
+	printf("bytes to the broker %.1f kB/s average, %.1f kB/s peak\n", total.bytesIn / duration / 1e3, peak.bytesIn / 1e3);
+	printf("bytes from the broker %.1f kB/s average, %.1f kB/s peak\n", total.bytesOut / duration / 1e3, peak.bytesOut / 1e3);
+	printf("messages: state %lu, availability %lu, set %lu, diagnostics %lu, ping %lu\n", topicCount[0], topicCount[1], topicCount[2],
+		topicCount[3], topicCount[4]);
+	fflush(stdout);
+	_exit(0); // Suspended fibers of the devices are never unwound
+}
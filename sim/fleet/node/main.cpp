@@ -0,0 +1,41 @@
+/*
+ * Device of the fleet simulation
+ *
+ * This file is linked together with the firmware into the shared
+ * library loaded by the fleet simulation for every device. It
+ * attaches a plant model, sets the identity of the device and
+ * runs the firmware loop in the fiber of the device.
+ */
+
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+#include <Fiber.h>
+#include <HostSim.h>
+#include <PlantModel.h>
+#include <PubSubClient.h>
+
+#include "../Node.h"
+#include "config.h"
+
+extern "C" void nodeMain(const NodeConfig* config) {
+	sim::serialOutput = nullptr;
+	sim::loopTime = config->loopTime;
+	sim::network.latency = config->latency;
+	sim::chipId = 0x00c00000 + config->index;
+	sim::mqttIdentity = {config->clientIdSuffix, config->topicPrefix, config->devicePrefix};
+
+	sim::PlantParameters plant;
+	plant.kFactor = (CONFIG_FLOW_METER_PULSES); // Meter matches the volume per pulse used by the firmware
+	plant.maxFlow = config->maxFlow;
+	static sim::PlantModel model(plant, config->seed); // Lives as long as the device
+	model.attach(CONFIG_PIN_PUMP, CONFIG_PIN_FLOW_METER);
+
+	try {
+		setup();
+		for (;;) {
+			loop();
+			sim::sleepUntil(sim::virtualClock.now() + sim::loopTime);
+		}
+	} catch (const sim::DeepSleep&) { // Device stays asleep for the rest of the simulation
+	}
+}
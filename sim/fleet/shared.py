@@ -0,0 +1,6 @@
+# Link the device program of the fleet simulation as a shared library.
+# Clock, broker and fibers are left undefined and resolved against the
+# fleet executable when the library is loaded.
+Import("env")
+
+env.Append(LINKFLAGS=["-shared"])
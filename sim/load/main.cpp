@@ -0,0 +1,162 @@
+/*
+ * MQTT load test
+ *
+ * Floods the set topic of the simulated firmware with commands
+ * at a fixed rate and measures the time until the state topic
+ * reflects each command. Every command carries a unique target
+ * volume with the pump state off, so the state message answering
+ * it can be identified. Broker disconnects, WiFi outages and
+ * network stalls can be injected to observe the reconnect
+ * behaviour of the firmware under load.
+ *
+ * Usage: pio run -e load && .pio/build/load/program [options]
+ *   --rate <1/s>           Commands per second (default 10)
+ *   --duration <s>         Duration of the flood (default 60)
+ *   --drop <s>,...         Drop the MQTT connection at the given times
+ *   --wifi <s>:<s>         WiFi outage start and duration
+ *   --outage <s>:<s>       Broker outage start and duration
+ *   --stall <s>:<s>        Network stall start and duration
+ *   --latency <us>         One-way network latency (default 2000)
+ *   --loop <us>            Virtual time per loop() iteration (default 100)
+ *   --serial               Print the serial output of the firmware
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <vector>
+
+#include <Arduino.h>
+#include <Broker.h>
+#include <ESP8266WiFi.h>
+#include <HostSim.h>
+
+#include "config.h"
+
+namespace {
+
+void window(const char* argument, double& start, double& duration) { // Parse <start>:<duration>
+	sscanf(argument, "%lf:%lf", &start, &duration);
+}
+
+double percentile(std::vector<double> values, double p) {
+	if (values.empty()) {
+		return 0.0;
+	}
+	std::sort(values.begin(), values.end());
+	return values[(size_t) (p * (values.size() - 1) + 0.5)];
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+	double rate = 10.0; // Commands per second
+	double duration = 60.0; // Duration of the flood in s
+	std::vector<double> drops; // Times of dropped MQTT connections in s
+	double wifiStart = -1.0, wifiDuration = 0.0; // WiFi outage in s
+	double outageStart = -1.0, outageDuration = 0.0; // Broker outage in s
+	double stallStart = -1.0, stallDuration = 0.0; // Network stall in s
+	bool serial = false; // Print serial output
+
+	sim::reset();
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--rate") && i + 1 < argc) {
+			rate = atof(argv[++i]);
+		} else if (!strcmp(argv[i], "--duration") && i + 1 < argc) {
+			duration = atof(argv[++i]);
+		} else if (!strcmp(argv[i], "--drop") && i + 1 < argc) {
+			for (char* time = strtok(argv[++i], ","); time; time = strtok(nullptr, ",")) {
+				drops.push_back(atof(time));
+			}
+		} else if (!strcmp(argv[i], "--wifi") && i + 1 < argc) {
+			window(argv[++i], wifiStart, wifiDuration);
+		} else if (!strcmp(argv[i], "--outage") && i + 1 < argc) {
+			window(argv[++i], outageStart, outageDuration);
+		} else if (!strcmp(argv[i], "--stall") && i + 1 < argc) {
+			window(argv[++i], stallStart, stallDuration);
+		} else if (!strcmp(argv[i], "--latency") && i + 1 < argc) {
+			sim::network.latency = strtoull(argv[++i], nullptr, 10);
+		} else if (!strcmp(argv[i], "--loop") && i + 1 < argc) {
+			sim::loopTime = strtoull(argv[++i], nullptr, 10);
+		} else if (!strcmp(argv[i], "--serial")) {
+			serial = true;
+		} else {
+			fprintf(stderr, "unknown option %s\n", argv[i]);
+			return 1;
+		}
+	}
+	if (rate <= 0.0) {
+		fprintf(stderr, "invalid rate\n");
+		return 1;
+	}
+	sim::serialOutput = serial ? stdout : nullptr;
+
+	std::map<long, uint64_t> pending; // Send time of unanswered commands by target volume
+	std::vector<double> latencies; // Command to state latencies in ms
+	unsigned long sent = 0, reconnects = 0, stateMessages = 0;
+	sim::broker.observe(CONFIG_MQTT_TOPIC_STATE, [&](const sim::Message& message) {
+		stateMessages++;
+		const char* target = strstr(message.payload.c_str(), "\"volumeTarget\":");
+		if (!target) {
+			return;
+		}
+		auto it = pending.find(atol(target + strlen("\"volumeTarget\":")));
+		if (it != pending.end()) {
+			latencies.push_back((sim::virtualClock.now() - it->second) / 1e3);
+			pending.erase(it);
+		}
+	});
+	sim::broker.observe(CONFIG_MQTT_TOPIC_AVAILABILITY, [&](const sim::Message& message) {
+		reconnects += message.payload == CONFIG_MQTT_PAYLOAD_ONLINE;
+	});
+
+	auto wallStart = std::chrono::steady_clock::now();
+	try {
+		setup();
+		sim::run(60000000, []() { // Wait until the firmware is online
+			const sim::Message* availability = sim::broker.retained(CONFIG_MQTT_TOPIC_AVAILABILITY);
+			return availability && availability->payload == CONFIG_MQTT_PAYLOAD_ONLINE;
+		});
+		reconnects = 0;
+
+		uint64_t start = sim::virtualClock.now();
+		for (double time : drops) {
+			sim::virtualClock.schedule(start + time * 1e6, []() { sim::broker.drop(CONFIG_MQTT_CLIENT_ID); });
+		}
+		if (wifiStart >= 0.0) {
+			sim::virtualClock.schedule(start + wifiStart * 1e6, []() { sim::network.available = false; });
+			sim::virtualClock.schedule(start + (wifiStart + wifiDuration) * 1e6, []() { sim::network.available = true; });
+		}
+		if (outageStart >= 0.0) {
+			sim::virtualClock.schedule(start + outageStart * 1e6, []() { sim::broker.setOnline(false); });
+			sim::virtualClock.schedule(start + (outageStart + outageDuration) * 1e6, []() { sim::broker.setOnline(true); });
+		}
+		if (stallStart >= 0.0) {
+			sim::virtualClock.schedule(start + stallStart * 1e6, [=]() { sim::stallNetwork(stallDuration * 1e6); });
+		}
+		unsigned long count = rate * duration;
+		for (unsigned long i = 0; i < count; i++) { // Commands with unique target volumes
+			sim::virtualClock.schedule(start + i * 1e6 / rate, [&, i]() {
+				char command[64];
+				snprintf(command, sizeof(command), "{\"state\": \"%s\", \"volume\": %lu}", CONFIG_MQTT_PAYLOAD_OFF, i + 1);
+				pending[i + 1] = sim::virtualClock.now();
+				sent++;
+				sim::broker.publish(CONFIG_MQTT_TOPIC_SET, command);
+			});
+		}
+		sim::run(duration * 1e6 + 10000000); // Flood and let the backlog drain
+	} catch (const sim::DeepSleep& sleep) {
+		printf("deep sleep after %.3f s\n", sim::virtualClock.now() / 1e6);
+	}
+	double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+
+	printf("commands sent %lu, answered %zu, unanswered %zu, state messages %lu, reconnects %lu\n", sent, latencies.size(), pending.size(),
+		stateMessages, reconnects);
+	printf("latency p50 %.1f ms, p95 %.1f ms, p99 %.1f ms, max %.1f ms\n", percentile(latencies, 0.5), percentile(latencies, 0.95),
+		percentile(latencies, 0.99), percentile(latencies, 1.0));
+	printf("simulated %.3f s in %.3f ms wall-clock time\n", sim::virtualClock.now() / 1e6, wall * 1e3);
+	return 0;
+}
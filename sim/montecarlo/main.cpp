@@ -0,0 +1,265 @@
+/*
+ * Monte-Carlo accuracy sweep
+ *
+ * Runs a large number of simulated watering runs over a grid of
+ * target volumes, pump flows, status update delays, network stall
+ * distributions and shutoff compensations. Every run uses its own
+ * random seed for the plant model and the network stalls. The
+ * overshoot percentiles of every configuration are written as CSV,
+ * followed by the compensation with the smallest median overshoot
+ * for each combination of the other parameters.
+ *
+ * The firmware keeps its state in global variables, so every run is
+ * executed in a freshly forked process, distributed over one worker
+ * process per core by sim::parallel().
+ *
+ * Usage: pio run -e montecarlo && .pio/build/montecarlo/program [options]
+ *   --runs <n>             Runs per configuration (default 1000)
+ *   --volumes <ml,...>     Target volumes (default 50,250,1000)
+ *   --flows <l/min,...>    Pump flows without head (default 1,2)
+ *   --updates <ms,...>     Status update delays (default 50,100,500)
+ *   --stalls <spec,...>    Network stall distributions (default none,6:0.5)
+ *                          "none" or <stalls per minute>:<mean duration in s>
+ *   --compensations <ml,...> Shutoff compensations (default 0,5,10)
+ *   --priming <ml>         Volume of the tubing behind the flow meter (default 0)
+ *   --loop <us>            Virtual time per loop() iteration (default 100)
+ *   --jobs <n>             Worker processes (default: number of cores)
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <Arduino.h>
+#include <Broker.h>
+#include <ESP8266WiFi.h>
+#include <HostSim.h>
+#include <PlantModel.h>
+#include <WorkerPool.h>
+
+#include "config.h"
+
+extern unsigned long updateInterval; // Status update delay of the firmware in ms
+extern uint32_t shutoffVolume; // Shutoff compensation of the firmware in microlitres
+
+namespace {
+
+struct Stalls {
+	double rate; // Stalls per minute
+	double duration; // Mean stall duration in s
+	std::string name; // Specification given on the command line
+};
+
+struct Configuration {
+	double volume; // Target volume in ml
+	double flow; // Pump flow without head in l/min
+	unsigned long update; // Status update delay in ms
+	Stalls stalls; // Network stall distribution
+	double compensation; // Shutoff compensation in ml
+};
+
+struct Options {
+	uint64_t runs = 1000;
+	std::vector<double> volumes = {50, 250, 1000};
+	std::vector<double> flows = {1, 2};
+	std::vector<double> updates = {50, 100, 500};
+	std::vector<Stalls> stalls = {{0, 0, "none"}, {6, 0.5, "6:0.5"}};
+	std::vector<double> compensations = {0, 5, 10};
+	double priming = 0.0;
+	uint64_t loopTime = 100;
+	int jobs = 0;
+};
+
+std::vector<double> parseList(const char* list) {
+	std::vector<double> values;
+	for (const char* p = list; *p; p += (*p == ',')) {
+		char* end;
+		values.push_back(strtod(p, &end));
+		p = end;
+	}
+	return values;
+}
+
+std::vector<Stalls> parseStalls(const char* list) {
+	std::vector<Stalls> values;
+	std::string all = list;
+	size_t start = 0;
+	while (start <= all.size()) {
+		size_t end = std::min(all.find(',', start), all.size());
+		std::string spec = all.substr(start, end - start);
+		Stalls stalls = {0, 0, spec};
+		if (spec != "none") {
+			sscanf(spec.c_str(), "%lf:%lf", &stalls.rate, &stalls.duration);
+		}
+		values.push_back(stalls);
+		start = end + 1;
+	}
+	return values;
+}
+
+/*
+ * Simulate one watering run
+ *
+ * Returns the delivered volume minus the target volume in ml,
+ * NaN if the run did not finish within an hour.
+ */
+float simulate(const Configuration& configuration, const Options& options, uint64_t seed) {
+	sim::reset();
+	sim::serialOutput = nullptr;
+	sim::loopTime = options.loopTime;
+	updateInterval = configuration.update;
+	shutoffVolume = configuration.compensation * 1000.0 + 0.5;
+
+	sim::PlantParameters plant;
+	plant.kFactor = (CONFIG_FLOW_METER_PULSES); // Meter matches the volume per pulse used by the firmware
+	plant.maxFlow = configuration.flow;
+	plant.primingVolume = options.priming;
+	sim::PlantModel model(plant, seed);
+	model.attach(CONFIG_PIN_PUMP, CONFIG_PIN_FLOW_METER);
+
+	std::mt19937_64 random(seed ^ 0x9e3779b97f4a7c15ULL);
+	std::function<void()> stall = [&]() { // Poisson process of network stalls
+		std::exponential_distribution<double> duration(1.0 / configuration.stalls.duration);
+		std::exponential_distribution<double> interval(configuration.stalls.rate / 60.0);
+		sim::stallNetwork(duration(random) * 1e6);
+		sim::virtualClock.scheduleIn(interval(random) * 1e6, stall);
+	};
+	if (configuration.stalls.rate > 0.0) {
+		std::exponential_distribution<double> interval(configuration.stalls.rate / 60.0);
+		sim::virtualClock.scheduleIn(interval(random) * 1e6, stall);
+	}
+
+	bool started = false, finished = false;
+	sim::broker.observe(CONFIG_MQTT_TOPIC_STATE, [&](const sim::Message& message) {
+		bool on = message.payload.find("\"" CONFIG_MQTT_PAYLOAD_ON "\"") != std::string::npos;
+		started |= on;
+		finished |= started && !on;
+	});
+
+	try {
+		setup();
+		sim::run(60000000, []() {
+			const sim::Message* availability = sim::broker.retained(CONFIG_MQTT_TOPIC_AVAILABILITY);
+			return availability && availability->payload == CONFIG_MQTT_PAYLOAD_ONLINE;
+		});
+		char command[64];
+		snprintf(command, sizeof(command), "{\"state\": \"%s\", \"volume\": %g}", CONFIG_MQTT_PAYLOAD_ON, configuration.volume);
+		sim::broker.publish(CONFIG_MQTT_TOPIC_SET, command);
+		sim::run(3600000000ULL, [&]() { return finished; });
+	} catch (const sim::DeepSleep&) {
+	}
+	if (!finished) {
+		return NAN;
+	}
+	while (model.speed() > 0.0 && sim::virtualClock.step()) { // Let the pump coast down
+	}
+	return model.deliveredVolume() - configuration.volume;
+}
+
+double percentile(const std::vector<float>& sorted, double p) {
+	if (sorted.empty()) {
+		return NAN;
+	}
+	double index = p * (sorted.size() - 1);
+	size_t lower = index;
+	size_t upper = std::min(lower + 1, sorted.size() - 1);
+	return sorted[lower] + (sorted[upper] - sorted[lower]) * (index - lower);
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+	Options options;
+	for (int i = 1; i < argc; i++) {
+		if (i + 1 >= argc) {
+			fprintf(stderr, "missing value for %s\n", argv[i]);
+			return 1;
+		} else if (!strcmp(argv[i], "--runs")) {
+			options.runs = strtoull(argv[++i], nullptr, 10);
+		} else if (!strcmp(argv[i], "--volumes")) {
+			options.volumes = parseList(argv[++i]);
+		} else if (!strcmp(argv[i], "--flows")) {
+			options.flows = parseList(argv[++i]);
+		} else if (!strcmp(argv[i], "--updates")) {
+			options.updates = parseList(argv[++i]);
+		} else if (!strcmp(argv[i], "--stalls")) {
+			options.stalls = parseStalls(argv[++i]);
+		} else if (!strcmp(argv[i], "--compensations")) {
+			options.compensations = parseList(argv[++i]);
+		} else if (!strcmp(argv[i], "--priming")) {
+			options.priming = atof(argv[++i]);
+		} else if (!strcmp(argv[i], "--loop")) {
+			options.loopTime = strtoull(argv[++i], nullptr, 10);
+		} else if (!strcmp(argv[i], "--jobs")) {
+			options.jobs = atoi(argv[++i]);
+		} else {
+			fprintf(stderr, "unknown option %s\n", argv[i]);
+			return 1;
+		}
+	}
+
+	std::vector<Configuration> configurations;
+	for (double volume : options.volumes)
+		for (double flow : options.flows)
+			for (double update : options.updates)
+				for (const Stalls& stalls : options.stalls)
+					for (double compensation : options.compensations)
+						configurations.push_back({volume, flow, (unsigned long) update, stalls, compensation});
+
+	uint64_t total = options.runs * configurations.size();
+	if (total == 0 || total >= UINT32_MAX) {
+		fprintf(stderr, "invalid number of runs\n");
+		return 1;
+	}
+	std::vector<double> results = sim::parallel(total, options.jobs, [&](size_t run) {
+		return simulate(configurations[run % configurations.size()], options, run + 1);
+	}, true);
+
+	// Percentiles per configuration
+	printf("volume,flow,update,stalls,compensation,runs,failed,mean,p1,p5,p50,p95,p99,abs_error_p95_percent\n");
+	std::vector<double> medians(configurations.size());
+	for (size_t c = 0; c < configurations.size(); c++) {
+		std::vector<float> overshoot, error;
+		size_t failed = 0;
+		for (uint64_t run = c; run < total; run += configurations.size()) {
+			if (std::isnan(results[run])) {
+				failed++;
+				continue;
+			}
+			overshoot.push_back(results[run]);
+			error.push_back(std::fabs(results[run]) / configurations[c].volume * 100.0);
+		}
+		std::sort(overshoot.begin(), overshoot.end());
+		std::sort(error.begin(), error.end());
+		double mean = 0.0;
+		for (float value : overshoot) {
+			mean += value / overshoot.size();
+		}
+		const Configuration& configuration = configurations[c];
+		medians[c] = percentile(overshoot, 0.5);
+		printf("%g,%g,%lu,%s,%g,%zu,%zu,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f\n", configuration.volume, configuration.flow,
+			configuration.update, configuration.stalls.name.c_str(), configuration.compensation, overshoot.size(), failed, mean,
+			percentile(overshoot, 0.01), percentile(overshoot, 0.05), medians[c], percentile(overshoot, 0.95),
+			percentile(overshoot, 0.99), percentile(error, 0.95));
+	}
+
+	// Compensation with the smallest median overshoot, configurations only differ in the compensation within a group
+	size_t group = options.compensations.size();
+	printf("\n# volume,flow,update,stalls,best_compensation,median_overshoot\n");
+	for (size_t c = 0; c < configurations.size(); c += group) {
+		size_t best = c;
+		for (size_t k = c; k < c + group; k++) {
+			if (std::fabs(medians[k]) < std::fabs(medians[best])) {
+				best = k;
+			}
+		}
+		printf("# %g,%g,%lu,%s,%g,%.2f\n", configurations[best].volume, configurations[best].flow, configurations[best].update,
+			configurations[best].stalls.name.c_str(), configurations[best].compensation, medians[best]);
+	}
+	return 0;
+}
@@ -0,0 +1,414 @@
+/*
+ * Replay of a capture
+ *
+ * Feeds the MQTT messages and flow meter pulses captured by a
+ * device with CONFIG_CAPTURE enabled into the simulated firmware,
+ * so a misbehaving run can be reproduced and profiled on the host.
+ * The capture is the concatenation of the payloads published to
+ * CONFIG_MQTT_TOPIC_CAPTURE, e.g. recorded with
+ * mosquitto_sub -t <topic> -N > run.cap, or written by the run
+ * simulation with --capture.
+ *
+ * The replay is aligned to every recorded connection: the
+ * records following it are scheduled relative to the time the
+ * simulated firmware connected. A recorded disconnect takes the
+ * broker offline until shortly before the next recorded
+ * connection, so the reconnect attempts of the firmware fail as
+ * they did on the device. The publishes of the simulated firmware
+ * are compared with the recorded ones, without the lifetime
+ * totals, which depend on the flash content of the device.
+ *
+ * Capture format, all numbers little-endian:
+ *   Chunk:  magic 0xca, version 1, uint16 length of the chunk,
+ *           uint16 sequence number, uint16 records lost before
+ *           the chunk, uint32 start time in us, records
+ *   Record: varint (time since the previous record in us << 2 | kind)
+ *           kind 0 pulse:    no data
+ *           kind 1 inbound:  topic, varint length, payload
+ *           kind 2 outbound: topic, varint length, payload
+ *           kind 3 event:    event code (0 boot, 1 connected, 2 disconnected,
+ *                            3 lost pulses followed by varint count)
+ *   Topic:  byte index into state, set, availability, diagnostics
+ *           and ping topic, 0x7f followed by varint length and
+ *           name for other topics, the highest bit is the retain flag
+ *
+ * Usage: pio run -e replay && .pio/build/replay/program [options] <capture>
+ *   --boot <n>             Replay the n-th boot contained in the capture (default 1)
+ *   --dump                 Print the records instead of replaying them
+ *   --print                Print the messages of the simulated firmware
+ *   --loop <us>            Virtual time per loop() iteration (default 100)
+ *   --latency <us>         One-way network latency (default 2000)
+ *   --serial               Print the serial output of the firmware
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <Arduino.h>
+#include <Broker.h>
+#include <ESP8266WiFi.h>
+#include <HostSim.h>
+
+#include "config.h"
+
+namespace {
+
+enum Kind { PULSE, INBOUND, OUTBOUND, EVENT };
+enum Event { BOOT, CONNECTED, DISCONNECTED, LOST_PULSES };
+
+struct Record {
+	uint64_t time; // Device time in us, unwrapped
+	Kind kind;
+	int event = -1; // Event code of events
+	uint64_t count = 0; // Number of lost pulses
+	std::string topic; // Topic of messages
+	std::string payload; // Payload of messages
+	bool retained = false; // Retain flag of messages
+};
+
+struct Capture {
+	std::vector<Record> records; // All records in chronological order
+	unsigned chunks = 0; // Decoded chunks
+	unsigned missing = 0; // Chunks missing in the sequence
+	unsigned long dropped = 0; // Records lost on the device
+};
+
+const char* const TOPICS[] = {CONFIG_MQTT_TOPIC_STATE, CONFIG_MQTT_TOPIC_SET, CONFIG_MQTT_TOPIC_AVAILABILITY, CONFIG_MQTT_TOPIC_DIAGNOSTICS,
+	CONFIG_MQTT_TOPIC_PING};
+
+/*
+ * Reader for the bytes of one chunk
+ */
+class Reader {
+public:
+	Reader(const uint8_t* data, size_t size) : data(data), size(size) {}
+
+	bool done() const { return position >= size; }
+	bool failed() const { return error; }
+
+	uint32_t fixed(int bytes) { // Little-endian number
+		uint32_t value = 0;
+		for (int i = 0; i < bytes; i++) {
+			value |= (uint32_t) byte() << (8 * i);
+		}
+		return value;
+	}
+
+	uint8_t byte() {
+		if (position >= size) {
+			error = true;
+			return 0;
+		}
+		return data[position++];
+	}
+
+	uint64_t number() { // Variable length integer
+		uint64_t value = 0;
+		for (int shift = 0; shift < 64; shift += 7) {
+			uint8_t next = byte();
+			value |= (uint64_t) (next & 0x7f) << shift;
+			if (!(next & 0x80)) {
+				return value;
+			}
+		}
+		error = true;
+		return 0;
+	}
+
+	std::string string(size_t length) {
+		if (length > size - position) {
+			error = true;
+			return "";
+		}
+		std::string value((const char*) data + position, length);
+		position += length;
+		return value;
+	}
+
+private:
+	const uint8_t* data;
+	size_t size;
+	size_t position = 0;
+	bool error = false;
+};
+
+bool decode(const std::vector<uint8_t>& file, Capture& capture) {
+	size_t offset = 0;
+	uint64_t last = 0; // Unwrapped time of the last record
+	int sequence = -1; // Sequence number of the last chunk
+	while (offset < file.size()) {
+		Reader header(file.data() + offset, file.size() - offset);
+		uint8_t magic = header.byte(), version = header.byte();
+		size_t length = header.fixed(2);
+		uint16_t number = header.fixed(2);
+		capture.dropped += header.fixed(2);
+		uint32_t start = header.fixed(4);
+		if (header.failed() || magic != 0xca || version != 1 || length < 12 || length > file.size() - offset) {
+			fprintf(stderr, "invalid chunk at offset %zu\n", offset);
+			return false;
+		}
+		if (number == 0 || sequence < 0) { // Device booted, its clock starts over
+			last = (capture.records.empty()) ? start : last + 1;
+		} else {
+			capture.missing += (uint16_t) (number - sequence - 1);
+		}
+		sequence = number;
+		uint64_t time = last + (uint32_t) (start - (uint32_t) last); // Unwrap the 32 bit device time
+
+		Reader reader(file.data() + offset + 12, length - 12);
+		while (!reader.done() && !reader.failed()) {
+			uint64_t head = reader.number();
+			Record record;
+			time += head >> 2;
+			record.time = time;
+			record.kind = (Kind) (head & 3);
+			if (record.kind == EVENT) {
+				record.event = reader.byte();
+				if (record.event == LOST_PULSES) {
+					record.count = reader.number();
+				}
+			} else if (record.kind != PULSE) {
+				uint8_t index = reader.byte();
+				record.retained = index & 0x80;
+				index &= 0x7f;
+				if (index < sizeof(TOPICS) / sizeof(TOPICS[0])) {
+					record.topic = TOPICS[index];
+				} else {
+					record.topic = reader.string(reader.number());
+				}
+				record.payload = reader.string(reader.number());
+			}
+			if (!reader.failed()) {
+				capture.records.push_back(record);
+			}
+		}
+		if (reader.failed()) {
+			fprintf(stderr, "truncated record in chunk %u\n", number);
+			return false;
+		}
+		last = time;
+		capture.chunks++;
+		offset += length;
+	}
+	return true;
+}
+
+void printRecord(const Record& record, uint64_t start) {
+	printf("[%10.6f s] ", (record.time - start) / 1e6);
+	switch (record.kind) {
+	case PULSE:
+		printf("pulse\n");
+		break;
+	case INBOUND:
+	case OUTBOUND:
+		printf("%s %s%s %s\n", (record.kind == INBOUND) ? "in " : "out", record.topic.c_str(), record.retained ? " (retained)" : "",
+			record.payload.c_str());
+		break;
+	case EVENT: {
+		const char* names[] = {"boot", "connected", "disconnected", "lost pulses"};
+		printf("%s", (record.event >= 0 && record.event < 4) ? names[record.event] : "unknown event");
+		printf((record.event == LOST_PULSES) ? " %llu\n" : "\n", (unsigned long long) record.count);
+		break;
+	}
+	}
+}
+
+std::string withoutTotals(const std::string& state) { // The lifetime totals are the last keys of the state
+	size_t totals = state.find(",\"volumeLifetime\":");
+	return (totals == std::string::npos) ? state : state.substr(0, totals) + "}";
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+	const char* path = nullptr; // Capture file
+	unsigned boot = 1; // Boot to replay
+	bool dump = false; // Print records only
+	bool print = false; // Print messages of the simulated firmware
+	bool serial = false; // Print serial output
+
+	sim::reset();
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--boot") && i + 1 < argc) {
+			boot = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--dump")) {
+			dump = true;
+		} else if (!strcmp(argv[i], "--print")) {
+			print = true;
+		} else if (!strcmp(argv[i], "--loop") && i + 1 < argc) {
+			sim::loopTime = strtoull(argv[++i], nullptr, 10);
+		} else if (!strcmp(argv[i], "--latency") && i + 1 < argc) {
+			sim::network.latency = strtoull(argv[++i], nullptr, 10);
+		} else if (!strcmp(argv[i], "--serial")) {
+			serial = true;
+		} else if (argv[i][0] != '-' && !path) {
+			path = argv[i];
+		} else {
+			fprintf(stderr, "unknown option %s\n", argv[i]);
+			return 1;
+		}
+	}
+	if (!path) {
+		fprintf(stderr, "no capture given\n");
+		return 1;
+	}
+	sim::serialOutput = serial ? stdout : nullptr;
+
+	FILE* file = fopen(path, "rb");
+	if (!file) {
+		perror(path);
+		return 1;
+	}
+	std::vector<uint8_t> data;
+	uint8_t buffer[65536];
+	size_t size;
+	while ((size = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+		data.insert(data.end(), buffer, buffer + size);
+	}
+	fclose(file);
+	Capture capture;
+	if (!decode(data, capture)) {
+		return 1;
+	}
+
+	// Records of the selected boot
+	std::vector<Record> records;
+	unsigned boots = 0;
+	for (const Record& record : capture.records) {
+		boots += record.kind == EVENT && record.event == BOOT;
+		if (boots == boot || (boot == 1 && boots == 0)) { // Records in front of the first boot belong to it
+			records.push_back(record);
+		}
+	}
+	unsigned long lostPulses = 0;
+	for (const Record& record : records) {
+		lostPulses += record.count;
+	}
+	printf("capture: %u chunks, %u missing, %lu records lost, %lu pulses without time stamp, boot %u of %u\n", capture.chunks, capture.missing,
+		capture.dropped, lostPulses, boot, std::max(boots, 1u));
+	if (capture.missing || capture.dropped || lostPulses) {
+		printf("warning: the capture is incomplete, the replay may deviate\n");
+	}
+	if (records.empty()) {
+		fprintf(stderr, "no records for boot %u\n", boot);
+		return 1;
+	}
+	if (dump) {
+		for (const Record& record : records) {
+			printRecord(record, records.front().time);
+		}
+		return 0;
+	}
+
+	unsigned long counts[4] = {0, 0, 0, 0};
+	unsigned connects = 0;
+	std::vector<std::string> recordedStates;
+	for (const Record& record : records) {
+		counts[record.kind]++;
+		connects += record.kind == EVENT && record.event == CONNECTED;
+		if (record.kind == OUTBOUND && record.topic == CONFIG_MQTT_TOPIC_STATE) {
+			recordedStates.push_back(withoutTotals(record.payload));
+		}
+	}
+	printf("records: %lu pulses, %lu inbound, %lu outbound, %lu events, %u connects\n", counts[PULSE], counts[INBOUND], counts[OUTBOUND],
+		counts[EVENT], connects);
+
+	unsigned online = 0; // Connections of the simulated firmware
+	std::vector<std::string> replayedStates;
+	sim::broker.observe("#", [&](const sim::Message& message) {
+		if (message.topic == CONFIG_MQTT_TOPIC_CAPTURE) {
+			return;
+		}
+		if (print) {
+			printf("[%10.3f s] %s %s\n", sim::virtualClock.now() / 1e6, message.topic.c_str(), message.payload.c_str());
+		}
+		if (message.topic == CONFIG_MQTT_TOPIC_STATE) {
+			replayedStates.push_back(withoutTotals(message.payload));
+		}
+		online += message.topic == CONFIG_MQTT_TOPIC_AVAILABILITY && message.payload == CONFIG_MQTT_PAYLOAD_ONLINE;
+	});
+
+	auto wallStart = std::chrono::steady_clock::now();
+	unsigned long skipped = 0, pulses = 0, messages = 0;
+	auto pulse = []() {
+		sim::setPinLevel(CONFIG_PIN_FLOW_METER, HIGH);
+		sim::setPinLevel(CONFIG_PIN_FLOW_METER, LOW); // Falling edge
+	};
+	try {
+		setup();
+		size_t i = 0;
+		while (i < records.size() && !(records[i].kind == EVENT && records[i].event == CONNECTED)) { // Nothing to align before the first connection
+			skipped += (records[i].kind == PULSE) + (records[i].kind == INBOUND) + records[i].count;
+			i++;
+		}
+		for (unsigned connection = 1; i < records.size(); connection++) {
+			sim::broker.setOnline(true);
+			if (!sim::run(60000000, [&]() { return online >= connection; })) {
+				printf("warning: the firmware did not connect for recorded connection %u\n", connection);
+				break;
+			}
+			uint64_t offset = sim::virtualClock.now() - records[i].time; // Device time to virtual time
+			uint64_t lastPulse = records[i].time; // Device time of the last pulse, lost pulses are spread from there
+			size_t next = i + 1;
+			bool disconnected = false; // Connection was lost before the next recorded connection
+			for (; next < records.size() && !(records[next].kind == EVENT && records[next].event == CONNECTED); next++) {
+				const Record& record = records[next];
+				uint64_t time = record.time + offset;
+				if (record.kind == PULSE) {
+					pulses++;
+					lastPulse = record.time;
+					sim::virtualClock.schedule(time, pulse);
+				} else if (record.kind == EVENT && record.event == LOST_PULSES) { // Spread evenly over the gap
+					pulses += record.count;
+					for (uint64_t k = 1; k <= record.count; k++) {
+						sim::virtualClock.schedule(lastPulse + offset + (record.time - lastPulse) * k / (record.count + 1), pulse);
+					}
+				} else if (record.kind == INBOUND && record.topic != CONFIG_MQTT_TOPIC_PING) { // Latency measurements are sent by the firmware itself
+					messages++;
+					uint64_t latency = sim::network.latency;
+					sim::virtualClock.schedule((time > latency) ? time - latency : 0, [&record]() {
+						sim::broker.publish(record.topic, record.payload, record.retained);
+					});
+				} else if (record.kind == EVENT && record.event == DISCONNECTED) {
+					disconnected = true;
+					sim::virtualClock.schedule(time, []() { sim::broker.setOnline(false); });
+				}
+			}
+			uint64_t end = ((next < records.size()) ? records[next].time : records.back().time) + offset; // Start of the next connection
+			if (disconnected && next < records.size()) { // Accept the attempt which succeeded on the device, attempts are 5 s apart
+				sim::virtualClock.schedule(std::max(end, sim::virtualClock.now() + 1000000) - 1000000, []() { sim::broker.setOnline(true); });
+			}
+			if (end > sim::virtualClock.now()) {
+				sim::run(end - sim::virtualClock.now());
+			}
+			i = next;
+		}
+		sim::run(1000000); // Let the final messages settle
+	} catch (const sim::DeepSleep& sleep) {
+		printf("deep sleep after %.3f s\n", sim::virtualClock.now() / 1e6);
+	}
+	double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+
+	printf("replayed %lu pulses and %lu messages, %lu records before the first connection skipped\n", pulses, messages, skipped);
+	size_t difference = 0;
+	while (difference < recordedStates.size() && difference < replayedStates.size() && recordedStates[difference] == replayedStates[difference]) {
+		difference++;
+	}
+	printf("state messages recorded %zu, replayed %zu", recordedStates.size(), replayedStates.size());
+	if (difference < std::max(recordedStates.size(), replayedStates.size())) {
+		printf(", first difference at #%zu\n", difference + 1);
+		printf("  recorded %s\n", (difference < recordedStates.size()) ? recordedStates[difference].c_str() : "-");
+		printf("  replayed %s\n", (difference < replayedStates.size()) ? replayedStates[difference].c_str() : "-");
+	} else {
+		printf(", identical\n");
+	}
+	bool match = !recordedStates.empty() && !replayedStates.empty() && recordedStates.back() == replayedStates.back();
+	printf("final state recorded %s, replayed %s\n", recordedStates.empty() ? "-" : recordedStates.back().c_str(),
+		replayedStates.empty() ? "-" : replayedStates.back().c_str());
+	printf("simulated %.3f s in %.3f ms wall-clock time\n", sim::virtualClock.now() / 1e6, wall * 1e3);
+	return match ? 0 : 2;
+}
@@ -0,0 +1,219 @@
+/*
+ * Watering run simulation
+ *
+ * Simulates a complete watering run of the firmware using the
+ * virtual clock: the system boots, connects to the simulated
+ * broker, receives a command and waters the plants while the
+ * plant model simulates pump, tubing and flow meter. All MQTT
+ * messages are printed with their virtual time stamp, followed
+ * by the accuracy of the run. Frames of batched flow samples are
+ * printed decoded.
+ *
+ * Usage: pio run -e native && .pio/build/native/program [options]
+ *   --volume <ml>          Commanded volume (default 250)
+ *   --flow <l/min>         Flow of the pump without head (default 2.0)
+ *   --head <m>             Static head of the installation (default 0.5)
+ *   --priming <ml>         Volume of the tubing behind the flow meter (default 15)
+ *   --jitter <ratio>       Pulse jitter relative to the pulse period (default 0.05)
+ *   --seed <n>             Seed for the random numbers of the plant model (default 1)
+ *   --loop <us>            Virtual time per loop() iteration (default 100)
+ *   --latency <us>         One-way network latency (default 2000)
+ *   --outage <s>:<s>       Broker outage start and duration
+ *   --capture <file>       Write the capture chunks of the firmware to a file, requires CONFIG_CAPTURE
+ *   --trace <file>         Request a dump of the trace buffer after the run and write it to a file, requires CONFIG_TRACE
+ *   --serial               Print the serial output of the firmware
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include <Arduino.h>
+#include <Broker.h>
+#include <ESP8266WiFi.h>
+#include <HostSim.h>
+#include <PlantModel.h>
+
+#include "config.h"
+
+namespace {
+
+uint32_t fixed(const uint8_t* data, int bytes) { // Little-endian number
+	uint32_t value = 0;
+	for (int i = 0; i < bytes; i++) {
+		value |= (uint32_t) data[i] << (8 * i);
+	}
+	return value;
+}
+
+uint32_t varint(const uint8_t*& data, const uint8_t* end) {
+	uint32_t value = 0;
+	for (int shift = 0; data < end; shift += 7) {
+		value |= (uint32_t) (*data & 0x7f) << shift;
+		if (!(*data++ & 0x80)) {
+			break;
+		}
+	}
+	return value;
+}
+
+/*
+ * Decode a frame of flow samples into time in ms and volume in ml pairs
+ */
+std::string flowFrame(const std::string& payload) {
+	const uint8_t* data = (const uint8_t*) payload.data();
+	const uint8_t* end = data + payload.size();
+	if (payload.size() < 16 || data[0] != 0xf1 || data[1] != 1) {
+		return "invalid frame";
+	}
+	double pulseVolume = fixed(data + 2, 2) / 1000.0;
+	uint32_t time = fixed(data + 8, 4), pulses = fixed(data + 12, 4);
+	char text[64];
+	snprintf(text, sizeof(text), "frame %u, %u samples:", fixed(data + 4, 2), fixed(data + 6, 2));
+	std::string result = text;
+	for (data += 16; data < end;) {
+		time += varint(data, end);
+		pulses += varint(data, end);
+		snprintf(text, sizeof(text), " %u:%.3f", time, pulses * pulseVolume);
+		result += text;
+	}
+	return result;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+	double volume = 250.0; // Commanded volume in ml
+	sim::PlantParameters plant; // Parameters of the plant model
+	plant.kFactor = (CONFIG_FLOW_METER_PULSES); // Meter matches the volume per pulse used by the firmware at nominal flow
+	uint64_t seed = 1; // Seed of the plant model
+	double outageStart = -1.0, outageDuration = 0.0; // Broker outage in s
+	const char* capture = nullptr; // Capture output
+	const char* trace = nullptr; // Trace dump output
+	bool serial = false; // Print serial output
+
+	sim::reset();
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--volume") && i + 1 < argc) {
+			volume = atof(argv[++i]);
+		} else if (!strcmp(argv[i], "--flow") && i + 1 < argc) {
+			plant.maxFlow = atof(argv[++i]);
+		} else if (!strcmp(argv[i], "--head") && i + 1 < argc) {
+			plant.head = atof(argv[++i]);
+		} else if (!strcmp(argv[i], "--priming") && i + 1 < argc) {
+			plant.primingVolume = atof(argv[++i]);
+		} else if (!strcmp(argv[i], "--jitter") && i + 1 < argc) {
+			plant.jitter = atof(argv[++i]);
+		} else if (!strcmp(argv[i], "--seed") && i + 1 < argc) {
+			seed = strtoull(argv[++i], nullptr, 10);
+		} else if (!strcmp(argv[i], "--loop") && i + 1 < argc) {
+			sim::loopTime = strtoull(argv[++i], nullptr, 10);
+		} else if (!strcmp(argv[i], "--latency") && i + 1 < argc) {
+			sim::network.latency = strtoull(argv[++i], nullptr, 10);
+		} else if (!strcmp(argv[i], "--outage") && i + 1 < argc) {
+			sscanf(argv[++i], "%lf:%lf", &outageStart, &outageDuration);
+		} else if (!strcmp(argv[i], "--capture") && i + 1 < argc) {
+			capture = argv[++i];
+		} else if (!strcmp(argv[i], "--trace") && i + 1 < argc) {
+			trace = argv[++i];
+		} else if (!strcmp(argv[i], "--serial")) {
+			serial = true;
+		} else {
+			fprintf(stderr, "unknown option %s\n", argv[i]);
+			return 1;
+		}
+	}
+	sim::serialOutput = serial ? stdout : nullptr;
+
+	sim::PlantModel model(plant, seed);
+	model.attach(CONFIG_PIN_PUMP, CONFIG_PIN_FLOW_METER);
+	uint64_t pumpStart = 0, pumpStop = 0; // Virtual time the pump was switched on and off
+	sim::onPinWrite([&](uint8_t pin, int level) {
+		if (pin == CONFIG_PIN_PUMP) {
+			(level == HIGH ? pumpStart : pumpStop) = sim::virtualClock.now();
+		}
+	});
+
+	if (outageStart >= 0.0) {
+		sim::virtualClock.schedule(outageStart * 1e6, []() { sim::broker.setOnline(false); });
+		sim::virtualClock.schedule((outageStart + outageDuration) * 1e6, []() { sim::broker.setOnline(true); });
+	}
+
+	FILE* captureFile = capture ? fopen(capture, "wb") : nullptr;
+	if (capture && !captureFile) {
+		perror(capture);
+		return 1;
+	}
+	FILE* traceFile = trace ? fopen(trace, "wb") : nullptr;
+	if (trace && !traceFile) {
+		perror(trace);
+		return 1;
+	}
+	bool started = false, finished = false; // Run progress seen on the state topic
+	sim::broker.observe("#", [&](const sim::Message& message) {
+		if (message.topic == CONFIG_MQTT_TOPIC_CAPTURE) { // Binary chunks are not printed
+			if (captureFile) {
+				fwrite(message.payload.data(), 1, message.payload.size(), captureFile);
+			}
+			return;
+		}
+		if (message.topic == CONFIG_MQTT_TOPIC_TRACE) {
+			if (traceFile) {
+				fwrite(message.payload.data(), 1, message.payload.size(), traceFile);
+			}
+			return;
+		}
+		if (message.topic == CONFIG_MQTT_TOPIC_FLOW) {
+			printf("[%10.3f s] %s %s\n", sim::virtualClock.now() / 1e6, message.topic.c_str(), flowFrame(message.payload).c_str());
+			return;
+		}
+		printf("[%10.3f s] %s %s\n", sim::virtualClock.now() / 1e6, message.topic.c_str(), message.payload.c_str());
+		if (message.topic == CONFIG_MQTT_TOPIC_STATE) {
+			bool on = message.payload.find("\"" CONFIG_MQTT_PAYLOAD_ON "\"") != std::string::npos;
+			started |= on;
+			finished |= started && !on;
+		}
+	});
+
+	auto wallStart = std::chrono::steady_clock::now();
+	try {
+		setup();
+		sim::run(60000000, []() { // Wait until the firmware is online
+			const sim::Message* availability = sim::broker.retained(CONFIG_MQTT_TOPIC_AVAILABILITY);
+			return availability && availability->payload == CONFIG_MQTT_PAYLOAD_ONLINE;
+		});
+
+		char command[64];
+		snprintf(command, sizeof(command), "{\"state\": \"%s\", \"volume\": %g}", CONFIG_MQTT_PAYLOAD_ON, volume);
+		sim::broker.publish(CONFIG_MQTT_TOPIC_SET, command);
+		sim::run(24 * 3600e6, [&]() { return finished; });
+		sim::run(1000000); // Let the final messages settle
+		if (traceFile) {
+			sim::broker.publish(CONFIG_MQTT_TOPIC_SET, "{\"trace\": true}");
+			sim::run(1000000); // Wait for the dump
+		}
+		if (captureFile) {
+			sim::run(CONFIG_CAPTURE_FLUSH * 1000); // Wait for the last capture chunk
+		}
+	} catch (const sim::DeepSleep& sleep) {
+		printf("[%10.3f s] deep sleep for %.0f s\n", sim::virtualClock.now() / 1e6, sleep.duration / 1e6);
+	}
+	double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+	if (captureFile) {
+		fclose(captureFile);
+	}
+	if (traceFile) {
+		fclose(traceFile);
+	}
+
+	sim::virtualClock.advance(10000000); // Let the pump coast down
+	double metered = model.pulses() * 1000.0 / plant.kFactor;
+	printf("target %.1f ml, metered %.1f ml, pumped %.1f ml, delivered %.1f ml\n", volume, metered, model.pumpedVolume(), model.deliveredVolume());
+	printf("overshoot %.1f ml (%.2f %%), pump on for %.3f s, first pulse after %.3f s\n", model.deliveredVolume() - volume,
+		(model.deliveredVolume() - volume) / volume * 100.0, (pumpStop - pumpStart) / 1e6,
+		model.firstPulseTime() ? (model.firstPulseTime() - pumpStart) / 1e6 : 0.0);
+	printf("simulated %.3f s in %.3f ms wall-clock time\n", sim::virtualClock.now() / 1e6, wall * 1e3);
+	return finished ? 0 : 2;
+}
@@ -0,0 +1,300 @@
+/*
+ * Conversion of a trace dump to Chrome/Perfetto trace JSON
+ *
+ * Converts the trace ring published by a device with CONFIG_TRACE
+ * enabled into the JSON trace event format, which is opened by
+ * https://ui.perfetto.dev and chrome://tracing. The dump is
+ * requested by sending {"trace": true} to the set topic. The
+ * input is the concatenation of the payloads published to
+ * CONFIG_MQTT_TOPIC_TRACE, e.g. recorded with
+ * mosquitto_sub -t <topic> -N > trace.bin, or written by the run
+ * simulation with --trace.
+ *
+ * loop() iterations and callbacks are shown as nested slices on
+ * the loop track, publishes as instants on the same track, flow
+ * meter pulses as instants on the interrupt track and the pump
+ * as a counter. Slices cut off by the start of the ring are
+ * dropped, slices still open at its end are closed there.
+ *
+ * Trace format, all numbers little-endian:
+ *   Chunk:  magic 0x7e, version 1, CPU frequency in MHz, reserved,
+ *           uint16 dump number, uint16 chunk index, uint16 chunk
+ *           count, uint16 number of events, events
+ *   Event:  uint32 CPU cycle count, uint8 type (0 loop begin, 1 loop
+ *           end, 2 callback begin, 3 callback end, 4 publish, 5 pulse,
+ *           6 pump on, 7 pump off), uint8 topic index, uint16 payload
+ *           length
+ *   Topic:  index into state, set, availability, diagnostics and
+ *           ping topic, 0x7f for other topics
+ *
+ * Usage: pio run -e trace && .pio/build/trace/program [options] <dump>
+ *   --dump <n>             Convert the dump with the given number (default the last one)
+ *   --output <file>        Write the JSON to a file instead of the standard output
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <map>
+#include <vector>
+
+#include "config.h"
+
+namespace {
+
+enum Type { LOOP_BEGIN, LOOP_END, CALLBACK_BEGIN, CALLBACK_END, PUBLISH, PULSE, PUMP_ON, PUMP_OFF };
+
+struct Event {
+	uint32_t cycles; // CPU cycle count
+	uint8_t type;
+	uint8_t topic; // Topic index of messages
+	uint16_t length; // Payload length of messages
+};
+
+struct Dump {
+	unsigned frequency = 0; // CPU frequency in MHz
+	unsigned chunkCount = 0; // Number of chunks of the dump
+	std::map<unsigned, std::vector<Event>> chunks; // Events by chunk index
+};
+
+const char* const TOPICS[] = {CONFIG_MQTT_TOPIC_STATE, CONFIG_MQTT_TOPIC_SET, CONFIG_MQTT_TOPIC_AVAILABILITY, CONFIG_MQTT_TOPIC_DIAGNOSTICS,
+	CONFIG_MQTT_TOPIC_PING};
+const int LOOP_TRACK = 1; // Thread IDs of the tracks
+const int INTERRUPT_TRACK = 2;
+
+unsigned fixed(const uint8_t* data, int bytes) { // Little-endian number
+	unsigned value = 0;
+	for (int i = 0; i < bytes; i++) {
+		value |= (unsigned) data[i] << (8 * i);
+	}
+	return value;
+}
+
+bool decode(const std::vector<uint8_t>& file, std::map<unsigned, Dump>& dumps) {
+	size_t offset = 0;
+	while (offset < file.size()) {
+		const uint8_t* header = file.data() + offset;
+		if (file.size() - offset < 12 || header[0] != 0x7e || header[1] != 1) {
+			fprintf(stderr, "invalid chunk at offset %zu\n", offset);
+			return false;
+		}
+		size_t events = fixed(header + 10, 2);
+		if (file.size() - offset - 12 < events * 8) {
+			fprintf(stderr, "truncated chunk at offset %zu\n", offset);
+			return false;
+		}
+		Dump& dump = dumps[fixed(header + 4, 2)];
+		dump.frequency = header[2];
+		dump.chunkCount = fixed(header + 8, 2);
+		std::vector<Event>& chunk = dump.chunks[fixed(header + 6, 2)];
+		chunk.clear(); // A repeated chunk replaces the earlier one
+		for (size_t i = 0; i < events; i++) {
+			const uint8_t* data = header + 12 + i * 8;
+			chunk.push_back({(uint32_t) fixed(data, 4), data[4], data[5], (uint16_t) fixed(data + 6, 2)});
+		}
+		offset += 12 + events * 8;
+	}
+	return true;
+}
+
+const char* topicName(uint8_t index) {
+	return (index < sizeof(TOPICS) / sizeof(TOPICS[0])) ? TOPICS[index] : "other";
+}
+
+/*
+ * Writer for the events of the JSON trace
+ */
+class Writer {
+public:
+	explicit Writer(FILE* output) : output(output) {}
+
+	void begin() {
+		fprintf(output, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+		metadata(LOOP_TRACK, "loop()");
+		metadata(INTERRUPT_TRACK, "flow meter interrupt");
+	}
+
+	void end() {
+		fprintf(output, "\n]}\n");
+	}
+
+	void slice(const char* phase, const char* name, double time, int track) {
+		separator();
+		fprintf(output, "{\"name\": \"%s\", \"ph\": \"%s\", \"ts\": %.3f, \"pid\": 1, \"tid\": %d}", name, phase, time, track);
+	}
+
+	void message(const char* phase, const char* name, double time, const Event& event) {
+		separator();
+		fprintf(output, "{\"name\": \"%s\", \"ph\": \"%s\", \"ts\": %.3f, \"pid\": 1, \"tid\": %d%s, \"args\": {\"topic\": \"%s\", \"length\": %u}}",
+			name, phase, time, LOOP_TRACK, (phase[0] == 'i') ? ", \"s\": \"t\"" : "", topicName(event.topic), event.length);
+	}
+
+	void instant(const char* name, double time, int track) {
+		separator();
+		fprintf(output, "{\"name\": \"%s\", \"ph\": \"i\", \"s\": \"t\", \"ts\": %.3f, \"pid\": 1, \"tid\": %d}", name, time, track);
+	}
+
+	void counter(const char* name, double time, int value) {
+		separator();
+		fprintf(output, "{\"name\": \"%s\", \"ph\": \"C\", \"ts\": %.3f, \"pid\": 1, \"args\": {\"on\": %d}}", name, time, value);
+	}
+
+private:
+	void metadata(int track, const char* name) {
+		separator();
+		fprintf(output, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"%s\"}}", track, name);
+	}
+
+	void separator() {
+		fprintf(output, (count++ > 0) ? ",\n" : "");
+	}
+
+	FILE* output;
+	unsigned long count = 0; // Written events
+};
+
+} // namespace
+
+int main(int argc, char** argv) {
+	const char* path = nullptr; // Trace dump file
+	const char* outputPath = nullptr; // JSON output file
+	long selected = -1; // Dump to convert, -1 for the last one
+
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--dump") && i + 1 < argc) {
+			selected = atol(argv[++i]);
+		} else if (!strcmp(argv[i], "--output") && i + 1 < argc) {
+			outputPath = argv[++i];
+		} else if (argv[i][0] != '-' && !path) {
+			path = argv[i];
+		} else {
+			fprintf(stderr, "unknown option %s\n", argv[i]);
+			return 1;
+		}
+	}
+	if (!path) {
+		fprintf(stderr, "no trace dump given\n");
+		return 1;
+	}
+
+	FILE* file = fopen(path, "rb");
+	if (!file) {
+		perror(path);
+		return 1;
+	}
+	std::vector<uint8_t> data;
+	uint8_t buffer[65536];
+	size_t size;
+	while ((size = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+		data.insert(data.end(), buffer, buffer + size);
+	}
+	fclose(file);
+	std::map<unsigned, Dump> dumps;
+	if (!decode(data, dumps)) {
+		return 1;
+	}
+	if (dumps.empty()) {
+		fprintf(stderr, "no dump in %s\n", path);
+		return 1;
+	}
+	auto found = (selected < 0) ? std::prev(dumps.end()) : dumps.find(selected);
+	if (found == dumps.end()) {
+		fprintf(stderr, "no dump %ld in %s\n", selected, path);
+		return 1;
+	}
+	const Dump& dump = found->second;
+	if (dump.frequency == 0) {
+		fprintf(stderr, "invalid CPU frequency in dump %u\n", found->first);
+		return 1;
+	}
+	std::vector<Event> events;
+	for (const auto& chunk : dump.chunks) {
+		events.insert(events.end(), chunk.second.begin(), chunk.second.end());
+	}
+	if (dump.chunks.size() < dump.chunkCount) {
+		fprintf(stderr, "warning: %zu of %u chunks missing, the timeline has gaps\n", dump.chunkCount - dump.chunks.size(), dump.chunkCount);
+	}
+
+	FILE* output = outputPath ? fopen(outputPath, "w") : stdout;
+	if (!output) {
+		perror(outputPath);
+		return 1;
+	}
+	Writer writer(output);
+	writer.begin();
+	uint64_t cycles = 0; // Unwrapped cycle count relative to the first event
+	double time = 0.0; // Time of the current event in us
+	bool inLoop = false, inCallback = false; // Open slices
+	unsigned long counts[8] = {0};
+	for (size_t i = 0; i < events.size(); i++) {
+		const Event& event = events[i];
+		if (i > 0) {
+			cycles += (uint32_t) (event.cycles - events[i - 1].cycles); // Events are less than one counter period apart
+		}
+		time = (double) cycles / dump.frequency;
+		if (event.type < 8) {
+			counts[event.type]++;
+		}
+		switch (event.type) {
+		case LOOP_BEGIN:
+			if (inCallback) { // End is missing, e.g. after a reset
+				writer.slice("E", "callback()", time, LOOP_TRACK);
+				inCallback = false;
+			}
+			if (inLoop) {
+				writer.slice("E", "loop()", time, LOOP_TRACK);
+			}
+			writer.slice("B", "loop()", time, LOOP_TRACK);
+			inLoop = true;
+			break;
+		case LOOP_END:
+			if (inCallback) {
+				writer.slice("E", "callback()", time, LOOP_TRACK);
+				inCallback = false;
+			}
+			if (inLoop) { // Begin may be cut off by the start of the ring
+				writer.slice("E", "loop()", time, LOOP_TRACK);
+				inLoop = false;
+			}
+			break;
+		case CALLBACK_BEGIN:
+			if (inCallback) {
+				writer.slice("E", "callback()", time, LOOP_TRACK);
+			}
+			writer.message("B", "callback()", time, event);
+			inCallback = true;
+			break;
+		case CALLBACK_END:
+			if (inCallback) {
+				writer.slice("E", "callback()", time, LOOP_TRACK);
+				inCallback = false;
+			}
+			break;
+		case PUBLISH:
+			writer.message("i", "publish", time, event);
+			break;
+		case PULSE:
+			writer.instant("pulse", time, INTERRUPT_TRACK);
+			break;
+		case PUMP_ON:
+		case PUMP_OFF:
+			writer.counter("pump", time, event.type == PUMP_ON);
+			break;
+		}
+	}
+	if (inCallback) {
+		writer.slice("E", "callback()", time, LOOP_TRACK);
+	}
+	if (inLoop) {
+		writer.slice("E", "loop()", time, LOOP_TRACK);
+	}
+	writer.end();
+	if (output != stdout) {
+		fclose(output);
+	}
+
+	fprintf(stderr, "dump %u: %zu events over %.3f ms, %lu loop iterations, %lu callbacks, %lu publishes, %lu pulses\n", found->first, events.size(),
+		time / 1e3, counts[LOOP_BEGIN], counts[CALLBACK_BEGIN], counts[PUBLISH], counts[PULSE]);
+	return 0;
+}
@@ -0,0 +1,552 @@
+/*
+ * Autotuner of the pump control
+ *
+ * Fits the plant model to the runs captured on a unit and
+ * searches the shutoff compensation and, with CONFIG_PUMP_PWM,
+ * the gains of the pump controller which give the most accurate
+ * runs on the fitted model. The result is printed as a block for
+ * the config.h of the unit.
+ *
+ * The captures are recorded as for the replay, with CONFIG_CAPTURE
+ * enabled and the pump at full drive, i.e. CONFIG_PUMP_PWM disabled.
+ * The spin-up, the steady flow and the coast-down in the pulse
+ * trace determine the flow, the head and the time constants of
+ * the pump. A run starts with a JSON command switching the pump
+ * on and ends with the next published OFF state, the pulses of
+ * the following coast-down are part of the run.
+ *
+ * Both searches use the cross-entropy method: every iteration
+ * draws a population of candidates from a normal distribution,
+ * evaluates them and fits the distribution to the best ones.
+ * The simulations of an iteration are distributed over one
+ * worker process per core by sim::parallel(), every simulation
+ * runs in a freshly forked process.
+ *
+ * Capture format: see sim/replay/main.cpp
+ *
+ * Usage: pio run -e tune && .pio/build/tune/program [options] <capture>...
+ *   --volumes <ml,...>     Target volumes of the search (default: the captured ones)
+ *   --runs <n>             Runs per volume and candidate with different seeds (default 4)
+ *   --population <n>       Candidates per iteration (default 48)
+ *   --iterations <n>       Iterations of each search (default 15)
+ *   --loop <us>            Virtual time per loop() iteration (default 100)
+ *   --jobs <n>             Worker processes (default: number of cores)
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <numeric>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <Arduino.h>
+#include <Broker.h>
+#include <ESP8266WiFi.h>
+#include <HostSim.h>
+#include <PlantModel.h>
+#include <WorkerPool.h>
+
+#include "config.h"
+
+extern uint32_t shutoffVolume; // Shutoff compensation of the firmware in microlitres
+extern uint32_t flowTarget; // Flow of the run in microlitres per s
+extern float pumpKp, pumpKi, pumpKd; // Gains of the pump controller
+
+namespace {
+
+const uint64_t RUN_TAIL = 3000000; // Time after switching off the pump in which pulses belong to the run in us
+const uint64_t FIT_STEP = 10000; // Distance of the compared points of the pulse trace in us
+const uint64_t TRACK_STEP = 50000; // Distance of the flow tracking samples in us
+const double TRACKING_WEIGHT = 0.1; // Cost of one percent of flow tracking error relative to one percent of volume error
+
+struct Run {
+	double volume; // Commanded volume in ml
+	uint64_t duration; // Time the pump was on in us
+	std::vector<uint64_t> pulses; // Pulse times since switching on the pump in us
+};
+
+struct Options {
+	std::vector<double> volumes; // Empty for the captured volumes
+	int runs = 4;
+	int population = 48;
+	int iterations = 15;
+	uint64_t loopTime = 100;
+	int jobs = 0;
+};
+
+/*
+ * Dimension of a search
+ */
+struct Dimension {
+	const char* name;
+	double low, high; // Bounds of the values
+	double mean, deviation; // Distribution of the candidates
+};
+
+/*
+ * Reader for the bytes of one chunk
+ */
+class Reader {
+public:
+	Reader(const uint8_t* data, size_t size) : data(data), size(size) {}
+
+	bool done() const { return position >= size; }
+	bool failed() const { return error; }
+
+	uint32_t fixed(int bytes) { // Little-endian number
+		uint32_t value = 0;
+		for (int i = 0; i < bytes; i++) {
+			value |= (uint32_t) byte() << (8 * i);
+		}
+		return value;
+	}
+
+	uint8_t byte() {
+		if (position >= size) {
+			error = true;
+			return 0;
+		}
+		return data[position++];
+	}
+
+	uint64_t number() { // Variable length integer
+		uint64_t value = 0;
+		for (int shift = 0; shift < 64; shift += 7) {
+			uint8_t next = byte();
+			value |= (uint64_t) (next & 0x7f) << shift;
+			if (!(next & 0x80)) {
+				return value;
+			}
+		}
+		error = true;
+		return 0;
+	}
+
+	std::string string(size_t length) {
+		if (length > size - position) {
+			error = true;
+			return "";
+		}
+		std::string value((const char*) data + position, length);
+		position += length;
+		return value;
+	}
+
+private:
+	const uint8_t* data;
+	size_t size;
+	size_t position = 0;
+	bool error = false;
+};
+
+/*
+ * Read the runs of a capture
+ *
+ * Only pulses, commands on the set topic and states on the
+ * state topic are needed, other records are skipped.
+ */
+bool readCapture(const char* path, std::vector<Run>& runs) {
+	FILE* file = fopen(path, "rb");
+	if (!file) {
+		perror(path);
+		return false;
+	}
+	std::vector<uint8_t> data;
+	uint8_t buffer[65536];
+	size_t size;
+	while ((size = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+		data.insert(data.end(), buffer, buffer + size);
+	}
+	fclose(file);
+
+	size_t offset = 0;
+	uint64_t last = 0; // Unwrapped time of the last record
+	bool first = true;
+	double volume = 0.0; // Volume of the last command, kept by the firmware
+	Run run; // Run being read
+	uint64_t start = 0, stop = 0; // Time the pump of the run was switched on and off, 0 while open
+	auto finish = [&]() {
+		if (start && stop && !run.pulses.empty()) {
+			runs.push_back(run);
+		}
+		start = stop = 0;
+	};
+	while (offset < data.size()) {
+		Reader header(data.data() + offset, data.size() - offset);
+		uint8_t magic = header.byte(), version = header.byte();
+		size_t length = header.fixed(2);
+		uint16_t number = header.fixed(2);
+		header.fixed(2); // Lost records
+		uint32_t chunkStart = header.fixed(4);
+		if (header.failed() || magic != 0xca || version != 1 || length < 12 || length > data.size() - offset) {
+			fprintf(stderr, "%s: invalid chunk at offset %zu\n", path, offset);
+			return false;
+		}
+		if (number == 0 || first) { // Device booted, its clock starts over
+			finish();
+			last = first ? chunkStart : last + 1;
+			first = false;
+		}
+		uint64_t time = last + (uint32_t) (chunkStart - (uint32_t) last); // Unwrap the 32 bit device time
+
+		Reader reader(data.data() + offset + 12, length - 12);
+		while (!reader.done() && !reader.failed()) {
+			uint64_t head = reader.number();
+			time += head >> 2;
+			int kind = head & 3;
+			if (kind == 3) { // Event
+				if (reader.byte() == 3) { // Lost pulses make the trace useless
+					reader.number();
+					start = stop = 0;
+				}
+				continue;
+			}
+			if (kind == 0) { // Pulse
+				if (start && (!stop || time - stop < RUN_TAIL)) {
+					run.pulses.push_back(time - start);
+				}
+				continue;
+			}
+			uint8_t index = reader.byte() & 0x7f;
+			if (index == 0x7f) { // Other topic
+				reader.string(reader.number());
+			}
+			std::string payload = reader.string(reader.number());
+			if (kind == 1 && index == 1) { // Command
+				size_t key = payload.find("\"volume\"");
+				if (key != std::string::npos && (key = payload.find(':', key)) != std::string::npos) {
+					volume = atof(payload.c_str() + key + 1);
+				}
+				if (payload.find("\"" CONFIG_MQTT_PAYLOAD_ON "\"") != std::string::npos && (!start || stop)) { // Pump is switched on
+					finish();
+					run = {volume, 0, {}};
+					start = time;
+				}
+			} else if (kind == 2 && index == 0 && start && !stop && payload.find("\"" CONFIG_MQTT_PAYLOAD_OFF "\"") != std::string::npos) { // Pump was switched off
+				stop = time;
+				run.duration = stop - start;
+			}
+		}
+		if (reader.failed()) {
+			fprintf(stderr, "%s: truncated record in chunk %u\n", path, number);
+			return false;
+		}
+		last = time;
+		offset += length;
+	}
+	finish();
+	return true;
+}
+
+/*
+ * Pulse jitter of the runs
+ *
+ * Estimated from the standard deviation of the pulse periods
+ * relative to their median in the middle half of every run,
+ * where the flow is steady.
+ */
+double pulseJitter(const std::vector<Run>& runs) {
+	double sum = 0.0;
+	size_t count = 0;
+	for (const Run& run : runs) {
+		std::vector<double> periods;
+		for (size_t i = 1; i < run.pulses.size(); i++) {
+			if (run.pulses[i - 1] > run.duration / 4 && run.pulses[i] < run.duration * 3 / 4) {
+				periods.push_back(run.pulses[i] - run.pulses[i - 1]);
+			}
+		}
+		if (periods.size() < 10) {
+			continue;
+		}
+		std::vector<double> sorted = periods;
+		std::nth_element(sorted.begin(), sorted.begin() + sorted.size() / 2, sorted.end());
+		double median = sorted[sorted.size() / 2];
+		for (double period : periods) {
+			sum += (period - median) * (period - median) / (median * median);
+			count++;
+		}
+	}
+	return count ? std::sqrt(sum / count / 2) : 0.05; // Every period is the difference of two jittered pulses
+}
+
+sim::PlantParameters plantParameters(const std::vector<double>& values, double jitter) {
+	sim::PlantParameters plant;
+	plant.kFactor = (CONFIG_FLOW_METER_PULSES); // Meter matches the volume per pulse used by the firmware at nominal flow
+	plant.maxFlow = values[0];
+	plant.head = values[1];
+	plant.spinUpTime = values[2];
+	plant.coastDownTime = values[3];
+	plant.primingVolume = 0.0; // Not seen by the flow meter
+	plant.jitter = jitter;
+	return plant;
+}
+
+/*
+ * Squared pulse count error of the plant model for a captured run
+ *
+ * The pump of the model is switched on and off at the captured
+ * times and its pulse count compared with the captured one every
+ * FIT_STEP until RUN_TAIL after switching off.
+ */
+double fitError(const Run& run, const sim::PlantParameters& plant) {
+	sim::reset();
+	sim::serialOutput = nullptr;
+	sim::PlantModel model(plant, 1);
+	model.attach(CONFIG_PIN_PUMP, CONFIG_PIN_FLOW_METER);
+	digitalWrite(CONFIG_PIN_PUMP, HIGH);
+	sim::virtualClock.schedule(run.duration, []() { digitalWrite(CONFIG_PIN_PUMP, LOW); });
+	double sum = 0.0;
+	size_t count = 0, captured = 0;
+	for (uint64_t time = FIT_STEP; time <= run.duration + RUN_TAIL; time += FIT_STEP) {
+		sim::virtualClock.advanceTo(time);
+		while (captured < run.pulses.size() && run.pulses[captured] <= time) {
+			captured++;
+		}
+		double difference = (double) model.pulses() - captured;
+		sum += difference * difference;
+		count++;
+	}
+	return sum / count;
+}
+
+/*
+ * Simulate a run of the firmware with the given compensation and gains
+ *
+ * Returns the absolute volume error in percent of the target
+ * plus the weighted mean flow tracking error in percent while
+ * the flow of the run is held, NaN if the run did not finish.
+ */
+double tuneError(const sim::PlantParameters& plant, double volume, uint64_t seed, const std::vector<double>& candidate, const Options& options) {
+	sim::reset();
+	sim::serialOutput = nullptr;
+	sim::loopTime = options.loopTime;
+	shutoffVolume = candidate[0] * 1000.0 + 0.5;
+	if (CONFIG_PUMP_PWM) {
+		pumpKp = candidate[1];
+		pumpKi = candidate[2];
+		pumpKd = candidate[3];
+	}
+	sim::PlantModel model(plant, seed);
+	model.attach(CONFIG_PIN_PUMP, CONFIG_PIN_FLOW_METER);
+
+	uint64_t pumpStart = 0; // Virtual time the pump was switched on
+	sim::onPinWrite([&](uint8_t pin, int level) {
+		if (pin == CONFIG_PIN_PUMP && level == HIGH) {
+			pumpStart = sim::virtualClock.now();
+		}
+	});
+	double tracking = 0.0; // Sum of the relative flow errors
+	size_t samples = 0;
+	std::function<void()> sample = [&]() { // Flow between soft start and final approach
+		if (pumpStart && sim::virtualClock.now() - pumpStart > (CONFIG_PUMP_SOFT_START + 1000) * 1000ULL &&
+			model.pumpedVolume() < volume - CONFIG_PUMP_APPROACH_VOLUME - 5.0 && flowTarget > 0) {
+			tracking += std::fabs(model.flow() * 1e6 / 60.0 - flowTarget) / flowTarget;
+			samples++;
+		}
+		sim::virtualClock.scheduleIn(TRACK_STEP, sample);
+	};
+	if (CONFIG_PUMP_PWM) {
+		sim::virtualClock.scheduleIn(TRACK_STEP, sample);
+	}
+
+	bool started = false, finished = false;
+	sim::broker.observe(CONFIG_MQTT_TOPIC_STATE, [&](const sim::Message& message) {
+		bool on = message.payload.find("\"" CONFIG_MQTT_PAYLOAD_ON "\"") != std::string::npos;
+		started |= on;
+		finished |= started && !on;
+	});
+	try {
+		setup();
+		sim::run(60000000, []() {
+			const sim::Message* availability = sim::broker.retained(CONFIG_MQTT_TOPIC_AVAILABILITY);
+			return availability && availability->payload == CONFIG_MQTT_PAYLOAD_ONLINE;
+		});
+		char command[64];
+		snprintf(command, sizeof(command), "{\"state\": \"%s\", \"volume\": %g}", CONFIG_MQTT_PAYLOAD_ON, volume);
+		sim::broker.publish(CONFIG_MQTT_TOPIC_SET, command);
+		sim::run(3600000000ULL, [&]() { return finished; });
+	} catch (const sim::DeepSleep&) {
+	}
+	if (!finished) {
+		return NAN;
+	}
+	while (model.speed() > 0.0 && sim::virtualClock.step()) { // Let the pump coast down
+	}
+	double error = std::fabs(model.pumpedVolume() - volume) / volume * 100.0;
+	return error + (samples ? TRACKING_WEIGHT * tracking / samples * 100.0 : 0.0);
+}
+
+/*
+ * Cross-entropy search
+ *
+ * Minimises the mean of the given number of simulations per
+ * candidate. The mean of the distribution is part of every
+ * population, so the result never gets worse than the best
+ * candidate seen. Returns the best candidate and its cost.
+ */
+std::vector<double> search(const char* name, std::vector<Dimension> dimensions, size_t simulations, const Options& options, int jobs,
+	const std::function<double(const std::vector<double>&, size_t)>& simulation, double& bestCost) {
+	std::mt19937_64 random(1);
+	std::vector<double> best;
+	bestCost = INFINITY;
+	size_t elite = std::max(2, options.population / 6);
+	for (int iteration = 0; iteration < options.iterations; iteration++) {
+		std::vector<std::vector<double>> candidates(options.population);
+		for (int c = 0; c < options.population; c++) {
+			for (const Dimension& dimension : dimensions) {
+				std::normal_distribution<double> distribution(dimension.mean, dimension.deviation);
+				double value = (c == 0) ? dimension.mean : distribution(random);
+				candidates[c].push_back(std::min(std::max(value, dimension.low), dimension.high));
+			}
+		}
+		std::vector<double> results = sim::parallel(candidates.size() * simulations, jobs,
+			[&](size_t index) { return simulation(candidates[index / simulations], index % simulations); });
+		std::vector<double> costs(candidates.size(), 0.0);
+		for (size_t c = 0; c < candidates.size(); c++) {
+			for (size_t s = 0; s < simulations; s++) {
+				double result = results[c * simulations + s];
+				costs[c] += std::isnan(result) ? INFINITY : result / simulations; // A failed run disqualifies the candidate
+			}
+		}
+		std::vector<size_t> order(candidates.size());
+		std::iota(order.begin(), order.end(), 0);
+		std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return costs[a] < costs[b]; });
+		if (costs[order[0]] < bestCost) {
+			bestCost = costs[order[0]];
+			best = candidates[order[0]];
+		}
+		for (size_t d = 0; d < dimensions.size(); d++) { // Fit the distribution to the elite
+			double mean = 0.0, variance = 0.0;
+			for (size_t e = 0; e < elite; e++) {
+				mean += candidates[order[e]][d] / elite;
+			}
+			for (size_t e = 0; e < elite; e++) {
+				variance += (candidates[order[e]][d] - mean) * (candidates[order[e]][d] - mean) / elite;
+			}
+			dimensions[d].mean = mean;
+			dimensions[d].deviation = std::max(std::sqrt(variance), (dimensions[d].high - dimensions[d].low) * 1e-4);
+		}
+		fprintf(stderr, "\r%s: iteration %d / %d, cost %.4g", name, iteration + 1, options.iterations, bestCost);
+	}
+	fprintf(stderr, "\n");
+	return best;
+}
+
+std::vector<double> parseList(const char* list) {
+	std::vector<double> values;
+	for (const char* p = list; *p; p += (*p == ',')) {
+		char* end;
+		values.push_back(strtod(p, &end));
+		p = end;
+	}
+	return values;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+	Options options;
+	std::vector<const char*> paths; // Capture files
+	for (int i = 1; i < argc; i++) {
+		if (argv[i][0] != '-') {
+			paths.push_back(argv[i]);
+		} else if (i + 1 >= argc) {
+			fprintf(stderr, "missing value for %s\n", argv[i]);
+			return 1;
+		} else if (!strcmp(argv[i], "--volumes")) {
+			options.volumes = parseList(argv[++i]);
+		} else if (!strcmp(argv[i], "--runs")) {
+			options.runs = std::max(1, atoi(argv[++i]));
+		} else if (!strcmp(argv[i], "--population")) {
+			options.population = std::max(4, atoi(argv[++i]));
+		} else if (!strcmp(argv[i], "--iterations")) {
+			options.iterations = std::max(1, atoi(argv[++i]));
+		} else if (!strcmp(argv[i], "--loop")) {
+			options.loopTime = strtoull(argv[++i], nullptr, 10);
+		} else if (!strcmp(argv[i], "--jobs")) {
+			options.jobs = atoi(argv[++i]);
+		} else {
+			fprintf(stderr, "unknown option %s\n", argv[i]);
+			return 1;
+		}
+	}
+	if (paths.empty()) {
+		fprintf(stderr, "no capture given\n");
+		return 1;
+	}
+	std::vector<Run> runs;
+	for (const char* path : paths) {
+		if (!readCapture(path, runs)) {
+			return 1;
+		}
+	}
+	if (runs.empty()) {
+		fprintf(stderr, "no complete run in the captures\n");
+		return 1;
+	}
+	if (options.volumes.empty()) {
+		for (const Run& run : runs) {
+			if (run.volume > 0.0 && std::find(options.volumes.begin(), options.volumes.end(), run.volume) == options.volumes.end()) {
+				options.volumes.push_back(run.volume);
+			}
+		}
+		std::sort(options.volumes.begin(), options.volumes.end());
+	}
+	int jobs = sim::workerCount(options.jobs);
+	fprintf(stderr, "%zu runs in %zu captures, %d jobs\n", runs.size(), paths.size(), jobs);
+
+	// Fit the plant model to the pulse traces
+	double jitter = pulseJitter(runs);
+	sim::PlantParameters defaults;
+	std::vector<Dimension> plantDimensions = {
+		{"maxFlow", 0.1, 10.0, defaults.maxFlow, 1.0},
+		{"head", 0.0, defaults.shutoffHead * 0.95, defaults.head, 0.5},
+		{"spinUpTime", 0.01, 2.0, defaults.spinUpTime, 0.1},
+		{"coastDownTime", 0.01, 3.0, defaults.coastDownTime, 0.2},
+	};
+	double fitCost;
+	std::vector<double> fitted = search("plant fit", plantDimensions, runs.size(), options, jobs,
+		[&](const std::vector<double>& candidate, size_t run) { return fitError(runs[run], plantParameters(candidate, 0.0)); }, fitCost);
+	sim::PlantParameters plant = plantParameters(fitted, jitter);
+
+	// Search compensation and gains on the fitted model
+	std::vector<Dimension> tuneDimensions = {{"compensation", 0.0, 50.0, 5.0, 5.0}};
+	if (CONFIG_PUMP_PWM) {
+		tuneDimensions.push_back({"kp", 0.0, 0.2, CONFIG_PUMP_KP, 0.02});
+		tuneDimensions.push_back({"ki", 0.0, 1.0, CONFIG_PUMP_KI, 0.05});
+		tuneDimensions.push_back({"kd", 0.0, 0.01, CONFIG_PUMP_KD, 0.001});
+	}
+	size_t simulations = options.volumes.size() * options.runs;
+	double tuneCost;
+	std::vector<double> tuned = search("controller", tuneDimensions, simulations, options, jobs,
+		[&](const std::vector<double>& candidate, size_t index) {
+			return tuneError(plant, options.volumes[index % options.volumes.size()], index / options.volumes.size() + 1, candidate, options);
+		},
+		tuneCost);
+
+	printf("// Autotuned from %zu runs of %s", runs.size(), paths[0]);
+	for (size_t i = 1; i < paths.size(); i++) {
+		printf(", %s", paths[i]);
+	}
+	printf("\n// Fitted plant: maximum flow %.3f l/min, head %.3f m, spin-up %.3f s, coast-down %.3f s, pulse jitter %.3f, RMS error %.2f pulses\n",
+		plant.maxFlow, plant.head, plant.spinUpTime, plant.coastDownTime, plant.jitter, std::sqrt(fitCost));
+	printf("// Volumes ");
+	for (size_t i = 0; i < options.volumes.size(); i++) {
+		printf("%s%g", i ? "," : "", options.volumes[i]);
+	}
+	printf(" ml, %d runs each, mean cost %.3f (volume error in %%%s)\n", options.runs, tuneCost,
+		CONFIG_PUMP_PWM ? " plus flow tracking error in % weighted by 0.1" : "");
+	printf("#define CONFIG_SHUTOFF_COMPENSATION %.1f // Volume flowing after the pump is switched off in ml, the pump stops early by this amount\n",
+		tuned[0]);
+	if (CONFIG_PUMP_PWM) {
+		printf("#define CONFIG_PUMP_KP %.4g // Proportional gain in duty per ul/s\n", tuned[1]);
+		printf("#define CONFIG_PUMP_KI %.4g // Integral gain in duty per ul/s and s\n", tuned[2]);
+		printf("#define CONFIG_PUMP_KD %.4g // Derivative gain in duty per ul/s^2, acts on the measured flow\n", tuned[3]);
+	}
+	return 0;
+}
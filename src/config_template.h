@@ -20,11 +20,29 @@
 #define CONFIG_MQTT_PASS "Password" // MQTT borker password
 #define CONFIG_MQTT_CLIENT_ID "ESP_Watering" // MQTT broker client ID. Must be unique on the MQTT network
 #define CONFIG_MQTT_UPDATE_FREQ 100 // MQTT status update delay in ms
+#define CONFIG_MQTT_BINARY false // Accept MessagePack commands on the set topic with the suffix /msgpack, answered on the state topic with the same suffix
 
 // MQTT Topics
 #define CONFIG_MQTT_TOPIC_STATE "home-assistant/watering" // MQTT topic for system status information
 #define CONFIG_MQTT_TOPIC_SET "home-assistant/watering/set" // MQTT topic for set values
 #define CONFIG_MQTT_TOPIC_AVAILABILITY "home-assistant/watering/availability" // MQTT topic for system avalability information
+#define CONFIG_MQTT_TOPIC_DIAGNOSTICS "home-assistant/watering/diagnostics" // MQTT topic for diagnostic information
+#define CONFIG_MQTT_TOPIC_PING "home-assistant/watering/ping" // MQTT topic for measuring the command latency
+#define CONFIG_MQTT_TOPIC_CAPTURE "home-assistant/watering/capture" // MQTT topic for captured traffic and flow meter pulses
+#define CONFIG_MQTT_TOPIC_TRACE "home-assistant/watering/trace" // MQTT topic for dumps of the trace buffer
+#define CONFIG_MQTT_TOPIC_LOG "home-assistant/watering/log" // MQTT topic for log messages
+#define CONFIG_MQTT_TOPIC_RUN "home-assistant/watering/run" // MQTT topic for the summary of every finished run
+#define CONFIG_MQTT_TOPIC_HISTORY "home-assistant/watering/history" // MQTT topic for pages of the run history
+#define CONFIG_MQTT_TOPIC_HISTORY_GET "home-assistant/watering/history/get" // MQTT topic for requesting the runs after a given job number
+#define CONFIG_MQTT_TOPIC_BACKLOG "home-assistant/watering/backlog" // MQTT topic for state updates buffered while the broker was unreachable
+#define CONFIG_MQTT_TOPIC_FLOW "home-assistant/watering/flow" // MQTT topic for batched flow samples
+#define CONFIG_MQTT_TOPIC_CALIBRATE "home-assistant/watering/calibrate" // MQTT topic for starting and completing a flow meter calibration
+#define CONFIG_MQTT_TOPIC_CALIBRATION "home-assistant/watering/calibration" // MQTT topic for the K-factor table of the flow meter
+
+// WiFi power saving
+#define CONFIG_WIFI_POWER_PROFILE WIFI_MODEM_SLEEP // WiFi power saving while idle (WIFI_NONE_SLEEP, WIFI_MODEM_SLEEP or WIFI_LIGHT_SLEEP)
+#define CONFIG_WIFI_IDLE_DELAY 100 // Delay per loop while idle in ms, allows WiFi power saving
+#define CONFIG_DIAGNOSTICS_FREQ 60000 // Command latency measurement and diagnostics update delay in ms
 
 // MQTT Payloads
 #define CONFIG_MQTT_PAYLOAD_ON "ON" // MQTT payload for indicating on-state
@@ -33,7 +51,66 @@
 #define CONFIG_MQTT_PAYLOAD_OFFLINE "offline" // MQTT payload for indicating offline-state
 
 // Flow Meter
-#define CONFIG_FLOW_METER_PULSES 1925 * 3 / 2 // Flow Meter pulses per liter
+#define CONFIG_FLOW_METER_PULSES (1925 * 3 / 2) // Flow Meter pulses per liter
+#define CONFIG_SHUTOFF_COMPENSATION 0.0 // Volume flowing after the pump is switched off in ml, the pump stops early by this amount
+
+// Pump speed control
+#define CONFIG_PUMP_PWM false // Drive the pump by PWM and control its speed toward the flow of the run. Requires a pump driver which can be switched at CONFIG_PUMP_PWM_FREQ
+#define CONFIG_PUMP_PWM_FREQ 1000 // PWM frequency in Hz
+#define CONFIG_PUMP_FLOW 1.5 // Flow of a run in l/min, unless a command gives its own with "flow"
+#define CONFIG_PUMP_MIN_DUTY 400 // Lowest duty cycle of 1023 while running, keeps the pump turning
+#define CONFIG_PUMP_KP 0.02 // Proportional gain in duty per ul/s
+#define CONFIG_PUMP_KI 0.05 // Integral gain in duty per ul/s and s
+#define CONFIG_PUMP_KD 0.0 // Derivative gain in duty per ul/s^2, acts on the measured flow
+#define CONFIG_PUMP_CONTROL_INTERVAL 100 // Time between two controller updates in ms
+#define CONFIG_PUMP_SOFT_START 1000 // Time to ramp the flow up from CONFIG_PUMP_APPROACH_FLOW in ms
+#define CONFIG_PUMP_APPROACH_VOLUME 20 // Volume before the target in ml, in which the flow is reduced toward CONFIG_PUMP_APPROACH_FLOW
+#define CONFIG_PUMP_APPROACH_FLOW 0.4 // Flow at the end of a run in l/min
+
+// Lifetime totals
+#define CONFIG_TOTALIZER true // Keep the lifetime volume, flow meter pulses and run count in flash and publish them with the state. Requires a flash layout with file system
+#define CONFIG_TOTALIZER_INTERVAL 600000 // Minimum time between two writes of the totals to flash in ms, runs since the last write are lost on power failure
+#define CONFIG_TOTALIZER_SECTORS 2 // Flash sectors of 4 KB used for the totals at the start of the file system region, at least 2
+
+// Run history
+#define CONFIG_HISTORY true // Keep the summaries of the last runs in flash, to be fetched by MQTT. Requires a flash layout with file system
+#define CONFIG_HISTORY_SECTORS 4 // Flash sectors of 4 KB used for the history behind the totals, at least 2, each holds 102 runs
+#define CONFIG_HISTORY_PAGE 8 // Maximum number of runs per history page
+
+// Deep sleep
+#define CONFIG_SLEEP_ENABLED false // Deep-sleep between scheduled watering runs. Requires GPIO16 to be wired to RST
+#define CONFIG_SLEEP_INTERVAL 43200 // Time between two scheduled watering runs in s
+#define CONFIG_SLEEP_VOLUME 250 // Volume watered on every scheduled run in ml
+#define CONFIG_SLEEP_AWAKE_TIME 10000 // Time to stay awake for MQTT commands after a run in ms
+#define CONFIG_SLEEP_CONNECT_TIMEOUT 10000 // Time to wait for WiFi before watering offline in ms
+#define CONFIG_SLEEP_CONNECT_ATTEMPTS 3 // MQTT connection attempts before watering offline
+
+// Batched flow samples
+#define CONFIG_FLOW_SAMPLES false // Publish the progress of a run as batched flow samples instead of a state update every CONFIG_MQTT_UPDATE_FREQ
+#define CONFIG_FLOW_SAMPLE_RATE 50 // Time between two flow samples in ms
+#define CONFIG_FLOW_SAMPLE_BATCH 2000 // Time between two frames of flow samples in ms
+
+// Flow meter calibration
+#define CONFIG_CALIBRATION true // Calibrate the flow meter by MQTT and keep the K-factor table in flash behind the history. Requires a flash layout with file system
+#define CONFIG_CALIBRATION_SECTORS 2 // Flash sectors of 4 KB used for the K-factor table, at least 2
+#define CONFIG_CALIBRATION_LIMIT 2000 // Volume at which a calibration run is stopped in ml
+
+// Backlog of state updates while the MQTT broker is unreachable
+#define CONFIG_BACKLOG_SIZE 2048 // Size of the backlog in bytes, an update during a run takes about 4 bytes
+
+// Capture of MQTT traffic and flow meter pulses for replay on the host
+#define CONFIG_CAPTURE false // Publish all MQTT messages and flow meter pulses to the capture topic
+#define CONFIG_CAPTURE_SIZE 512 // Size of a capture chunk in bytes
+#define CONFIG_CAPTURE_FLUSH 5000 // Maximum delay before a capture chunk is published in ms
+
+// Trace buffer for a timeline of the control loop
+#define CONFIG_TRACE false // Record loop iterations, callbacks, publishes, flow meter pulses and pump switching with CPU cycle time stamps
+#define CONFIG_TRACE_SIZE 256 // Number of events kept in the trace buffer, 8 bytes each
 
 // Enables Serial and print statements
 #define CONFIG_DEBUG false
+#define CONFIG_LOG_LEVEL LOG_LEVEL_INFO // Most detailed log level compiled in (LOG_LEVEL_NONE, LOG_LEVEL_ERROR, LOG_LEVEL_WARNING, LOG_LEVEL_INFO or LOG_LEVEL_DEBUG)
+#define CONFIG_LOG_BUFFER_SIZE 1024 // Log output waiting for the serial interface or MQTT in bytes, lines not fitting are dropped
+#define CONFIG_LOG_MQTT false // Publish log messages to the log topic, also without CONFIG_DEBUG
+#define CONFIG_LOG_BATCH_SIZE 512 // Maximum size of a batch of log messages in bytes
+#define CONFIG_LOG_BATCH_DELAY 10000 // Maximum delay before a batch of log messages is published in ms
@@ -14,18 +14,1233 @@
 
 #include "config.h" // Set configuration options for pins, WiFi, and MQTT in this file
 #include <ESP8266WiFi.h>
+#include <flash_hal.h> // File system region of the flash
 #include <PubSubClient.h> // http://pubsubclient.knolleary.net/
 #include <ArduinoJson.h> // https://github.com/bblanchon/ArduinoJson
 
-const int JSON_DOCUMENT_SIZE = JSON_OBJECT_SIZE(3); // JSON buffer is used for handling JSON objects
+// Log levels, messages above CONFIG_LOG_LEVEL are not compiled in, the format strings are kept in flash
+#define LOG_LEVEL_NONE 0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARNING 2
+#define LOG_LEVEL_INFO 3
+#define LOG_LEVEL_DEBUG 4
+#define LOG_LEVEL ((CONFIG_DEBUG || CONFIG_LOG_MQTT) ? CONFIG_LOG_LEVEL : LOG_LEVEL_NONE) // Log output requires the serial interface or MQTT
+
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+#define LOG_ERROR(format, ...) logWrite('E', PSTR(format), ##__VA_ARGS__)
+#else
+#define LOG_ERROR(format, ...) do {} while (0)
+#endif
+#if LOG_LEVEL >= LOG_LEVEL_WARNING
+#define LOG_WARNING(format, ...) logWrite('W', PSTR(format), ##__VA_ARGS__)
+#else
+#define LOG_WARNING(format, ...) do {} while (0)
+#endif
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOG_INFO(format, ...) logWrite('I', PSTR(format), ##__VA_ARGS__)
+#else
+#define LOG_INFO(format, ...) do {} while (0)
+#endif
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(format, ...) logWrite('D', PSTR(format), ##__VA_ARGS__)
+#else
+#define LOG_DEBUG(format, ...) do {} while (0)
+#endif
+
+const int JSON_DOCUMENT_SIZE = JSON_OBJECT_SIZE(6); // JSON buffer is used for handling JSON objects
+const uint16_t MQTT_BUFFER_SIZE = 512; // MQTT packet buffer, fits the diagnostic information
+const size_t TOPIC_SIZE = 128; // Buffer for a topic copied from flash, longer topics are truncated
 bool state = false; // state refers to the state of the pump: on / off
 unsigned long millis_time; // Time for status update delay
-float volumeTotal = 0.0; // Total commanded volume for plant watering in ml
-float volumeCurrent = -1.0; // Currently flown volume
+const uint32_t PULSE_VOLUME = 1000000000.0 / (CONFIG_FLOW_METER_PULSES) + 0.5; // Nominal volume per flow meter pulse in nanolitres
+uint32_t pulseVolume = PULSE_VOLUME; // Volume per pulse at the current flow in nanolitres, follows the calibration
+uint64_t meterVolume = 0; // Volume of the current run in nanolitres, converted from the pulses
+uint32_t meterPulses = 0; // Pulses converted into meterVolume
+uint32_t meterPulseTime = 0; // Time of the last converted pulse in us
+uint32_t meterFlow = 0; // Flow measured between the last converted pulses in microlitres per s
+uint32_t volumeTarget = 0; // Commanded volume for plant watering in microlitres
+volatile uint32_t pulseCount = 0; // Flow meter pulses of the current run, counted by the interrupt
+bool pumpActive = false; // Pump is running
+unsigned long updateInterval = CONFIG_MQTT_UPDATE_FREQ; // Status update delay in ms
+uint32_t shutoffVolume = CONFIG_SHUTOFF_COMPENSATION * 1000.0 + 0.5; // Volume flowing after the pump is switched off in microlitres
+const uint32_t PUMP_FLOW = CONFIG_PUMP_FLOW * 1000000.0 / 60 + 0.5; // Default flow of a run in microlitres per s
+uint32_t flowTarget = PUMP_FLOW; // Flow of the run in microlitres per s, kept until the next flow command
+bool offline = false; // MQTT connection was given up for the current wake period
+unsigned long activity_time = 0; // Time of the last run or command for the deep sleep awake window
+bool stateBinary = false; // State is published as MessagePack, follows the format of the last command
+const unsigned long MQTT_RETRY_DELAY = 5000; // Delay between two MQTT connection attempts in ms
+int mqttAttempts = 0; // Failed MQTT connection attempts since the connection was lost
+unsigned long mqtt_time = 0; // Time of the last MQTT connection attempt
+
+// MQTT topics and payloads, kept in flash to save RAM
+#define MQTT_BINARY_SUFFIX "/msgpack" // Suffix of the topics carrying MessagePack instead of JSON
+const char TOPIC_STATE[] PROGMEM = CONFIG_MQTT_TOPIC_STATE;
+const char TOPIC_SET[] PROGMEM = CONFIG_MQTT_TOPIC_SET;
+const char TOPIC_AVAILABILITY[] PROGMEM = CONFIG_MQTT_TOPIC_AVAILABILITY;
+const char TOPIC_DIAGNOSTICS[] PROGMEM = CONFIG_MQTT_TOPIC_DIAGNOSTICS;
+const char TOPIC_PING[] PROGMEM = CONFIG_MQTT_TOPIC_PING;
+const char TOPIC_CAPTURE[] PROGMEM = CONFIG_MQTT_TOPIC_CAPTURE;
+const char TOPIC_TRACE[] PROGMEM = CONFIG_MQTT_TOPIC_TRACE;
+const char TOPIC_LOG[] PROGMEM = CONFIG_MQTT_TOPIC_LOG;
+const char TOPIC_RUN[] PROGMEM = CONFIG_MQTT_TOPIC_RUN;
+const char TOPIC_HISTORY[] PROGMEM = CONFIG_MQTT_TOPIC_HISTORY;
+const char TOPIC_HISTORY_GET[] PROGMEM = CONFIG_MQTT_TOPIC_HISTORY_GET;
+const char TOPIC_BACKLOG[] PROGMEM = CONFIG_MQTT_TOPIC_BACKLOG;
+const char TOPIC_FLOW[] PROGMEM = CONFIG_MQTT_TOPIC_FLOW;
+const char TOPIC_CALIBRATE[] PROGMEM = CONFIG_MQTT_TOPIC_CALIBRATE;
+const char TOPIC_CALIBRATION[] PROGMEM = CONFIG_MQTT_TOPIC_CALIBRATION;
+const char TOPIC_STATE_BINARY[] PROGMEM = CONFIG_MQTT_TOPIC_STATE MQTT_BINARY_SUFFIX;
+const char TOPIC_SET_BINARY[] PROGMEM = CONFIG_MQTT_TOPIC_SET MQTT_BINARY_SUFFIX;
+const char PAYLOAD_ON[] PROGMEM = CONFIG_MQTT_PAYLOAD_ON;
+const char PAYLOAD_OFF[] PROGMEM = CONFIG_MQTT_PAYLOAD_OFF;
+const char PAYLOAD_ONLINE[] PROGMEM = CONFIG_MQTT_PAYLOAD_ONLINE;
+const char PAYLOAD_OFFLINE[] PROGMEM = CONFIG_MQTT_PAYLOAD_OFFLINE;
+
+// WiFi power saving profiles, indexed by WiFiSleepType_t
+const char PROFILE_NONE[] PROGMEM = "none";
+const char PROFILE_LIGHT[] PROGMEM = "light";
+const char PROFILE_MODEM[] PROGMEM = "modem";
+const char* const POWER_PROFILE_NAMES[] PROGMEM = {PROFILE_NONE, PROFILE_LIGHT, PROFILE_MODEM}; // Profile names used in MQTT messages
+const float POWER_PROFILE_CURRENT[] = {70.0, 0.9, 15.0}; // Typical current consumption per profile in mA (ESP8266 datasheet)
+WiFiSleepType_t powerProfile = CONFIG_WIFI_POWER_PROFILE; // Selected power saving profile while idle
+WiFiSleepType_t powerMode = WIFI_NONE_SLEEP; // Currently applied power saving profile
+unsigned long powerTime[3] = {0, 0, 0}; // Time spent in each profile in ms
+float powerLatency[3] = {-1.0, -1.0, -1.0}; // Average command latency per profile in ms, -1.0 if not measured
+unsigned long power_time = 0; // Time the current profile was applied
+unsigned long ping_time = 0; // Time of the last latency measurement
+WiFiSleepType_t pingMode = WIFI_NONE_SLEEP; // Profile applied while the last latency measurement was sent
+size_t mqttBufferUsed = 0; // Largest MQTT packet sent or received in bytes, high-water mark of the MQTT buffer
+
+// Command keys, the index of a key is the bit of its COMMAND_* flag
+const uint8_t COMMAND_STATE = 1; // Flags of the values contained in a command
+const uint8_t COMMAND_VOLUME = 2;
+const uint8_t COMMAND_POWER_PROFILE = 4;
+const uint8_t COMMAND_TRACE = 8;
+const uint8_t COMMAND_FLOW = 16;
+const size_t COMMAND_KEY_SIZE = 13; // Longest key including the terminator
+constexpr char COMMAND_KEYS[][COMMAND_KEY_SIZE] PROGMEM = {"state", "volume", "powerProfile", "trace", "flow"};
+const size_t COMMAND_KEY_COUNT = sizeof(COMMAND_KEYS) / sizeof(COMMAND_KEYS[0]);
+const size_t COMMAND_KEY_SLOTS = 8; // Size of the key hash table, a power of two
+const int JSON_NESTING_LIMIT = 10; // Deepest nesting of skipped values, as ArduinoJson
+
+/*
+ * Command received on the set topic
+ *
+ * Only the values whose flag is set in keys are applied.
+ * An unknown power profile name is stored as -1, which
+ * only reapplies the selected profile.
+ */
+struct Command {
+	uint8_t keys; // COMMAND_* flags of the contained values
+	bool state; // Requested pump state
+	float volume; // Requested volume in ml
+	float flow; // Requested flow in l/min
+	int8_t powerProfile; // Requested power saving profile, -1 if unknown
+};
+
+/*
+ * Hash of a command key
+ *
+ * The first character and the length of the keys are
+ * distinct in the lowest three bits, which makes the hash
+ * perfect for the keys in COMMAND_KEYS. Other keys hash to
+ * an arbitrary slot and are rejected by comparing the key.
+ */
+constexpr size_t commandKeyHash(char first, size_t length) {
+	return ((uint8_t) first ^ length) & (COMMAND_KEY_SLOTS - 1);
+}
+
+struct CommandKeyTable {
+	int8_t index[COMMAND_KEY_SLOTS]; // Key index by hash, -1 for unused slots
+	bool perfect; // No two keys share a slot
+};
+
+constexpr CommandKeyTable commandKeyTable() { // Build the hash table at compile time
+	CommandKeyTable table = {{}, true};
+	for (size_t slot = 0; slot < COMMAND_KEY_SLOTS; slot++) {
+		table.index[slot] = -1;
+	}
+	for (size_t key = 0; key < COMMAND_KEY_COUNT; key++) {
+		size_t length = 0;
+		while (COMMAND_KEYS[key][length]) {
+			length++;
+		}
+		size_t slot = commandKeyHash(COMMAND_KEYS[key][0], length);
+		table.perfect = table.perfect && table.index[slot] < 0;
+		table.index[slot] = key;
+	}
+	return table;
+}
+
+constexpr CommandKeyTable COMMAND_KEY_TABLE PROGMEM = commandKeyTable();
+static_assert(COMMAND_KEY_TABLE.perfect, "command keys collide in commandKeyHash()");
+
+// Types of MessagePack values
+const uint8_t MSGPACK_NIL = 0;
+const uint8_t MSGPACK_BOOLEAN = 1;
+const uint8_t MSGPACK_NUMBER = 2;
+const uint8_t MSGPACK_STRING = 3;
+const uint8_t MSGPACK_ARRAY = 4;
+const uint8_t MSGPACK_MAP = 5;
+const uint8_t MSGPACK_OTHER = 6; // Binary data and extensions
+const uint8_t STATE_KEY_STATE = 0; // Keys of the MessagePack state, replacing state, volumeTarget and volumeCurrent
+const uint8_t STATE_KEY_TARGET = 1;
+const uint8_t STATE_KEY_CURRENT = 2;
+const uint8_t STATE_KEY_VOLUME_LIFETIME = 3; // Keys of the lifetime totals, replacing volumeLifetime, pulsesLifetime and runs
+const uint8_t STATE_KEY_PULSES_LIFETIME = 4;
+const uint8_t STATE_KEY_RUNS = 5;
+
+struct MsgPackValue {
+	uint8_t type; // MSGPACK_* type
+	float number; // Value of numbers and booleans
+	const char* data; // Content of strings, binary data and extensions
+	uint32_t size; // Length of the content in bytes, number of elements of arrays and maps
+};
+
+/*
+ * Deep sleep data
+ *
+ * This structure is kept in the RTC memory, which survives
+ * deep sleep. It holds the remaining time until the next
+ * scheduled run, the access point used for a fast reconnect
+ * and the result of a run which was still in the backlog.
+ */
+struct RtcData {
+	uint32_t crc; // CRC32 of the following fields
+	uint32_t sleepRemaining; // Remaining sleep time until the next scheduled run in s
+	uint8_t bssid[6]; // BSSID of the last access point
+	uint8_t channel; // WiFi channel of the last access point, 0 if unknown
+	bool pending; // A finished run has not been published yet
+	uint32_t pendingTarget; // Target volume of the unpublished run in microlitres
+	uint32_t pendingVolume; // Delivered volume of the unpublished run in microlitres
+} rtcData;
+
+// Lifetime totals kept in a flash journal
+const size_t JOURNAL_OVERHEAD = 8; // Sequence number and CRC32 stored with every journal record
+const uint32_t JOURNAL_EMPTY = 0xffffffff; // Sequence number read from an erased slot
+
+/*
+ * Journal of records in a ring of flash sectors
+ *
+ * Records are appended to the next free slot of the ring. Each
+ * slot holds a sequence number, the record and a CRC32 of both,
+ * slots never span two sectors. A sector is only erased when the
+ * ring wraps around to it, which spreads the wear evenly over all
+ * sectors and keeps the latest record in another sector.
+ */
+struct Journal {
+	uint32_t sector; // First flash sector of the ring
+	uint16_t sectors; // Number of sectors, at least two
+	uint16_t size; // Size of a record in bytes, a multiple of four
+	uint32_t slot; // Slot of the next record
+	uint32_t sequence; // Sequence number of the next record
+	bool erased; // Sector of the next slot is erased
+	bool ready; // Journal has been opened
+};
+
+/*
+ * Lifetime totals of the unit
+ *
+ * The totals cover all finished runs. They are written to a
+ * journal in flash, so they survive power loss and deep sleep.
+ */
+struct Totals {
+	uint64_t pulses; // Flow meter pulses of all runs
+	uint64_t volume; // Volume of all runs in microlitres
+	uint32_t runs; // Number of runs
+} totals;
+
+Journal totalsJournal = {0, CONFIG_TOTALIZER_SECTORS, sizeof(Totals), 0, 0, false, false}; // Journal at the start of the file system region
+bool totalsChanged = false; // Totals have not been written to the journal yet
+unsigned long totals_time = 0; // Time of the last journal write, for the write interval
+bool totalsOutdated = false; // Published state does not contain the latest totals
+
+// Summary of the current run
+const uint8_t RUN_TARGET = 0; // Termination reasons: target volume reached
+const uint8_t RUN_STOPPED = 1; // Switched off by command
+const char REASON_TARGET[] PROGMEM = "target";
+const char REASON_STOPPED[] PROGMEM = "stopped";
+const char* const RUN_REASON_NAMES[] PROGMEM = {REASON_TARGET, REASON_STOPPED}; // Reason names used in MQTT messages
+const uint32_t RUN_SETTLE_TIME = 500000; // Time without pulses after switching off the pump until the run is complete in us
+const uint32_t RUN_SETTLE_LIMIT = 10000000; // Longest time the coast-down is counted in us
+const unsigned long FLOW_WINDOW = 1000; // Window of the peak flow in ms
+const uint32_t NO_PULSE = 0xffffffff; // Time to the first pulse of a run without pulses
+
+/*
+ * Summary of a run
+ *
+ * The summary is completed once the water flowing after the pump
+ * has been switched off has been counted, so the delivered volume
+ * includes the coast-down of the pump.
+ */
+struct RunSummary {
+	uint32_t job; // Number of the run, taken from the lifetime run count
+	uint32_t target; // Target volume in microlitres
+	uint32_t delivered; // Delivered volume including the coast-down in microlitres
+	uint32_t duration; // Time the pump was running in ms
+	uint32_t firstPulse; // Time from switching on the pump to the first pulse in ms, NO_PULSE without pulses
+	uint32_t flowAverage; // Average flow while the pump was running in microlitres per s
+	uint32_t flowPeak; // Highest flow within FLOW_WINDOW in microlitres per s
+	uint8_t reason; // Termination reason, RUN_TARGET or RUN_STOPPED
+} runSummary;
+
+bool runSettling = false; // Pump is off, the coast-down is still counted
+uint32_t runStart = 0; // Time the pump was switched on in us
+uint32_t runStop = 0; // Time the pump was switched off in us
+volatile uint32_t pulseFirst = 0; // Time of the first pulse of the run in us, written by the interrupt
+volatile uint32_t pulseLast = 0; // Time of the last pulse in us, written by the interrupt
+uint32_t flowVolume = 0; // Volume at the start of the peak flow window in microlitres
+unsigned long flow_time = 0; // Start of the peak flow window
+
+// Flow samples of the current run, published in batches
+const uint8_t FLOW_MAGIC = 0xf1; // First byte of every flow frame
+const uint8_t FLOW_VERSION = 1; // Version of the flow frame format
+const size_t FLOW_HEADER_SIZE = 16; // Bytes in front of the samples of a frame
+const size_t FLOW_SAMPLE_SIZE = 10; // Longest sample in bytes
+uint8_t flowFrame[FLOW_HEADER_SIZE + CONFIG_FLOW_SAMPLE_BATCH / CONFIG_FLOW_SAMPLE_RATE * 4]; // Frame being filled, a sample takes about two bytes
+size_t flowLength = 0; // Bytes in the frame, 0 before its first sample
+uint16_t flowSamples = 0; // Samples in the frame
+uint16_t flowFrames = 0; // Frames published during the current run
+uint32_t flowSampleTime = 0; // Time of the last sample since the pump was switched on in ms
+uint32_t flowSamplePulses = 0; // Pulse count of the last sample
+unsigned long sample_time = 0; // Time of the last sample, for the sample rate
+unsigned long frame_time = 0; // Time the frame was started, for the batch interval
+
+// Closed-loop control of the pump speed
+const int PUMP_DUTY_RANGE = 1023; // Range of the PWM duty cycle
+const uint32_t PUMP_APPROACH_FLOW = CONFIG_PUMP_APPROACH_FLOW * 1000000.0 / 60 + 0.5; // Flow at the end of a run in microlitres per s
+float pumpKp = CONFIG_PUMP_KP; // Gains of the controller, variables for the autotuner on the host
+float pumpKi = CONFIG_PUMP_KI;
+float pumpKd = CONFIG_PUMP_KD;
+float pumpIntegral = 0.0; // Integral term of the controller in duty
+uint32_t pumpFlow = 0; // Flow measured at the previous update in microlitres per s
+uint32_t pumpPulses = 0; // Pulse count at the last pulse of the previous update
+uint32_t pumpPulseTime = 0; // Time of the last pulse of the previous update in us
+unsigned long pump_time = 0; // Time of the last controller update
+
+// Calibration of the flow meter, kept in a flash journal behind the run history
+const int CALIBRATION_POINTS = 6; // Points of the K-factor table
+const float CALIBRATION_MERGE = 0.1; // Relative flow difference within which a new point replaces an existing one
+
+/*
+ * K-factor table of the flow meter
+ *
+ * The points are sorted by flow. Without points, the nominal
+ * CONFIG_FLOW_METER_PULSES is used.
+ */
+struct Calibration {
+	uint32_t count; // Number of valid points
+	struct {
+		uint32_t flow; // Flow in microlitres per s
+		uint32_t kFactor; // Pulses per litre in thousandths
+	} points[CALIBRATION_POINTS];
+} calibration;
+
+Journal calibrationJournal = {0, CONFIG_CALIBRATION_SECTORS, sizeof(Calibration), 0, 0, false, false}; // Journal of the K-factor table
+bool calibrationChanged = false; // Table has to be written to flash
+bool calibrating = false; // Current run is a calibration run
+bool calibrationDone = false; // Calibration run is complete and waits for the reference volume
+uint32_t calibrationPulses = 0; // Pulses of the last calibration run including the coast-down
+uint32_t calibrationPumpPulses = 0; // Pulses of the last calibration run until the pump was switched off
+uint32_t calibrationDuration = 0; // Time the pump was running in the last calibration run in ms
+
+// History of run summaries kept in a flash journal behind the lifetime totals
+const size_t HISTORY_RUN_SIZE = 96; // Longest run in a history page in bytes
+const size_t HISTORY_PAGE_SIZE = CONFIG_HISTORY_PAGE * HISTORY_RUN_SIZE + 48; // Longest history page in bytes
+Journal historyJournal = {0, CONFIG_HISTORY_SECTORS, sizeof(RunSummary), 0, 0, false, false}; // Journal of run summaries
+RunSummary historyRecord; // Summary waiting to be written to the journal
+bool historyPending = false; // historyRecord has not been written yet
+bool historyRequested = false; // A page of the history was requested
+uint32_t historyAfter = 0; // Job after which the requested page starts
+
+// Backlog of state updates while the MQTT broker is unreachable
+const size_t BACKLOG_PAGE_SIZE = 400; // Longest backlog page in bytes, fits MQTT_BUFFER_SIZE
+const size_t BACKLOG_SAMPLE_SIZE = 48; // Longest update in a backlog page in bytes
+const unsigned long BACKLOG_PAGE_DELAY = 50; // Delay between two backlog pages in ms
+
+/*
+ * Update of the backlog
+ *
+ * Updates are stored as difference to the previous one, so the
+ * writer and the reader of the backlog each keep the last one.
+ */
+struct BacklogSample {
+	unsigned long time; // Time of the update in ms
+	bool state; // State of the pump
+	uint32_t target; // Target volume in microlitres
+	uint32_t current; // Current volume in microlitres
+};
+
+uint8_t backlogBuffer[CONFIG_BACKLOG_SIZE]; // Delta-encoded state updates waiting to be published
+size_t backlogHead = 0; // Bytes written to the buffer
+size_t backlogTail = 0; // Bytes published from the buffer
+uint32_t backlogDropped = 0; // Updates lost to a full buffer, not reported yet
+BacklogSample backlogWriter; // Last update written to the buffer
+BacklogSample backlogReader; // Last update published from the buffer
+unsigned long backlog_time = 0; // Time the last backlog page was published, for the page delay
 
 WiFiClient wifi; // Create WiFiClient object
 PubSubClient mqtt(wifi); // Create PubSubClient object
 
+// Capture of MQTT traffic and flow meter pulses for record and replay
+const uint8_t CAPTURE_MAGIC = 0xca; // First byte of every capture chunk
+const uint8_t CAPTURE_VERSION = 1; // Version of the capture format
+const size_t CAPTURE_HEADER = 12; // Chunk header: magic, version, length, sequence, dropped records, start time
+const uint8_t CAPTURE_PULSE = 0; // Record kinds, stored in the lowest two bits of the time delta
+const uint8_t CAPTURE_INBOUND = 1;
+const uint8_t CAPTURE_OUTBOUND = 2;
+const uint8_t CAPTURE_EVENT = 3;
+const uint8_t CAPTURE_EVENT_BOOT = 0; // Event codes
+const uint8_t CAPTURE_EVENT_CONNECTED = 1;
+const uint8_t CAPTURE_EVENT_DISCONNECTED = 2;
+const uint8_t CAPTURE_EVENT_LOST_PULSES = 3; // Followed by the number of pulses lost since the previous pulse
+const uint8_t CAPTURE_TOPIC_OTHER = 0x7f; // Topic index of topics stored as string, the highest bit is the retain flag
+const char* const CAPTURE_TOPICS[] PROGMEM = {TOPIC_STATE, TOPIC_SET, TOPIC_AVAILABILITY, TOPIC_DIAGNOSTICS, TOPIC_PING}; // Topics stored as index
+const uint32_t CAPTURE_PULSE_SLOTS = 64; // Size of the pulse time stamp ring, a power of two
+uint8_t captureBuffer[CONFIG_CAPTURE ? CONFIG_CAPTURE_SIZE : CAPTURE_HEADER]; // Capture chunk waiting to be published
+size_t captureLength = 0; // Used bytes of the capture chunk, 0 if no chunk is started
+uint32_t captureTime = 0; // Time stamp of the last record in us
+uint16_t captureSequence = 0; // Sequence number of the next chunk
+uint16_t captureDropped = 0; // Records lost since the last published chunk
+uint32_t captureLostPulses = 0; // Pulses which did not fit into the ring or the chunk, not captured yet
+unsigned long capture_time = 0; // Time the capture chunk was started, for the flush delay
+volatile uint32_t capturePulses[CONFIG_CAPTURE ? CAPTURE_PULSE_SLOTS : 1]; // Flow meter pulse time stamps written by the interrupt handler
+volatile uint32_t capturePulseHead = 0; // Number of pulses written by the interrupt handler
+uint32_t capturePulseTail = 0; // Number of pulses moved to the capture chunk
+
+// Trace buffer of binary events with CPU cycle time stamps
+const uint8_t TRACE_MAGIC = 0x7e; // First byte of every trace chunk
+const uint8_t TRACE_VERSION = 1; // Version of the trace format
+const size_t TRACE_HEADER = 12; // Chunk header: magic, version, CPU frequency, reserved, dump number, chunk index, chunk count, events
+const uint32_t TRACE_CHUNK_EVENTS = 24; // Events per chunk, a chunk fits into the default MQTT packet size
+const uint8_t TRACE_LOOP_BEGIN = 0; // Event types
+const uint8_t TRACE_LOOP_END = 1;
+const uint8_t TRACE_CALLBACK_BEGIN = 2; // Topic index and payload length of the message
+const uint8_t TRACE_CALLBACK_END = 3;
+const uint8_t TRACE_PUBLISH = 4; // Topic index and payload length of the message
+const uint8_t TRACE_PULSE = 5;
+const uint8_t TRACE_PUMP_ON = 6;
+const uint8_t TRACE_PUMP_OFF = 7;
+struct TraceEvent {
+	uint32_t cycles; // CPU cycle counter at the time of the event
+	uint8_t type; // Event type
+	uint8_t topic; // Topic index of messages
+	uint16_t length; // Payload length of messages
+};
+TraceEvent traceBuffer[CONFIG_TRACE ? CONFIG_TRACE_SIZE : 1]; // Ring of the latest events
+volatile uint32_t traceHead = 0; // Number of recorded events
+volatile bool traceDumping = false; // Recording is paused while the ring is published
+bool traceRequested = false; // Dump of the ring was requested
+uint16_t traceDumps = 0; // Number of the next dump
+
+// Log buffer drained to the serial interface and the log topic
+const size_t LOG_LINE_SIZE = 128; // Maximum length of a log line, longer lines are truncated
+char logBuffer[(LOG_LEVEL > LOG_LEVEL_NONE) ? CONFIG_LOG_BUFFER_SIZE : 1]; // Ring of log output waiting to be written
+uint32_t logHead = 0; // Number of bytes written to the ring
+uint32_t logTail = 0; // Number of bytes written to the serial interface
+uint32_t logMqttTail = 0; // Number of bytes published to the log topic
+uint32_t logDropped = 0; // Lines lost to a full ring, not reported yet
+unsigned long log_time = 0; // Time the oldest unpublished line was written, for the batch delay
+
+/*
+ * Calculate CRC32 checksum
+ *
+ * This function calculates the CRC32 checksum of the given
+ * data. It is used to validate the RTC memory after a reset.
+ */
+uint32_t crc32(const uint8_t* data, size_t length) {
+	uint32_t crc = 0xffffffff; // Initial CRC value
+	while (length--) { // Process all bytes
+		crc ^= *data++; // Add next byte
+		for (int i = 0; i < 8; i++) { // Process all bits
+			crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1)); // Apply polynomial
+		}
+	}
+	return ~crc; // Return final CRC value
+}
+
+/*
+ * Account an MQTT packet in the buffer high-water mark
+ *
+ * The MQTT client builds outgoing and receives incoming packets
+ * in one buffer. Messages not fitting into it are dropped, so the
+ * largest packet shows how close a unit runs to the limit.
+ */
+void mqttPacket(const char* topic, size_t length) {
+	mqttBufferUsed = max(mqttBufferUsed, MQTT_MAX_HEADER_SIZE + 2 + strlen(topic) + length); // Fixed header, topic length, topic and payload
+}
+
+/*
+ * Publish binary data to the MQTT broker
+ *
+ * The topic is copied from flash. Binary data is neither
+ * captured nor traced.
+ */
+bool publishBinary(PGM_P topicFlash, const uint8_t* payload, size_t length) {
+	char topic[TOPIC_SIZE]; // Topic in RAM
+	strlcpy_P(topic, topicFlash, sizeof(topic)); // Copy topic from flash
+	mqttPacket(topic, length); // Account buffer usage
+	return mqtt.publish(topic, payload, length);
+}
+
+/*
+ * Subscribe to a topic kept in flash
+ */
+bool subscribe(PGM_P topicFlash) {
+	char topic[TOPIC_SIZE]; // Topic in RAM
+	strlcpy_P(topic, topicFlash, sizeof(topic)); // Copy topic from flash
+	return mqtt.subscribe(topic);
+}
+
+/*
+ * Used bytes of the log ring
+ *
+ * Output is kept until all enabled destinations have written it.
+ */
+uint32_t logUsed() {
+	uint32_t used = 0; // Bytes not written by the slowest destination
+	if (CONFIG_DEBUG) { // Serial interface is enabled
+		used = logHead - logTail;
+	}
+	if (CONFIG_LOG_MQTT) { // Log topic is enabled
+		used = max(used, logHead - logMqttTail);
+	}
+	return used;
+}
+
+/*
+ * Append text to the log ring
+ *
+ * The text is only appended if it fits completely.
+ */
+bool logAppend(const char* text, size_t length) {
+	if (length > sizeof(logBuffer) - logUsed()) { // Ring is full
+		return false;
+	}
+	if (logHead == logMqttTail) { // Start of a new batch
+		log_time = millis(); // Save current system time for the batch delay
+	}
+	for (size_t i = 0; i < length; i++) { // Copy text, wrapping around the end of the ring
+		logBuffer[(logHead + i) % sizeof(logBuffer)] = text[i];
+	}
+	logHead += length; // Text is waiting to be written
+	return true;
+}
+
+/*
+ * Write a log line
+ *
+ * This function formats a line with the system time and the
+ * level and appends it to the log ring, which is drained by
+ * logFlush(). It never waits for the serial interface, a line
+ * which does not fit into the ring is dropped and counted. It
+ * is only called through the LOG_* macros.
+ */
+void logWrite(char level, PGM_P format, ...) {
+	char line[LOG_LINE_SIZE]; // Formatted line
+	if (logDropped > 0) { // Report lost lines first
+		int length = snprintf_P(line, sizeof(line), PSTR("[%lu] W %lu log lines dropped\r\n"), millis(), (unsigned long) logDropped);
+		if (logAppend(line, length)) { // Report fits
+			logDropped = 0; // Lost lines have been reported
+		}
+	}
+
+	size_t length = snprintf_P(line, sizeof(line), PSTR("[%lu] %c "), millis(), level); // Time stamp and level
+	va_list args; // Arguments of the message
+	va_start(args, format);
+	length += vsnprintf_P(line + length, sizeof(line) - length, format, args); // Message, the format is kept in flash
+	va_end(args);
+	length = min(length, sizeof(line) - 3); // Truncate long lines
+	line[length++] = '\r'; // Terminate line
+	line[length++] = '\n';
+	if (!logAppend(line, length)) { // Line does not fit
+		logDropped++; // Report with the next line
+	}
+}
+
+/*
+ * Write the log ring to the serial interface
+ *
+ * Without waiting, only as many bytes as fit into the transmit
+ * FIFO of the UART are written, so the caller never blocks. When
+ * waiting, the whole ring is written, which is used in phases
+ * where the system waits anyway, e.g. before deep sleep.
+ */
+void logFlush(bool wait) {
+	if (LOG_LEVEL == LOG_LEVEL_NONE || !CONFIG_DEBUG) { // Serial output is disabled
+		return;
+	}
+	while (logTail != logHead) { // Output left
+		size_t offset = logTail % sizeof(logBuffer); // Position of the oldest byte
+		size_t length = min((size_t) (logHead - logTail), sizeof(logBuffer) - offset); // Bytes up to the end of the ring
+		if (!wait) { // Do not block
+			length = min(length, (size_t) max(Serial.availableForWrite(), 0));
+		}
+		if (length == 0) { // Transmit FIFO is full
+			break;
+		}
+		Serial.write((const uint8_t*) logBuffer + offset, length); // Write output
+		logTail += length; // Output has been written
+	}
+	if (wait) { // Wait until the output has left the UART
+		Serial.flush();
+	}
+}
+
+/*
+ * Publish the log ring to the log topic
+ *
+ * Lines are published in batches of up to CONFIG_LOG_BATCH_SIZE
+ * bytes, once a batch is full or its oldest line has waited for
+ * CONFIG_LOG_BATCH_DELAY, or when forced. A batch always ends with
+ * a complete line. One batch is published per call, so a backlog
+ * after a reconnect is spread over several loop() iterations. Like
+ * the capture chunks, batches are published from loop() only.
+ */
+void logPublish(bool force) {
+	if (LOG_LEVEL == LOG_LEVEL_NONE || !CONFIG_LOG_MQTT || logHead == logMqttTail || !mqtt.connected()) { // Nothing to publish
+		return;
+	}
+	uint32_t pending = logHead - logMqttTail; // Unpublished bytes
+	if (!force && pending < CONFIG_LOG_BATCH_SIZE && millis() - log_time < CONFIG_LOG_BATCH_DELAY) { // Batch is not due yet
+		return;
+	}
+	char batch[CONFIG_LOG_MQTT ? CONFIG_LOG_BATCH_SIZE : 1]; // Lines of the batch
+	size_t length = 0; // Length of the batch up to the last complete line
+	for (size_t i = 0; i < min((size_t) pending, sizeof(batch)); i++) { // Copy unpublished bytes
+		batch[i] = logBuffer[(logMqttTail + i) % sizeof(logBuffer)];
+		if (batch[i] == '\n') { // End of a line
+			length = i + 1;
+		}
+	}
+	if (length == 0) { // Line is longer than a batch, publish it truncated
+		length = min((size_t) pending, sizeof(batch));
+	}
+	publishBinary(TOPIC_LOG, (const uint8_t*) batch, length); // A lost batch is not repeated
+	logMqttTail += length; // Lines have been published
+	log_time = millis(); // Remaining lines start the next batch
+}
+
+/*
+ * Save deep sleep data
+ *
+ * This function stores the deep sleep data together
+ * with its checksum in the RTC memory.
+ */
+void rtcSave() {
+	rtcData.crc = crc32(((uint8_t*) &rtcData) + sizeof(rtcData.crc), sizeof(rtcData) - sizeof(rtcData.crc)); // Update checksum
+	ESP.rtcUserMemoryWrite(0, (uint32_t*) &rtcData, sizeof(rtcData)); // Write data to RTC memory
+}
+
+/*
+ * Flash address of a journal slot
+ */
+uint32_t journalAddress(const Journal& journal, uint32_t slot) {
+	uint32_t slots = FLASH_SECTOR_SIZE / (journal.size + JOURNAL_OVERHEAD); // Slots per sector
+	return (journal.sector + slot / slots) * FLASH_SECTOR_SIZE + slot % slots * (journal.size + JOURNAL_OVERHEAD);
+}
+
+/*
+ * Read a journal slot
+ *
+ * This function copies the record of the given slot and returns
+ * its sequence number. JOURNAL_EMPTY is returned for an erased
+ * slot and 0 for a torn or foreign record.
+ */
+uint32_t journalRead(const Journal& journal, uint32_t slot, void* record) {
+	uint32_t buffer[(journal.size + JOURNAL_OVERHEAD) / 4]; // Sequence number, record and CRC32
+	ESP.flashRead(journalAddress(journal, slot), buffer, sizeof(buffer)); // Read slot from flash
+	bool erased = true; // All bits of the slot are set
+	for (uint32_t word : buffer) {
+		erased = erased && word == 0xffffffff;
+	}
+	if (erased) { // Slot can be written
+		return JOURNAL_EMPTY;
+	}
+	if (buffer[0] == JOURNAL_EMPTY || buffer[journal.size / 4 + 1] != crc32((uint8_t*) buffer, journal.size + 4)) { // Write was interrupted
+		return 0;
+	}
+	memcpy(record, buffer + 1, journal.size); // Copy record
+	return buffer[0];
+}
+
+/*
+ * Open a journal
+ *
+ * This function scans all slots for the latest record, which is
+ * copied to the given record. The next record is appended behind
+ * it. If that slot is not erased, e.g. after an interrupted write,
+ * the journal continues in the next sector. Returns true if a
+ * record was found.
+ */
+bool journalOpen(Journal& journal, void* record) {
+	uint32_t slots = FLASH_SECTOR_SIZE / (journal.size + JOURNAL_OVERHEAD); // Slots per sector
+	uint8_t candidate[journal.size]; // Record of the current slot
+	uint32_t latest = 0; // Sequence number of the latest record
+	journal.slot = 0;
+	for (uint32_t slot = 0; slot < journal.sectors * slots; slot++) { // Scan all slots
+		uint32_t sequence = journalRead(journal, slot, candidate);
+		if (sequence != JOURNAL_EMPTY && sequence > latest) { // Newer record found
+			latest = sequence;
+			memcpy(record, candidate, journal.size);
+			journal.slot = (slot + 1) % (journal.sectors * slots); // Append behind it
+		}
+	}
+	journal.sequence = latest + 1;
+	journal.erased = journalRead(journal, journal.slot, candidate) == JOURNAL_EMPTY; // Slot can be written without erasing
+	if (!journal.erased && journal.slot % slots != 0) { // Torn record behind the latest one
+		journal.slot = (journal.slot / slots + 1) % journal.sectors * slots; // Continue at the start of the next sector
+	}
+	journal.ready = true;
+	return latest > 0;
+}
+
+/*
+ * Append a record to a journal
+ *
+ * Erasing a sector blocks the CPU for tens of ms, so it is done
+ * in a separate call: if the sector of the next slot has to be
+ * erased first, the function erases it and returns false without
+ * writing the record. Returns true once the record is written.
+ */
+bool journalAppend(Journal& journal, const void* record) {
+	uint32_t slots = FLASH_SECTOR_SIZE / (journal.size + JOURNAL_OVERHEAD); // Slots per sector
+	if (!journal.erased) { // Ring wraps around to a used sector
+		if (!ESP.flashEraseSector(journal.sector + journal.slot / slots)) { // Erase sector of the next slot
+			LOG_ERROR("Erasing flash sector %u failed", journal.sector + journal.slot / slots); // Print debug info
+		}
+		journal.erased = true;
+		return false; // Record is written by the next call
+	}
+
+	uint32_t buffer[(journal.size + JOURNAL_OVERHEAD) / 4]; // Sequence number, record and CRC32
+	buffer[0] = journal.sequence; // Set sequence number
+	memcpy(buffer + 1, record, journal.size); // Copy record
+	buffer[journal.size / 4 + 1] = crc32((uint8_t*) buffer, journal.size + 4); // Protect against interrupted writes
+	if (!ESP.flashWrite(journalAddress(journal, journal.slot), buffer, sizeof(buffer))) { // Write slot to flash
+		LOG_ERROR("Writing journal record %u failed", journal.sequence); // Print debug info
+	}
+	journal.sequence++;
+	journal.slot = (journal.slot + 1) % (journal.sectors * slots); // Advance to the next slot
+	journal.erased = journal.slot % slots != 0; // A new sector has to be erased first
+	return true;
+}
+
+/*
+ * Restore the lifetime totals
+ *
+ * This function opens the journal at the start of the file system
+ * region and restores the totals from its latest record. Without
+ * a file system region of sufficient size, the totals only cover
+ * the runs since the last boot.
+ */
+void totalsRestore() {
+	if (FS_PHYS_SIZE < CONFIG_TOTALIZER_SECTORS * FLASH_SECTOR_SIZE) { // Flash layout without file system
+		LOG_ERROR("File system region too small for the totalizer"); // Print debug info
+		return;
+	}
+	totalsJournal.sector = FS_PHYS_ADDR / FLASH_SECTOR_SIZE; // Journal starts at the file system region
+	if (journalOpen(totalsJournal, &totals)) { // Totals found
+		LOG_INFO("Lifetime totals restored, %u runs", totals.runs); // Print debug info
+	}
+}
+
+/*
+ * Restore the run history
+ *
+ * This function opens the journal of run summaries behind the
+ * lifetime totals. The run count continues behind the latest
+ * run in the history, so job numbers stay unique if the
+ * totals were lost or are not kept.
+ */
+void historyRestore() {
+	if (FS_PHYS_SIZE < (CONFIG_TOTALIZER_SECTORS + CONFIG_HISTORY_SECTORS) * FLASH_SECTOR_SIZE) { // Flash layout without file system
+		LOG_ERROR("File system region too small for the run history"); // Print debug info
+		return;
+	}
+	historyJournal.sector = FS_PHYS_ADDR / FLASH_SECTOR_SIZE + CONFIG_TOTALIZER_SECTORS; // Journal follows the totals
+	RunSummary latest; // Latest run in the history
+	if (journalOpen(historyJournal, &latest) && latest.job > totals.runs) { // Totals are behind the history
+		totals.runs = latest.job; // Continue numbering behind the latest run
+	}
+}
+
+/*
+ * Write the pending run summary to the history
+ *
+ * Writing a record takes a few us and is done right away. If a
+ * sector has to be erased first, this is only done while the pump
+ * is off, in an iteration of the loop of its own. With force, the
+ * summary is written immediately.
+ */
+void historyCommit(bool force) {
+	if (!historyJournal.ready || !historyPending) { // Nothing to write
+		return;
+	}
+	if (!force && pumpActive && !historyJournal.erased) { // Erasing would delay the running pump
+		return;
+	}
+	bool written;
+	do {
+		written = journalAppend(historyJournal, &historyRecord); // Write summary, erasing a sector first if necessary
+	} while (force && !written);
+	historyPending = !written;
+}
+
+/*
+ * Add a finished run to the history
+ */
+void historyAdd(const RunSummary& summary) {
+	historyCommit(true); // Keep the previous summary, if it is still waiting
+	historyRecord = summary;
+	historyPending = true;
+	historyCommit(false); // Write summary unless a sector has to be erased
+}
+
+/*
+ * Add a finished run to the lifetime totals
+ */
+void totalsAdd(uint32_t pulses, uint32_t volume) {
+	totals.pulses += pulses; // Add pulses of the run
+	totals.volume += volume; // Add volume of the run
+	totals.runs++; // Count run
+	totalsChanged = true; // Totals have to be written
+}
+
+/*
+ * Write the lifetime totals to the journal
+ *
+ * The totals are only written while the pump is off and at most
+ * once per CONFIG_TOTALIZER_INTERVAL, which bounds the wear of the
+ * flash. A sector erase and the following write are done in two
+ * iterations of the loop. With force, the totals are written
+ * immediately, e.g. before entering deep sleep.
+ */
+void totalsCommit(bool force) {
+	if (!totalsJournal.ready || !totalsChanged) { // Nothing to write
+		return;
+	}
+	if (!force && (pumpActive || millis() - totals_time < CONFIG_TOTALIZER_INTERVAL)) { // Write is not due
+		return;
+	}
+	bool written;
+	do {
+		written = journalAppend(totalsJournal, &totals); // Write totals, erasing a sector first if necessary
+	} while (force && !written);
+	if (written) { // Totals are stored
+		totalsChanged = false;
+		totals_time = millis(); // Save current system time for the write interval
+	}
+}
+
+/*
+ * Volume per pulse at the given flow in nanolitres
+ *
+ * The K-factor is interpolated linearly between the two
+ * points of the table next to the flow and held beyond the
+ * first and last point.
+ */
+uint32_t calibrationPulseVolume(uint32_t flow) {
+	if (calibration.count == 0) { // Not calibrated
+		return PULSE_VOLUME;
+	}
+	uint32_t kFactor = calibration.points[0].kFactor; // Pulses per litre in thousandths
+	if (flow >= calibration.points[calibration.count - 1].flow) { // Beyond the last point
+		kFactor = calibration.points[calibration.count - 1].kFactor;
+	} else if (flow > calibration.points[0].flow) { // Between two points
+		int i = 1;
+		while (calibration.points[i].flow < flow) {
+			i++;
+		}
+		int64_t lower = calibration.points[i - 1].kFactor, upper = calibration.points[i].kFactor;
+		kFactor = lower + (upper - lower) * (int64_t) (flow - calibration.points[i - 1].flow) / (int64_t) (calibration.points[i].flow - calibration.points[i - 1].flow);
+	}
+	return 1000000000000ULL / max(kFactor, (uint32_t) 1);
+}
+
+/*
+ * Restore the flow meter calibration
+ *
+ * This function opens the journal of the K-factor table behind
+ * the run history. Without a stored table, the nominal
+ * CONFIG_FLOW_METER_PULSES is used.
+ */
+void calibrationRestore() {
+	if (FS_PHYS_SIZE < (CONFIG_TOTALIZER_SECTORS + CONFIG_HISTORY_SECTORS + CONFIG_CALIBRATION_SECTORS) * FLASH_SECTOR_SIZE) { // Flash layout without file system
+		LOG_ERROR("File system region too small for the calibration"); // Print debug info
+		return;
+	}
+	calibrationJournal.sector = FS_PHYS_ADDR / FLASH_SECTOR_SIZE + CONFIG_TOTALIZER_SECTORS + CONFIG_HISTORY_SECTORS; // Journal follows the history
+	if (!journalOpen(calibrationJournal, &calibration) || calibration.count > CALIBRATION_POINTS) { // No valid table
+		calibration.count = 0;
+	}
+	pulseVolume = calibrationPulseVolume(0); // Volume per pulse until the flow is measured
+	LOG_INFO("Flow meter calibration restored, %u points", calibration.count); // Print debug info
+}
+
+/*
+ * Write a changed calibration to flash
+ *
+ * As for the run history, a sector is only erased while the
+ * pump is off, in an iteration of the loop of its own. With
+ * force, the table is written immediately.
+ */
+void calibrationCommit(bool force) {
+	if (!calibrationJournal.ready || !calibrationChanged) { // Nothing to write
+		return;
+	}
+	if (!force && pumpActive && !calibrationJournal.erased) { // Erasing would delay the running pump
+		return;
+	}
+	bool written;
+	do {
+		written = journalAppend(calibrationJournal, &calibration); // Write table, erasing a sector first if necessary
+	} while (force && !written);
+	calibrationChanged = !written;
+}
+
+/*
+ * Convert the pulses of the run to a volume
+ *
+ * New pulses are converted with the volume per pulse at the
+ * flow measured between them, so the K-factor follows the flow
+ * during the run. Returns the volume of the run in microlitres.
+ */
+uint32_t meterRead() {
+	noInterrupts(); // Pulse count and time of the same pulse
+	uint32_t pulses = pulseCount;
+	uint32_t last = pulseLast;
+	interrupts();
+	if (pulses != meterPulses) { // New pulses
+		if (calibration.count > 1) { // K-factor depends on the flow
+			meterFlow = (uint64_t) (pulses - meterPulses) * pulseVolume / 1000 * 1000000 / max(last - meterPulseTime, (uint32_t) 1);
+			pulseVolume = calibrationPulseVolume(meterFlow);
+		}
+		meterVolume += (uint64_t) (pulses - meterPulses) * pulseVolume;
+		meterPulses = pulses;
+		meterPulseTime = last;
+	}
+	return meterVolume / 1000;
+}
+
+/*
+ * Append a number to the capture chunk
+ *
+ * Numbers are stored as variable length integers, seven bits
+ * per byte starting with the lowest ones. The highest bit
+ * marks that another byte follows.
+ */
+void captureNumber(uint64_t value) {
+	while (value >= 0x80) { // More than seven bits left
+		captureBuffer[captureLength++] = (value & 0x7f) | 0x80; // Store lowest bits with continuation flag
+		value >>= 7; // Next bits
+	}
+	captureBuffer[captureLength++] = value; // Store last bits
+}
+
+/*
+ * Start a capture record
+ *
+ * This function starts a new chunk if necessary and appends the
+ * time stamp and kind of a record, if the given number of bytes
+ * following them fits into the chunk. Otherwise false is returned
+ * and the caller accounts the lost record.
+ */
+bool captureRecord(uint32_t time, uint8_t kind, size_t size) {
+	if (captureLength == 0) { // Start new chunk
+		captureLength = CAPTURE_HEADER; // Header is completed when the chunk is published
+		memcpy(captureBuffer + 8, &time, sizeof(time)); // Start time of the chunk
+		captureTime = time; // Deltas of the records are relative to the start time
+		capture_time = millis(); // Save current system time for the flush delay
+	}
+	if (captureLength + 10 + size > sizeof(captureBuffer)) { // Record does not fit
+		return false;
+	}
+	captureNumber(((uint64_t) (time - captureTime) << 2) | kind); // Time since the previous record and kind
+	captureTime = time; // Save time stamp of this record
+	return true;
+}
+
+/*
+ * Move flow meter pulses to the capture chunk
+ *
+ * The interrupt handler only stores the time stamp of each pulse.
+ * This function appends the pulses up to the given time, so the
+ * records of the chunk stay in chronological order. Pulses which
+ * were overwritten in the ring or did not fit into the chunk are
+ * counted, so the replay can spread them over the gap.
+ */
+void capturePulseRecords(uint32_t until) {
+	uint32_t head = capturePulseHead; // Pulses written so far
+	if (head - capturePulseTail > CAPTURE_PULSE_SLOTS) { // Ring overflowed
+		captureLostPulses += head - capturePulseTail - CAPTURE_PULSE_SLOTS; // Count overwritten pulses
+		capturePulseTail = head - CAPTURE_PULSE_SLOTS; // Oldest pulse still available
+	}
+	while (capturePulseTail != head) { // Pulses left
+		uint32_t time = capturePulses[capturePulseTail % CAPTURE_PULSE_SLOTS]; // Time stamp of the pulse
+		if ((int32_t) (time - until) > 0) { // Pulse happened after the given time
+			break;
+		}
+		if (captureLostPulses > 0 && captureRecord(time, CAPTURE_EVENT, 1 + 5)) { // Lost pulses are reported in front of the next pulse
+			captureBuffer[captureLength++] = CAPTURE_EVENT_LOST_PULSES; // Append event code
+			captureNumber(captureLostPulses); // Append number of lost pulses
+			captureLostPulses = 0; // Lost pulses have been reported
+		}
+		if (!captureRecord(time, CAPTURE_PULSE, 0)) { // Chunk is full
+			captureLostPulses++; // Report pulse with the next one
+		}
+		capturePulseTail++; // Pulse has been moved
+	}
+}
+
+/*
+ * Capture an event
+ */
+void captureEvent(uint8_t event) {
+	if (CONFIG_CAPTURE) { // Capture is enabled
+		uint32_t time = micros(); // Time stamp of the event
+		capturePulseRecords(time); // Keep records in order
+		if (captureRecord(time, CAPTURE_EVENT, 1)) { // Record fits
+			captureBuffer[captureLength++] = event; // Append event code
+		} else {
+			captureDropped++; // Count lost record
+		}
+	}
+}
+
+/*
+ * Index of a known topic
+ *
+ * Captures and traces store known topics as index into
+ * CAPTURE_TOPICS. CAPTURE_TOPIC_OTHER is returned for all
+ * other topics.
+ */
+uint8_t topicIndex(const char* topic) {
+	for (uint8_t i = 0; i < sizeof(CAPTURE_TOPICS) / sizeof(CAPTURE_TOPICS[0]); i++) { // Search known topics
+		if (strcmp_P(topic, (PGM_P) pgm_read_ptr(&CAPTURE_TOPICS[i])) == 0) { // Topic found
+			return i;
+		}
+	}
+	return CAPTURE_TOPIC_OTHER; // Unknown topic
+}
+
+/*
+ * Capture an MQTT message
+ *
+ * Known topics are stored as index, all others as string.
+ */
+void captureMessage(uint8_t kind, const char* topic, const uint8_t* payload, size_t length, bool retained) {
+	if (CONFIG_CAPTURE) { // Capture is enabled
+		uint8_t index = topicIndex(topic); // Index of the topic
+		size_t topicLength = (index == CAPTURE_TOPIC_OTHER) ? strlen(topic) : 0; // Length of a topic stored as string
+		uint32_t time = micros(); // Time stamp of the message
+		capturePulseRecords(time); // Keep records in order
+		if (captureRecord(time, kind, 1 + 5 + topicLength + 5 + length)) { // Record fits
+			captureBuffer[captureLength++] = index | (retained ? 0x80 : 0x00); // Append topic index and retain flag
+			if (index == CAPTURE_TOPIC_OTHER) { // Topic is stored as string
+				captureNumber(topicLength); // Append topic length
+				memcpy(captureBuffer + captureLength, topic, topicLength); // Append topic
+				captureLength += topicLength;
+			}
+			captureNumber(length); // Append payload length
+			memcpy(captureBuffer + captureLength, payload, length); // Append payload
+			captureLength += length;
+		} else {
+			captureDropped++; // Count lost record
+		}
+	}
+}
+
+/*
+ * Publish the capture chunk
+ *
+ * The chunk is published when it is half full, when the flush
+ * delay has passed or when forced. Chunks are published from
+ * loop() only, as the MQTT client reuses its buffer, which
+ * still holds the message while the callback is running.
+ */
+void captureFlush(bool force) {
+	if (!CONFIG_CAPTURE) { // Capture is disabled
+		return;
+	}
+	capturePulseRecords(micros()); // Move pending pulses
+	if (captureLength == 0 || !mqtt.connected() || (!force && captureLength < sizeof(captureBuffer) / 2 && millis() - capture_time < CONFIG_CAPTURE_FLUSH)) { // Nothing to publish yet
+		return;
+	}
+	uint16_t length = captureLength; // Length of the chunk
+	captureBuffer[0] = CAPTURE_MAGIC; // Complete chunk header
+	captureBuffer[1] = CAPTURE_VERSION;
+	memcpy(captureBuffer + 2, &length, sizeof(length));
+	memcpy(captureBuffer + 4, &captureSequence, sizeof(captureSequence));
+	memcpy(captureBuffer + 6, &captureDropped, sizeof(captureDropped));
+	if (publishBinary(TOPIC_CAPTURE, captureBuffer, captureLength)) { // Chunk was sent
+		captureDropped = 0; // Lost records have been reported
+	} else { // Chunk is lost, the gap in the sequence numbers shows it
+		captureDropped++;
+	}
+	captureSequence++; // Sequence number of the next chunk
+	captureLength = 0; // Start a new chunk with the next record
+}
+
+/*
+ * Record a trace event
+ *
+ * This function stores an event with the current CPU cycle count
+ * in the trace ring, overwriting the oldest event. It is called
+ * directly by the flow meter interrupt handler, all other callers
+ * use traceEvent(), which keeps the interrupt from recording into
+ * the same slot.
+ */
+void ICACHE_RAM_ATTR traceRecord(uint8_t type, uint8_t topic, uint16_t length) {
+	if (traceDumping) { // Ring is being published
+		return;
+	}
+	uint32_t head = traceHead; // Number of recorded events
+	TraceEvent& event = traceBuffer[head % CONFIG_TRACE_SIZE]; // Next slot of the ring
+	event.cycles = ESP.getCycleCount(); // Time stamp of the event
+	event.type = type;
+	event.topic = topic;
+	event.length = length;
+	traceHead = head + 1; // Event has been recorded
+}
+
+/*
+ * Record a trace event outside of the interrupt handler
+ */
+void traceEvent(uint8_t type, uint8_t topic = 0, uint16_t length = 0) {
+	if (CONFIG_TRACE) { // Trace is enabled
+		noInterrupts(); // Flow meter interrupt records events as well
+		traceRecord(type, topic, length); // Record event
+		interrupts();
+	}
+}
+
+/*
+ * Publish the trace ring
+ *
+ * When a dump was requested, the events in the ring are published
+ * to the trace topic in chunks, oldest first. Recording is paused
+ * meanwhile, so the dump is a consistent snapshot. Like the capture
+ * chunks, the dump is published from loop() only.
+ */
+void traceFlush() {
+	if (!CONFIG_TRACE || !traceRequested || !mqtt.connected()) { // Nothing to publish
+		return;
+	}
+	traceRequested = false; // Dump is handled
+	traceDumping = true; // Pause recording
+	uint32_t head = traceHead; // Number of recorded events
+	uint32_t count = min(head, (uint32_t) CONFIG_TRACE_SIZE); // Number of events in the ring
+	uint16_t chunks = max((count + TRACE_CHUNK_EVENTS - 1) / TRACE_CHUNK_EVENTS, (uint32_t) 1); // An empty ring is answered by an empty chunk
+	uint8_t chunk[TRACE_HEADER + TRACE_CHUNK_EVENTS * sizeof(TraceEvent)]; // Chunk buffer
+	chunk[0] = TRACE_MAGIC; // Chunk header
+	chunk[1] = TRACE_VERSION;
+	chunk[2] = ESP.getCpuFreqMHz(); // Cycles per us for the conversion of the time stamps
+	chunk[3] = 0; // Reserved
+	memcpy(chunk + 4, &traceDumps, sizeof(traceDumps));
+	memcpy(chunk + 8, &chunks, sizeof(chunks));
+	for (uint16_t i = 0; i < chunks; i++) { // Publish all chunks
+		uint16_t events = min(count - i * TRACE_CHUNK_EVENTS, TRACE_CHUNK_EVENTS); // Events in this chunk
+		memcpy(chunk + 6, &i, sizeof(i)); // Chunk index
+		memcpy(chunk + 10, &events, sizeof(events)); // Number of events
+		for (uint16_t e = 0; e < events; e++) { // Copy events, oldest first
+			memcpy(chunk + TRACE_HEADER + e * sizeof(TraceEvent), &traceBuffer[(head - count + i * TRACE_CHUNK_EVENTS + e) % CONFIG_TRACE_SIZE], sizeof(TraceEvent));
+		}
+		publishBinary(TOPIC_TRACE, chunk, TRACE_HEADER + events * sizeof(TraceEvent)); // A lost chunk shows as gap in the chunk indices
+	}
+	traceDumps++; // Number of the next dump
+	traceDumping = false; // Resume recording
+}
+
+/*
+ * Publish a message to the MQTT broker
+ *
+ * This function captures, traces and publishes a message.
+ * The topic is copied from flash.
+ */
+bool publish(PGM_P topicFlash, const uint8_t* payload, size_t length, bool retained = false) {
+	char topic[TOPIC_SIZE]; // Topic in RAM
+	strlcpy_P(topic, topicFlash, sizeof(topic)); // Copy topic from flash
+	mqttPacket(topic, length); // Account buffer usage
+	captureMessage(CAPTURE_OUTBOUND, topic, payload, length, retained); // Capture outbound message
+	if (CONFIG_TRACE) { // Trace is enabled
+		traceEvent(TRACE_PUBLISH, topicIndex(topic), length); // Trace outbound message
+	}
+	return mqtt.publish(topic, payload, length, retained); // Publish message
+}
+
+bool publish(PGM_P topicFlash, const char* payload, bool retained = false) {
+	return publish(topicFlash, (const uint8_t*) payload, strlen(payload), retained);
+}
+
+/*
+ * Sleep for the next chunk of time
+ *
+ * The maximum deep sleep duration of the ESP8266 is limited to
+ * a few hours. Longer intervals are split into chunks. All but the
+ * last chunk wake up with WiFi disabled, only to go back to sleep.
+ */
+void sleepChunk() {
+	uint32_t chunk = min((uint64_t) rtcData.sleepRemaining, ESP.deepSleepMax() / 1000000); // Longest possible sleep in s
+	rtcData.sleepRemaining -= chunk; // Remaining sleep time after this chunk
+	rtcSave(); // Save deep sleep data to RTC memory
+	ESP.deepSleep((uint64_t) chunk * 1000000, (rtcData.sleepRemaining > 0) ? WAKE_RF_DISABLED : WAKE_RF_DEFAULT); // Enter deep sleep
+}
+
+/*
+ * Restore deep sleep data
+ *
+ * This function reads the deep sleep data from the RTC memory.
+ * If the next scheduled run is not due yet, the system goes back
+ * to sleep immediately. Returns true if a scheduled run is due
+ * and false after a cold boot.
+ */
+bool sleepRestore() {
+	ESP.rtcUserMemoryRead(0, (uint32_t*) &rtcData, sizeof(rtcData)); // Read data from RTC memory
+	if (rtcData.crc != crc32(((uint8_t*) &rtcData) + sizeof(rtcData.crc), sizeof(rtcData) - sizeof(rtcData.crc))) { // Cold boot
+		memset(&rtcData, 0, sizeof(rtcData)); // Reset deep sleep data
+		return false; // No scheduled run is due
+	}
+
+	if (rtcData.sleepRemaining > 0) { // Scheduled run is not due yet
+		sleepChunk(); // Go back to sleep
+	}
+	return true; // Scheduled run is due
+}
+
+/*
+ * Enter deep sleep until the next scheduled run
+ *
+ * This function saves the current access point for a fast
+ * reconnect, disconnects from the MQTT broker without
+ * triggering the last will and enters deep sleep.
+ */
+void sleepUntilNextRun() {
+	unsigned long awake = millis() / 1000; // Time spent awake in s
+	rtcData.sleepRemaining = (awake < CONFIG_SLEEP_INTERVAL) ? CONFIG_SLEEP_INTERVAL - awake : 1; // Time until the next scheduled run
+	if (WiFi.status() == WL_CONNECTED) { // Access point is known
+		rtcData.channel = WiFi.channel(); // Save WiFi channel
+		memcpy(rtcData.bssid, WiFi.BSSID(), sizeof(rtcData.bssid)); // Save BSSID
+	}
+	if (runSummary.job != 0 && backlogHead != backlogTail) { // Result of the last run is still in the backlog, which is lost in deep sleep
+		rtcData.pending = true; // Publish result after waking
+		rtcData.pendingTarget = runSummary.target;
+		rtcData.pendingVolume = runSummary.delivered;
+	}
+
+	LOG_INFO("Entering deep sleep"); // Print debug info
+	totalsCommit(true); // Keep the lifetime totals of this wake period
+	historyCommit(true); // Keep the summary of the last run
+	calibrationCommit(true); // Keep a changed calibration
+	captureFlush(true); // Publish the captured records
+	while (CONFIG_LOG_MQTT && mqtt.connected() && logHead != logMqttTail) { // Publish all log lines
+		logPublish(true);
+	}
+	mqtt.disconnect(); // Disconnect cleanly, the system stays available
+	logFlush(true); // Finish debug output before sleeping
+	sleepChunk(); // Enter deep sleep
+}
+
 /*
  * Set up WiFi
  * 
@@ -35,82 +1250,1240 @@ PubSubClient mqtt(wifi); // Create PubSubClient object
  */
 void setup_wifi() {
 	delay(10);
-	Serial.println(); // Print debug info
-	Serial.print("Connecting to "); // Print debug info
-	Serial.println(CONFIG_WIFI_SSID); // Print debug info
+	LOG_INFO("Connecting to %s", CONFIG_WIFI_SSID); // Print debug info
 
 	WiFi.mode(WIFI_STA); // Disable the built-in WiFi access point.
-	WiFi.begin(CONFIG_WIFI_SSID, CONFIG_WIFI_PASS); // Connect to given network
+	if (CONFIG_SLEEP_ENABLED && rtcData.channel != 0) { // Access point is known from the last wake period
+		WiFi.begin(CONFIG_WIFI_SSID, CONFIG_WIFI_PASS, rtcData.channel, rtcData.bssid); // Connect without scanning
+	} else {
+		WiFi.begin(CONFIG_WIFI_SSID, CONFIG_WIFI_PASS); // Connect to given network
+	}
+
+	unsigned long start = millis(); // Save current system time for connection timeout
+	while (WiFi.status() != WL_CONNECTED) { // Loop until connected to WiFi network
+		if (CONFIG_SLEEP_ENABLED && rtcData.channel != 0 && millis() - start >= CONFIG_SLEEP_CONNECT_TIMEOUT / 2) { // Cached access point not reachable
+			rtcData.channel = 0; // Forget cached access point
+			WiFi.begin(CONFIG_WIFI_SSID, CONFIG_WIFI_PASS); // Connect to given network with scanning
+		}
+		if (CONFIG_SLEEP_ENABLED && millis() - start >= CONFIG_SLEEP_CONNECT_TIMEOUT) { // Do not drain the battery
+			LOG_WARNING("WiFi not connected, giving up, watering offline"); // Print debug info
+			offline = true; // Skip MQTT until the next wake period
+			return;
+		}
+		logFlush(true); // Write debug output while waiting
+		delay(500); // Wait 500 ms
+	}
+
+	IPAddress ip = WiFi.localIP(); // Assigned IP address
+	LOG_INFO("WiFi connected, IP address %u.%u.%u.%u", ip[0], ip[1], ip[2], ip[3]); // Print debug info
+}
+
+/*
+ * Apply WiFi power saving profile
+ *
+ * This function switches the WiFi power saving profile
+ * and accounts the time spent in the previous one.
+ */
+void setPowerMode(WiFiSleepType_t mode) {
+	powerTime[powerMode] += millis() - power_time; // Account time spent in the previous profile
+	power_time = millis(); // Save current system time for time accounting
+	if (mode != WiFi.getSleepMode()) { // Profile changes
+		WiFi.setSleepMode(mode); // Apply new profile
+	}
+	powerMode = mode; // Save applied profile
+}
+
+/*
+ * Skip whitespace of a JSON message
+ */
+char* jsonSkipSpace(char* position) {
+	while (*position == ' ' || *position == '\t' || *position == '\r' || *position == '\n') {
+		position++;
+	}
+	return position;
+}
+
+/*
+ * Read a JSON string
+ *
+ * This function decodes the string starting at the opening
+ * quote in place and terminates it, like ArduinoJson does
+ * for writable input. Returns the position behind the
+ * closing quote, nullptr for an invalid string.
+ */
+char* jsonString(char* position, char*& string, size_t& length) {
+	char* write = position + 1; // Decoded characters never take more space than their encoding
+	string = write;
+	for (char* read = position + 1;; read++) {
+		char c = *read;
+		if (c == '"') { // End of string
+			*write = '\0'; // Terminate in place of the quote or an escape sequence
+			length = write - string;
+			return read + 1;
+		}
+		if (c == '\0') { // Unterminated string
+			return nullptr;
+		}
+		if (c == '\\') { // Escape sequence
+			c = *++read;
+			if (c == 'u') { // Unicode code unit, encoded as UTF-8
+				unsigned code = 0;
+				for (int i = 0; i < 4; i++) {
+					char digit = *++read;
+					if (!isxdigit(digit)) {
+						return nullptr;
+					}
+					code = code * 16 + (isdigit(digit) ? digit - '0' : (digit | 0x20) - 'a' + 10);
+				}
+				if (code < 0x80) {
+					*write++ = code;
+				} else if (code < 0x800) {
+					*write++ = 0xc0 | (code >> 6);
+					*write++ = 0x80 | (code & 0x3f);
+				} else {
+					*write++ = 0xe0 | (code >> 12);
+					*write++ = 0x80 | ((code >> 6) & 0x3f);
+					*write++ = 0x80 | (code & 0x3f);
+				}
+				continue;
+			}
+			switch (c) {
+			case '"': case '\\': case '/': break;
+			case 'b': c = '\b'; break;
+			case 'f': c = '\f'; break;
+			case 'n': c = '\n'; break;
+			case 'r': c = '\r'; break;
+			case 't': c = '\t'; break;
+			default: return nullptr; // Invalid escape sequence
+			}
+		}
+		*write++ = c;
+	}
+}
+
+/*
+ * Skip a JSON number, returns the position behind it or nullptr
+ */
+char* jsonNumber(char* position) {
+	if (*position == '-') { // Sign
+		position++;
+	}
+	if (!isdigit(*position)) {
+		return nullptr;
+	}
+	while (isdigit(*position)) { // Integer part
+		position++;
+	}
+	if (*position == '.') { // Fraction
+		if (!isdigit(*++position)) {
+			return nullptr;
+		}
+		while (isdigit(*position)) {
+			position++;
+		}
+	}
+	if (*position == 'e' || *position == 'E') { // Exponent
+		position++;
+		if (*position == '+' || *position == '-') {
+			position++;
+		}
+		if (!isdigit(*position)) {
+			return nullptr;
+		}
+		while (isdigit(*position)) {
+			position++;
+		}
+	}
+	return position;
+}
+
+/*
+ * Skip a JSON number or literal, returns the position behind it or nullptr
+ */
+char* jsonScalar(char* position) {
+	if (!strncmp(position, "true", 4) || !strncmp(position, "null", 4)) {
+		return position + 4;
+	}
+	if (!strncmp(position, "false", 5)) {
+		return position + 5;
+	}
+	return jsonNumber(position);
+}
+
+/*
+ * Skip a JSON value
+ *
+ * This function validates and skips a value of an unknown
+ * key without recursion. The open objects and arrays are
+ * kept as a bit stack, so the nesting is limited to
+ * JSON_NESTING_LIMIT. Returns the position behind the value,
+ * nullptr for invalid JSON.
+ */
+char* jsonSkipValue(char* position) {
+	uint16_t objects = 0; // Bit stack of the open containers, set for objects
+	int depth = 0; // Number of open containers
+	char* string;
+	size_t length;
+	for (;;) {
+		position = jsonSkipSpace(position);
+		bool complete = true; // A value has been read
+		if (*position == '{' || *position == '[') { // Open container
+			if (depth == JSON_NESTING_LIMIT) {
+				return nullptr;
+			}
+			bool object = (*position == '{');
+			objects = (objects << 1) | object;
+			depth++;
+			position = jsonSkipSpace(position + 1);
+			if (*position == (object ? '}' : ']')) { // Empty container
+				position++;
+				objects >>= 1;
+				depth--;
+			} else if (object) { // First key
+				if (*position != '"' || !(position = jsonString(position, string, length))) {
+					return nullptr;
+				}
+				position = jsonSkipSpace(position);
+				if (*position++ != ':') {
+					return nullptr;
+				}
+				complete = false;
+			} else { // First element
+				complete = false;
+			}
+		} else if (*position == '"') {
+			position = jsonString(position, string, length);
+		} else {
+			position = jsonScalar(position);
+		}
+		if (!position) {
+			return nullptr;
+		}
+		while (complete) { // Close containers until the next element
+			if (depth == 0) {
+				return position;
+			}
+			position = jsonSkipSpace(position);
+			if (*position == ((objects & 1) ? '}' : ']')) { // End of container
+				position++;
+				objects >>= 1;
+				depth--;
+			} else if (*position == ',') { // Next element
+				position = jsonSkipSpace(position + 1);
+				if (objects & 1) { // Next key
+					if (*position != '"' || !(position = jsonString(position, string, length))) {
+						return nullptr;
+					}
+					position = jsonSkipSpace(position);
+					if (*position++ != ':') {
+						return nullptr;
+					}
+				}
+				complete = false;
+			} else {
+				return nullptr;
+			}
+		}
+	}
+}
+
+/*
+ * Compare a string of the given length with a string in flash
+ */
+bool equalsFlash(const char* string, size_t length, PGM_P flash) {
+	return strncmp_P(string, flash, length) == 0 && pgm_read_byte(flash + length) == '\0';
+}
+
+/*
+ * Look up a command key
+ *
+ * The key does not need to be terminated. Returns the
+ * index of the key in COMMAND_KEYS, -1 for unknown keys.
+ */
+int commandKey(const char* key, size_t length) {
+	if (length == 0 || length >= COMMAND_KEY_SIZE) { // No command key
+		return -1;
+	}
+	int index = (int8_t) pgm_read_byte(&COMMAND_KEY_TABLE.index[commandKeyHash(key[0], length)]);
+	if (index < 0 || !equalsFlash(key, length, COMMAND_KEYS[index])) { // Empty slot or other key with the same hash
+		return -1;
+	}
+	return index;
+}
+
+/*
+ * Store a string value of a command
+ *
+ * This function handles the string values of the state and
+ * power profile keys for all wire formats. Unknown states
+ * are ignored.
+ */
+void commandString(Command& command, uint8_t flag, const char* string, size_t length) {
+	if (flag == COMMAND_STATE) { // Other states are ignored
+		if (equalsFlash(string, length, PAYLOAD_ON)) { // state on is requested
+			command.state = true;
+			command.keys |= COMMAND_STATE;
+		} else if (equalsFlash(string, length, PAYLOAD_OFF)) { // state off is requested
+			command.state = false;
+			command.keys |= COMMAND_STATE;
+		}
+	} else if (flag == COMMAND_POWER_PROFILE) {
+		command.powerProfile = -1;
+		for (int i = 0; i < 3; i++) { // Search requested profile
+			if (equalsFlash(string, length, (PGM_P) pgm_read_ptr(&POWER_PROFILE_NAMES[i]))) { // Profile found
+				command.powerProfile = i;
+			}
+		}
+		command.keys |= COMMAND_POWER_PROFILE;
+	}
+}
+
+/*
+ * Parse a command
+ *
+ * This function reads a JSON formatted command in a single
+ * pass without building a JSON document. The values of known
+ * keys are converted while reading and stored in the command,
+ * other values are only validated. The message is modified
+ * in place. Returns false for invalid JSON, in which case
+ * the command must not be applied.
+ */
+bool parseCommand(char* message, Command& command) {
+	command.keys = 0;
+	char* position = jsonSkipSpace(message);
+	if (*position != '{') { // Valid JSON, but no command
+		return jsonSkipValue(position) != nullptr;
+	}
+	position = jsonSkipSpace(position + 1);
+	if (*position == '}') { // Empty object
+		return true;
+	}
+	for (;;) {
+		char* string;
+		size_t length;
+		if (*position != '"' || !(position = jsonString(position, string, length))) { // Read key
+			return false;
+		}
+		position = jsonSkipSpace(position);
+		if (*position != ':') {
+			return false;
+		}
+		position = jsonSkipSpace(position + 1);
+		int key = commandKey(string, length);
+		uint8_t flag = (key >= 0) ? 1 << key : 0; // COMMAND_* flag of the key
+		if ((flag & (COMMAND_STATE | COMMAND_POWER_PROFILE)) && *position == '"') { // State or power profile name
+			if (!(position = jsonString(position, string, length))) {
+				return false;
+			}
+			commandString(command, flag, string, length);
+		} else if (flag & (COMMAND_VOLUME | COMMAND_FLOW)) { // Converted like ArduinoJson converts a value to float
+			float& number = (flag == COMMAND_VOLUME) ? command.volume : command.flow;
+			char* end = jsonNumber(position);
+			if (end) { // Number
+				number = strtod(position, nullptr);
+				position = end;
+			} else if (*position == '"') { // Number in a string, other strings are 0
+				if (!(position = jsonString(position, string, length))) {
+					return false;
+				}
+				end = jsonNumber(string);
+				number = (end && *end == '\0') ? strtod(string, nullptr) : 0.0;
+			} else {
+				number = !strncmp(position, "true", 4) ? 1.0 : 0.0;
+				position = jsonSkipValue(position);
+			}
+			command.keys |= flag;
+		} else { // Other keys and values of other types
+			if (flag == COMMAND_POWER_PROFILE) { // Not a profile name, reapplies the selected profile
+				command.powerProfile = -1;
+			}
+			command.keys |= flag & (COMMAND_POWER_PROFILE | COMMAND_TRACE); // The trace value is ignored
+			position = jsonSkipValue(position);
+		}
+		if (!position) {
+			return false;
+		}
+		position = jsonSkipSpace(position);
+		if (*position == '}') { // End of command, trailing characters are ignored like ArduinoJson does
+			return true;
+		}
+		if (*position != ',') {
+			return false;
+		}
+		position = jsonSkipSpace(position + 1);
+	}
+}
+
+/*
+ * Skip the payload of a MessagePack value
+ */
+const uint8_t* msgPackData(const uint8_t* position, const uint8_t* end, MsgPackValue& value, uint32_t size) {
+	if (size > (size_t) (end - position)) { // Truncated
+		return nullptr;
+	}
+	value.data = (const char*) position;
+	value.size = size;
+	return position + size;
+}
+
+/*
+ * Read a big-endian number of a MessagePack message
+ */
+uint64_t msgPackUint(const uint8_t* position, int bytes) {
+	uint64_t value = 0;
+	for (int i = 0; i < bytes; i++) {
+		value = (value << 8) | position[i];
+	}
+	return value;
+}
+
+/*
+ * Read the header of a MessagePack value
+ *
+ * This function reads the type of the value together with
+ * numbers and booleans. Strings, binary data and extensions
+ * are skipped and referenced by data and size, for arrays and
+ * maps size is the number of elements which follow. Returns
+ * the position behind the value or its header, nullptr for
+ * truncated or invalid messages.
+ */
+const uint8_t* msgPackRead(const uint8_t* position, const uint8_t* end, MsgPackValue& value) {
+	if (position >= end) { // Truncated
+		return nullptr;
+	}
+	uint8_t format = *position++;
+	value.number = 0.0;
+	value.size = 0;
+	if (format <= 0x7f || format >= 0xe0) { // Positive and negative fixint
+		value.type = MSGPACK_NUMBER;
+		value.number = (format <= 0x7f) ? (int) format : (int) (int8_t) format;
+		return position;
+	}
+	if (format <= 0x9f) { // Fixmap and fixarray
+		value.type = (format <= 0x8f) ? MSGPACK_MAP : MSGPACK_ARRAY;
+		value.size = format & 0x0f;
+		return position;
+	}
+	if (format <= 0xbf) { // Fixstr
+		value.type = MSGPACK_STRING;
+		return msgPackData(position, end, value, format & 0x1f);
+	}
+	static const uint8_t SIZES[] PROGMEM = { // Length of the fixed part following the format byte of 0xc0 to 0xdf
+		0, 0, 0, 0, 1, 2, 4, 2, 3, 5, 4, 8, 1, 2, 4, 8, 1, 2, 4, 8, 2, 3, 5, 9, 17, 1, 2, 4, 2, 4, 2, 4};
+	size_t bytes = pgm_read_byte(&SIZES[format - 0xc0]);
+	if (bytes > (size_t) (end - position)) { // Truncated
+		return nullptr;
+	}
+	const uint8_t* data = position;
+	position += bytes;
+	switch (format) {
+	case 0xc0: // nil
+		value.type = MSGPACK_NIL;
+		return position;
+	case 0xc2: // false
+	case 0xc3: // true
+		value.type = MSGPACK_BOOLEAN;
+		value.number = format & 1;
+		return position;
+	case 0xca: { // float 32
+		uint32_t bits = msgPackUint(data, 4);
+		float number;
+		memcpy(&number, &bits, sizeof(number));
+		value.type = MSGPACK_NUMBER;
+		value.number = number;
+		return position;
+	}
+	case 0xcb: { // float 64
+		uint64_t bits = msgPackUint(data, 8);
+		double number;
+		memcpy(&number, &bits, sizeof(number));
+		value.type = MSGPACK_NUMBER;
+		value.number = number;
+		return position;
+	}
+	case 0xcc: case 0xcd: case 0xce: case 0xcf: // uint 8 to 64
+		value.type = MSGPACK_NUMBER;
+		value.number = msgPackUint(data, bytes);
+		return position;
+	case 0xd0: case 0xd1: case 0xd2: case 0xd3: { // int 8 to 64, sign extended from the highest byte
+		uint64_t bits = msgPackUint(data, bytes);
+		int shift = 64 - 8 * bytes;
+		value.type = MSGPACK_NUMBER;
+		value.number = (int64_t) (bits << shift) >> shift;
+		return position;
+	}
+	case 0xd9: case 0xda: case 0xdb: // str 8 to 32
+		value.type = MSGPACK_STRING;
+		return msgPackData(position, end, value, msgPackUint(data, bytes));
+	case 0xc4: case 0xc5: case 0xc6: // bin 8 to 32
+		value.type = MSGPACK_OTHER;
+		return msgPackData(position, end, value, msgPackUint(data, bytes));
+	case 0xc7: case 0xc8: case 0xc9: // ext 8 to 32, followed by the extension type
+		value.type = MSGPACK_OTHER;
+		return msgPackData(position, end, value, msgPackUint(data, bytes - 1));
+	case 0xd4: case 0xd5: case 0xd6: case 0xd7: case 0xd8: // fixext 1 to 16, the payload is part of the fixed part
+		value.type = MSGPACK_OTHER;
+		return position;
+	case 0xdc: case 0xdd: // array 16 and 32
+	case 0xde: case 0xdf: // map 16 and 32
+		value.type = (format <= 0xdd) ? MSGPACK_ARRAY : MSGPACK_MAP;
+		value.size = msgPackUint(data, bytes);
+		return position;
+	default: // 0xc1 is never used
+		return nullptr;
+	}
+}
+
+/*
+ * Skip a MessagePack value
+ *
+ * This function validates and skips a value including all
+ * elements of arrays and maps. Nested values are counted
+ * instead of recursing. Returns the position behind the
+ * value, nullptr for truncated or invalid messages.
+ */
+const uint8_t* msgPackSkip(const uint8_t* position, const uint8_t* end) {
+	size_t pending = 1; // Values left to skip
+	while (pending > 0) {
+		MsgPackValue value;
+		if (!(position = msgPackRead(position, end, value))) {
+			return nullptr;
+		}
+		pending--;
+		if (value.type == MSGPACK_ARRAY || value.type == MSGPACK_MAP) { // Elements follow
+			size_t elements = (value.type == MSGPACK_MAP) ? 2 * (size_t) value.size : value.size;
+			if (elements > (size_t) (end - position)) { // Every element takes at least one byte
+				return nullptr;
+			}
+			pending += elements;
+		}
+	}
+	return position;
+}
+
+/*
+ * Parse a MessagePack command
+ *
+ * This function reads a command encoded as MessagePack map
+ * with the same keys and values as the JSON command in a
+ * single pass. For smaller messages, a key may also be given
+ * as its index in COMMAND_KEYS and the state as boolean. The
+ * volume and flow are taken from numbers and booleans, other
+ * values set them to 0. Returns false for invalid messages, in which
+ * case the command must not be applied.
+ *
+ * Sample Payload (hex):
+ *   82 00 c3 01 cc fa = {0: true, 1: 250}
+ */
+bool parseMsgPack(const uint8_t* message, size_t length, Command& command) {
+	command.keys = 0;
+	const uint8_t* end = message + length;
+	MsgPackValue map;
+	const uint8_t* position = msgPackRead(message, end, map);
+	if (!position || map.type != MSGPACK_MAP) { // No command
+		return position && msgPackSkip(message, end);
+	}
+	for (uint32_t i = 0; i < map.size; i++) {
+		MsgPackValue key, value;
+		const uint8_t* next = msgPackSkip(position, end); // Keys may be of any type
+		if (!next) {
+			return false;
+		}
+		msgPackRead(position, end, key);
+		int index = -1; // Index of the key in COMMAND_KEYS
+		if (key.type == MSGPACK_STRING) { // Key name
+			index = commandKey(key.data, key.size);
+		} else if (key.type == MSGPACK_NUMBER && key.number >= 0 && key.number < COMMAND_KEY_COUNT && key.number == (int) key.number) { // Key index
+			index = key.number;
+		}
+		uint8_t flag = (index >= 0) ? 1 << index : 0; // COMMAND_* flag of the key
+		position = next;
+		if (!(next = msgPackSkip(position, end))) {
+			return false;
+		}
+		msgPackRead(position, end, value);
+		position = next;
+		if (value.type == MSGPACK_STRING) { // State or power profile name
+			commandString(command, flag, value.data, value.size);
+		}
+		if (flag == COMMAND_STATE && value.type == MSGPACK_BOOLEAN) { // State as boolean
+			command.state = value.number;
+			command.keys |= COMMAND_STATE;
+		} else if (flag & (COMMAND_VOLUME | COMMAND_FLOW)) {
+			((flag == COMMAND_VOLUME) ? command.volume : command.flow) = (value.type == MSGPACK_NUMBER || value.type == MSGPACK_BOOLEAN) ? value.number : 0.0;
+		} else if (flag == COMMAND_POWER_PROFILE && value.type != MSGPACK_STRING) { // Not a profile name, reapplies the selected profile
+			command.powerProfile = -1;
+		}
+		command.keys |= flag & (COMMAND_VOLUME | COMMAND_POWER_PROFILE | COMMAND_TRACE | COMMAND_FLOW); // The trace value is ignored
+	}
+	return true;
+}
+
+/*
+ * Write a float 32 value of a MessagePack message
+ */
+void msgPackFloat(uint8_t* buffer, float value) {
+	uint32_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	buffer[0] = 0xca; // float 32
+	for (int i = 0; i < 4; i++) { // Big-endian
+		buffer[1 + i] = bits >> (24 - 8 * i);
+	}
+}
+
+/*
+ * Write an unsigned integer of a MessagePack message
+ *
+ * The shortest encoding is used. Returns the number of bytes
+ * written, at most nine.
+ */
+size_t msgPackInteger(uint8_t* buffer, uint64_t value) {
+	if (value < 0x80) { // positive fixint
+		buffer[0] = value;
+		return 1;
+	}
+	int bytes = (value <= 0xff) ? 1 : (value <= 0xffff) ? 2 : (value <= 0xffffffff) ? 4 : 8; // Size of the number
+	buffer[0] = (bytes == 1) ? 0xcc : (bytes == 2) ? 0xcd : (bytes == 4) ? 0xce : 0xcf; // uint 8 to uint 64
+	for (int i = 0; i < bytes; i++) { // Big-endian
+		buffer[1 + i] = value >> (8 * (bytes - 1 - i));
+	}
+	return bytes + 1;
+}
+
+/*
+ * Convert a volume in ml received in a command to microlitres
+ *
+ * Negative volumes are 0, volumes beyond the range of the
+ * fixed-point representation are clamped.
+ */
+uint32_t microlitres(float volume) {
+	if (!(volume > 0.0)) { // Negative or not a number
+		return 0;
+	}
+	return (volume < UINT32_MAX / 1000.0) ? (uint32_t) (volume * 1000.0 + 0.5) : UINT32_MAX;
+}
+
+/*
+ * Apply a command
+ *
+ * This function assigns the values of a command to the
+ * corresponding variables.
+ */
+void applyCommand(const Command& command) {
+	if (command.keys & COMMAND_STATE) { // Command contains a valid state
+		state = command.state; // set state to on or off
+	}
+
+	if (command.keys & COMMAND_VOLUME) { // Command contains volume key
+		volumeTarget = microlitres(command.volume); // set total volume
+	}
+
+	if (command.keys & COMMAND_FLOW) { // Command contains flow key
+		flowTarget = (command.flow > 0.0) ? microlitres(command.flow * 1000.0) / 60 : PUMP_FLOW; // Flow of the run in microlitres per s, 0 restores the default
+	}
 
-	while (WiFi.status() != WL_CONNECTED) { // Loop until connected to WiFi network
-		delay(500); // Wait 500 ms
-		Serial.print("."); // Print debug info
+	if (command.keys & COMMAND_POWER_PROFILE) { // Command contains power profile key
+		if (command.powerProfile >= 0) { // Profile found
+			powerProfile = (WiFiSleepType_t) command.powerProfile; // Set power saving profile while idle
+		}
+		if (!state) { // System is idle
+			setPowerMode(powerProfile); // Apply new profile immediately
+		}
 	}
 
-	Serial.println(""); // Print debug info
-	Serial.println("WiFi connected"); // Print debug info
-	Serial.println("IP address: "); // Print debug info
-	Serial.println(WiFi.localIP()); // Print debug info
+	if (command.keys & COMMAND_TRACE) { // Command contains trace key
+		traceRequested = CONFIG_TRACE; // Publish the trace ring from loop()
+	}
 }
 
 /*
  * Process incoming JSON formatted message
  * 
  * This function processes an incoming JSON formatted
- * message from the MQTT broker. The message is deparsed
- * and the new values assigned to the corresponding variables.
+ * message from the MQTT broker. The message is parsed
+ * in place and the new values assigned to the corresponding
+ * variables. Nothing is changed if the message is invalid.
  */
 bool processJson(char* message) {
-	StaticJsonDocument<JSON_DOCUMENT_SIZE> jsonDocument; // Initialize new JSON document
+	Command command; // Values contained in the message
+
+	if (!parseCommand(message, command)) { // parsing message failed
+		LOG_WARNING("Parsing command failed"); // Print debug info
+		return false; // return with failure status
+	}
 
-	auto error = deserializeJson(jsonDocument, message); // parse message to JSON object
+	applyCommand(command); // Assign new values
+	return true; // return with success status
+}
+
+/*
+ * Process incoming MessagePack encoded message
+ *
+ * This function processes a command received on the set
+ * topic with the binary suffix. Nothing is changed if the
+ * message is invalid.
+ */
+bool processMsgPack(const uint8_t* message, size_t length) {
+	Command command; // Values contained in the message
 
-	if (error) { // parsing message failed
-		Serial.println("parseObject() failed"); // Print debug info
-    	Serial.print(F("deserializeJson() failed: ")); // Print debug info
-    	Serial.println(error.c_str()); // Print debug info
+	if (!parseMsgPack(message, length, command)) { // parsing message failed
+		LOG_WARNING("Parsing MessagePack command failed"); // Print debug info
 		return false; // return with failure status
 	}
 
-	if (jsonDocument.containsKey("state")) { // JSON object contains state key
-		if (strcmp(jsonDocument["state"], CONFIG_MQTT_PAYLOAD_ON) == 0) { // state on is requested
-			state = true; // set state to on
-		}
-		else if (strcmp(jsonDocument["state"], CONFIG_MQTT_PAYLOAD_OFF) == 0) { // state off is requested
-			state = false;// set state to off
+	applyCommand(command); // Assign new values
+	return true; // return with success status
+}
+
+/*
+ * Append a number to the backlog record
+ *
+ * Numbers are stored as variable length integers as in the
+ * capture. Returns the number of bytes written, at most five.
+ */
+size_t backlogNumber(uint8_t* buffer, uint32_t value) {
+	size_t length = 0;
+	while (value >= 0x80) { // Further bytes follow
+		buffer[length++] = (value & 0x7f) | 0x80;
+		value >>= 7;
+	}
+	buffer[length++] = value;
+	return length;
+}
+
+/*
+ * Read a number from the backlog
+ */
+uint32_t backlogRead() {
+	uint32_t value = 0;
+	for (int shift = 0; backlogTail < backlogHead; shift += 7) { // Numbers never cross the head
+		uint8_t byte = backlogBuffer[backlogTail++];
+		value |= (uint32_t) (byte & 0x7f) << shift;
+		if (!(byte & 0x80)) { // Last byte
+			break;
 		}
 	}
+	return value;
+}
 
-	if (jsonDocument.containsKey("volume")) { // JSON object contains volume key
-		volumeTotal = (float) jsonDocument["volume"]; // set total volume
+/*
+ * Buffer a state update while the broker is unreachable
+ *
+ * Every update is stored as the time since the previous update
+ * in ms, shifted by two bits for the pump state and a flag for a
+ * changed target, followed by the target if it changed and the
+ * change of the current volume, zigzag-encoded. An update during
+ * a run takes four bytes. Published updates are removed from the
+ * front of the buffer when it fills up, updates not fitting into
+ * the full buffer are dropped and counted.
+ */
+void backlogRecord(bool pumpState, uint32_t target, uint32_t current) {
+	if (backlogHead == backlogTail) { // Backlog is empty, start over
+		backlogHead = backlogTail = 0;
+		backlogWriter = {millis(), false, 0, 0};
+		backlogReader = backlogWriter;
 	}
+	uint8_t record[15]; // Encoded update
+	uint32_t elapsed = min(millis() - backlogWriter.time, 0x3ffffffful); // Time since the previous update in ms
+	bool targetChanged = target != backlogWriter.target;
+	size_t length = backlogNumber(record, elapsed << 2 | pumpState << 1 | targetChanged); // Append time, state and flag
+	if (targetChanged) {
+		length += backlogNumber(record + length, target); // Append target
+	}
+	int32_t delta = current - backlogWriter.current; // Change of the current volume
+	length += backlogNumber(record + length, ((uint32_t) delta << 1) ^ (uint32_t) (delta >> 31)); // Append zigzag-encoded change
 
-	return true; // return with success status
+	if (backlogHead + length > sizeof(backlogBuffer) && backlogTail > 0) { // Space of published updates can be reused
+		memmove(backlogBuffer, backlogBuffer + backlogTail, backlogHead - backlogTail); // Move waiting updates to the front
+		backlogHead -= backlogTail;
+		backlogTail = 0;
+	}
+	if (backlogHead + length > sizeof(backlogBuffer)) { // Buffer is full
+		backlogDropped++; // Count lost update
+		return;
+	}
+	memcpy(backlogBuffer + backlogHead, record, length); // Append update
+	backlogHead += length;
+	backlogWriter = {backlogWriter.time + elapsed, pumpState, target, current}; // Base of the next update
+}
+
+/*
+ * Publish a page of the backlog
+ *
+ * The buffered updates are published in pages after the
+ * connection is back, one page per BACKLOG_PAGE_DELAY, so the
+ * reconnect does not flood the broker. Every update is an array
+ * of its age in ms, the pump state and the target and current
+ * volume in ml. A page which cannot be published is repeated.
+ *
+ * Sample Payload:
+ * {
+ *   "samples": [[5230, 1, 250.000, 101.240], [5130, 1, 250.000, 104.355]],
+ *   "dropped": 0
+ * }
+ */
+void backlogPublish() {
+	if ((backlogHead == backlogTail && backlogDropped == 0) || millis() - backlog_time < BACKLOG_PAGE_DELAY) { // Nothing to publish or page not due
+		return;
+	}
+	size_t tail = backlogTail; // Position and last update to restore if publishing fails
+	BacklogSample reader = backlogReader;
+	char buffer[BACKLOG_PAGE_SIZE]; // Define buffer for JSON message
+	size_t length = strlcpy_P(buffer, PSTR("{\"samples\":["), sizeof(buffer)); // Encode JSON message
+	unsigned long now = millis(); // Ages are relative to the publish time
+	for (size_t count = 0; backlogTail < backlogHead && length + BACKLOG_SAMPLE_SIZE + 24 < sizeof(buffer); count++) { // Add updates while the page has room
+		uint32_t header = backlogRead(); // Decode update
+		backlogReader.time += header >> 2;
+		backlogReader.state = header & 2;
+		if (header & 1) { // Target changed
+			backlogReader.target = backlogRead();
+		}
+		uint32_t delta = backlogRead();
+		backlogReader.current += (delta >> 1) ^ -(delta & 1);
+		if (count > 0) {
+			buffer[length++] = ',';
+		}
+		length += snprintf_P(buffer + length, sizeof(buffer) - length, PSTR("[%lu,%d,%u.%03u,%u.%03u]"), now - backlogReader.time, backlogReader.state,
+			backlogReader.target / 1000, backlogReader.target % 1000, backlogReader.current / 1000, backlogReader.current % 1000);
+	}
+	snprintf_P(buffer + length, sizeof(buffer) - length, PSTR("],\"dropped\":%u}"), backlogDropped);
+	if (publish(TOPIC_BACKLOG, buffer)) { // Page was sent
+		backlogDropped = 0;
+		backlog_time = millis(); // Save current system time for the page delay
+	} else { // Repeat page
+		backlogTail = tail;
+		backlogReader = reader;
+	}
 }
 
 /*
  * Publish JSON formatted state to MQTT broker
  * 
- * This function sends the current state of the
+ * This function sends the given state of the
  * system to the MQTT broker as JSON formatted message.
+ * The volumes are given in microlitres and published
+ * in ml. With CONFIG_TOTALIZER, the lifetime volume in ml,
+ * flow meter pulses and number of runs are added. After a
+ * MessagePack command, the state is encoded as MessagePack
+ * map with the keys STATE_KEY_* and sent to the state topic
+ * with the binary suffix instead.
+ *
+ * While the broker is unreachable, the state is added to the
+ * backlog instead.
+ *
+ * Sample Payload (hex):
+ *   86 00 c3 01 ca 43 7a 00 00 02 ca 42 dc 00 00
+ *   03 cd 30 39 04 ce 00 02 1f 17 05 2a
+ *   = {0: true, 1: 250.0, 2: 110.0, 3: 12345, 4: 139031, 5: 42}
  *
  * Sample Payload:
  * {
  *   "volumeTarget": 120,
  *   "volumeCurrent": 110,
- *   "state": "ON"
+ *   "state": "ON",
+ *   "volumeLifetime": 12345,
+ *   "pulsesLifetime": 139031,
+ *   "runs": 42
  * }
  */
+void publishState(bool pumpState, uint32_t target, uint32_t current) {
+	if (!mqtt.connected()) { // Broker is unreachable
+		backlogRecord(pumpState, target, current); // Publish update after reconnecting
+		return;
+	}
+	float targetMl = target / 1000.0; // Convert volumes to ml
+	float currentMl = current / 1000.0;
+	if (stateBinary) { // Last command was encoded as MessagePack
+		uint8_t buffer[45] = {(uint8_t) (CONFIG_TOTALIZER ? 0x86 : 0x83), STATE_KEY_STATE, (uint8_t) (pumpState ? 0xc3 : 0xc2), STATE_KEY_TARGET, 0, 0, 0, 0, 0, STATE_KEY_CURRENT}; // Map of three values and the lifetime totals
+		msgPackFloat(buffer + 4, targetMl); // Encode volumes as float 32
+		msgPackFloat(buffer + 10, currentMl);
+		size_t length = 15; // Length of the message
+		if (CONFIG_TOTALIZER) { // Lifetime totals are kept
+			buffer[length++] = STATE_KEY_VOLUME_LIFETIME; // Encode totals as shortest integers
+			length += msgPackInteger(buffer + length, totals.volume / 1000);
+			buffer[length++] = STATE_KEY_PULSES_LIFETIME;
+			length += msgPackInteger(buffer + length, totals.pulses);
+			buffer[length++] = STATE_KEY_RUNS;
+			length += msgPackInteger(buffer + length, totals.runs);
+		}
+		publish(TOPIC_STATE_BINARY, buffer, length, true); // Publish MessagePack message to MQTT server
+		return;
+	}
+
+	StaticJsonDocument<JSON_DOCUMENT_SIZE + sizeof(CONFIG_MQTT_PAYLOAD_ON) + sizeof(CONFIG_MQTT_PAYLOAD_OFF)> jsonDocument; // Initialize new JSON document, the state is copied from flash
+
+	jsonDocument["state"] = FPSTR((pumpState) ? PAYLOAD_ON : PAYLOAD_OFF); // Create and assign state key
+	jsonDocument["volumeTarget"] = targetMl; // Create and assign total volume key
+	jsonDocument["volumeCurrent"] = currentMl; // Create and assign current volume key
+	if (CONFIG_TOTALIZER) { // Lifetime totals are kept
+		jsonDocument["volumeLifetime"] = totals.volume / 1000; // Create and assign lifetime volume key
+		jsonDocument["pulsesLifetime"] = totals.pulses; // Create and assign lifetime pulses key
+		jsonDocument["runs"] = totals.runs; // Create and assign run count key
+	}
+
+	char buffer[measureJson(jsonDocument) + 1]; // Define buffer for JSON message
+	serializeJson(jsonDocument, buffer, sizeof(buffer)); // Encode JSON object as string
+	publish(TOPIC_STATE, buffer, true); // Publish JSON message to MQTT server
+}
+
+/*
+ * Publish current state to MQTT broker
+ */
 void sendState() {
-	StaticJsonDocument<JSON_DOCUMENT_SIZE> jsonDocument; // Initialize new JSON document
+	publishState(state, volumeTarget, pumpActive ? meterRead() : 0); // Publish current values
+}
+
+/*
+ * Publish the summary of a run to MQTT broker
+ *
+ * This function sends the summary of a finished run to the
+ * run topic. Volumes are given in ml, flows in l/min and times
+ * in ms. The overshoot is the delivered volume beyond the target,
+ * negative if less was delivered. firstPulse is missing if no
+ * pulse was counted.
+ *
+ * Sample Payload:
+ * {
+ *   "job": 42,
+ *   "reason": "target",
+ *   "volumeTarget": 250,
+ *   "volumeDelivered": 253.1,
+ *   "overshoot": 3.1,
+ *   "duration": 7512,
+ *   "flowAverage": 1.98,
+ *   "flowPeak": 2.11,
+ *   "firstPulse": 151
+ * }
+ */
+void publishRun(const RunSummary& summary) {
+	StaticJsonDocument<JSON_OBJECT_SIZE(9)> jsonDocument; // Initialize new JSON document, the reason is copied from flash
+
+	jsonDocument["job"] = summary.job; // Create and assign job key
+	jsonDocument["reason"] = FPSTR(pgm_read_ptr(&RUN_REASON_NAMES[summary.reason])); // Create and assign termination reason key
+	jsonDocument["volumeTarget"] = summary.target / 1000.0; // Create and assign target volume key
+	jsonDocument["volumeDelivered"] = summary.delivered / 1000.0; // Create and assign delivered volume key
+	jsonDocument["overshoot"] = ((int32_t) summary.delivered - (int32_t) summary.target) / 1000.0; // Create and assign overshoot key
+	jsonDocument["duration"] = summary.duration; // Create and assign duration key
+	jsonDocument["flowAverage"] = summary.flowAverage * 0.00006; // Create and assign average flow key in l/min
+	jsonDocument["flowPeak"] = summary.flowPeak * 0.00006; // Create and assign peak flow key in l/min
+	if (summary.firstPulse != NO_PULSE) { // Flow meter responded
+		jsonDocument["firstPulse"] = summary.firstPulse; // Create and assign time to first pulse key
+	}
+
+	char buffer[measureJson(jsonDocument) + 1]; // Define buffer for JSON message
+	serializeJson(jsonDocument, buffer, sizeof(buffer)); // Encode JSON object as string
+	publish(TOPIC_RUN, buffer); // Publish JSON message to MQTT server
+}
+
+/*
+ * Append a run to a history page
+ *
+ * The run is written as array of job, reason, target volume,
+ * delivered volume, duration, time to the first pulse, average
+ * and peak flow, in the units of the run summary. Returns the
+ * number of characters written.
+ */
+size_t historyFormat(char* buffer, size_t size, const RunSummary& summary) {
+	char reason[8]; // Reason copied from flash
+	strlcpy_P(reason, (PGM_P) pgm_read_ptr(&RUN_REASON_NAMES[summary.reason]), sizeof(reason));
+	char firstPulse[11] = "null"; // Time to the first pulse, null without pulses
+	if (summary.firstPulse != NO_PULSE) {
+		ultoa(summary.firstPulse, firstPulse, 10);
+	}
+	uint32_t flowAverage = (uint64_t) summary.flowAverage * 60 / 1000; // Flows in ml/min, written in l/min
+	uint32_t flowPeak = (uint64_t) summary.flowPeak * 60 / 1000;
+	int length = snprintf_P(buffer, size, PSTR("[%u,\"%s\",%u.%03u,%u.%03u,%u,%s,%u.%03u,%u.%03u]"), summary.job, reason,
+		summary.target / 1000, summary.target % 1000, summary.delivered / 1000, summary.delivered % 1000, summary.duration, firstPulse,
+		flowAverage / 1000, flowAverage % 1000, flowPeak / 1000, flowPeak % 1000);
+	return min((size_t) max(length, 0), size - 1); // Length of a truncated run
+}
+
+/*
+ * Publish a page of the run history to MQTT broker
+ *
+ * This function sends up to CONFIG_HISTORY_PAGE runs with a job
+ * number above the given one, oldest first. "more" tells that
+ * further runs are available, which are fetched by requesting
+ * the runs after the last job of the page. A summary which has
+ * not been written to flash yet is included. The request is only
+ * stored by the callback, the page is built from loop() while the
+ * pump is off, as scanning the journal reads every slot.
+ *
+ * Sample Payload:
+ * {
+ *   "after": 40,
+ *   "runs": [
+ *     [41, "target", 250.000, 253.112, 7512, 151, 1.980, 2.110],
+ *     [42, "stopped", 500.000, 120.321, 3520, 148, 2.010, 2.180]
+ *   ],
+ *   "more": false
+ * }
+ */
+void sendHistory() {
+	if (!CONFIG_HISTORY || !historyRequested || pumpActive || !mqtt.connected()) { // Nothing to publish or pump is running
+		return;
+	}
+	historyRequested = false; // Request is handled
+	uint32_t after = historyAfter;
+	RunSummary page[CONFIG_HISTORY_PAGE]; // Runs of the page ordered by job number
+	size_t count = 0; // Runs in the page
+	bool more = false; // Further runs are available
+	uint32_t slots = FLASH_SECTOR_SIZE / (historyJournal.size + JOURNAL_OVERHEAD) * historyJournal.sectors; // Slots of the journal
+	for (uint32_t slot = 0; slot <= slots; slot++) { // Scan all slots and the pending summary
+		RunSummary summary;
+		if (slot < slots) { // Slot of the journal
+			uint32_t sequence = journalRead(historyJournal, slot, &summary);
+			if (sequence == JOURNAL_EMPTY || sequence == 0) { // No summary
+				continue;
+			}
+		} else if (historyPending) { // Summary not written yet
+			summary = historyRecord;
+		} else {
+			continue;
+		}
+		if (summary.job <= after) { // Run was fetched already
+			continue;
+		}
+		if (count == CONFIG_HISTORY_PAGE) { // Page is full
+			more = true;
+			if (summary.job > page[count - 1].job) { // Run belongs to a later page
+				continue;
+			}
+			count--; // Drop latest run of the page
+		}
+		size_t i = count++; // Insert run ordered by job number
+		for (; i > 0 && page[i - 1].job > summary.job; i--) {
+			page[i] = page[i - 1];
+		}
+		page[i] = summary;
+	}
+
+	char buffer[HISTORY_PAGE_SIZE]; // Define buffer for JSON message
+	size_t length = snprintf_P(buffer, sizeof(buffer), PSTR("{\"after\":%u,\"runs\":["), after); // Encode JSON message
+	for (size_t i = 0; i < count; i++) { // Add all runs
+		if (i > 0) {
+			buffer[length++] = ',';
+		}
+		length += historyFormat(buffer + length, sizeof(buffer) - length, page[i]);
+	}
+	strlcpy_P(buffer + length, more ? PSTR("],\"more\":true}") : PSTR("],\"more\":false}"), sizeof(buffer) - length);
+	publish(TOPIC_HISTORY, buffer); // Publish JSON message to MQTT server
+}
+
+/*
+ * Publish diagnostic information to MQTT broker
+ *
+ * This function sends the selected power saving profile
+ * together with the measured command latency and the
+ * estimated current consumption of each profile. The
+ * average current is estimated from the time spent in
+ * each profile. The memory figures show the free heap,
+ * its largest free block and fragmentation, the lowest
+ * free stack of loop() since boot and the largest MQTT
+ * packet compared to the size of the MQTT buffer.
+ *
+ * Sample Payload:
+ * {
+ *   "powerProfile": "modem",
+ *   "currentAverage": 18.2,
+ *   "profiles": {
+ *     "none": {"current": 70.0, "latency": 9.5},
+ *     "light": {"current": 0.9},
+ *     "modem": {"current": 15.0, "latency": 104.2}
+ *   },
+ *   "memory": {
+ *     "freeHeap": 42000,
+ *     "maxFreeBlock": 36000,
+ *     "fragmentation": 14,
+ *     "freeStack": 2600,
+ *     "mqttBufferUsed": 120,
+ *     "mqttBufferSize": 256
+ *   }
+ * }
+ */
+void sendDiagnostics() {
+	StaticJsonDocument<JSON_OBJECT_SIZE(4) + JSON_OBJECT_SIZE(3) + 3 * JSON_OBJECT_SIZE(2) + JSON_OBJECT_SIZE(6) + 32> jsonDocument; // Initialize new JSON document, the profile names are copied from flash
+
+	setPowerMode(powerMode); // Account time spent in the current profile
+	float charge = 0.0; // Consumed charge in mA * ms
+	unsigned long total = 0; // Total accounted time in ms
+	for (int i = 0; i < 3; i++) { // Sum up all profiles
+		charge += POWER_PROFILE_CURRENT[i] * powerTime[i]; // Add charge consumed in profile
+		total += powerTime[i]; // Add time spent in profile
+	}
 
-	jsonDocument["state"] = (state) ? CONFIG_MQTT_PAYLOAD_ON : CONFIG_MQTT_PAYLOAD_OFF; // Create and assign state key
-	jsonDocument["volumeTarget"] = volumeTotal; // Create and assign total volume key
-	jsonDocument["volumeCurrent"] = (volumeCurrent == -1.0) ? 0.0 : volumeCurrent; // Create and assign current volume key
+	jsonDocument["powerProfile"] = FPSTR(pgm_read_ptr(&POWER_PROFILE_NAMES[powerProfile])); // Create and assign power profile key
+	jsonDocument["currentAverage"] = (total > 0) ? charge / total : POWER_PROFILE_CURRENT[powerMode]; // Create and assign average current key
+	JsonObject profiles = jsonDocument.createNestedObject("profiles"); // Create profiles key
+	for (int i = 0; i < 3; i++) { // Add all profiles
+		JsonObject profile = profiles.createNestedObject(FPSTR(pgm_read_ptr(&POWER_PROFILE_NAMES[i]))); // Create profile key
+		profile["current"] = POWER_PROFILE_CURRENT[i]; // Create and assign estimated current key
+		if (powerLatency[i] >= 0.0) { // Latency has been measured for this profile
+			profile["latency"] = powerLatency[i]; // Create and assign latency key
+		}
+	}
+	JsonObject memory = jsonDocument.createNestedObject("memory"); // Create memory key
+	memory["freeHeap"] = ESP.getFreeHeap(); // Create and assign free heap key
+	memory["maxFreeBlock"] = ESP.getMaxFreeBlockSize(); // Create and assign largest free block key
+	memory["fragmentation"] = ESP.getHeapFragmentation(); // Create and assign heap fragmentation key
+	memory["freeStack"] = ESP.getFreeContStack(); // Create and assign lowest free stack key
+	memory["mqttBufferUsed"] = mqttBufferUsed; // Create and assign MQTT buffer high-water mark key
+	memory["mqttBufferSize"] = mqtt.getBufferSize(); // Create and assign MQTT buffer size key
 
 	char buffer[measureJson(jsonDocument) + 1]; // Define buffer for JSON message
 	serializeJson(jsonDocument, buffer, sizeof(buffer)); // Encode JSON object as string
-	mqtt.publish(CONFIG_MQTT_TOPIC_STATE, buffer, true); // Publish JSON message to MQTT server
+	publish(TOPIC_DIAGNOSTICS, buffer, true); // Publish JSON message to MQTT server
+}
+
+/*
+ * Send command latency measurement
+ *
+ * The command latency is measured by publishing the current
+ * system time to the ping topic, which the system subscribes
+ * to itself. The round trip includes the broker as well as
+ * the wake up delay of the WiFi power saving profile.
+ */
+void sendPing() {
+	char buffer[11]; // Define buffer for system time
+	ultoa(millis(), buffer, 10); // Encode system time as string
+	pingMode = powerMode; // Save profile the measurement belongs to
+	publish(TOPIC_PING, buffer); // Publish system time to MQTT server
+}
+
+/*
+ * Process command latency measurement
+ *
+ * This function evaluates a returning latency measurement
+ * and publishes the updated diagnostic information.
+ */
+void processPing(char* message) {
+	float latency = millis() - strtoul(message, NULL, 10); // Round trip time in ms
+	if (powerLatency[pingMode] < 0.0) { // First measurement for this profile
+		powerLatency[pingMode] = latency; // Initialize average
+	} else {
+		powerLatency[pingMode] += (latency - powerLatency[pingMode]) / 8; // Update moving average
+	}
+	sendDiagnostics(); // Update MQTT diagnostic information
+}
+
+/*
+ * Publish buffered telemetry
+ *
+ * This function publishes the result of a run which
+ * finished while the MQTT broker was unreachable before
+ * the last deep sleep. Without deep sleep, the result is
+ * published from the backlog instead.
+ */
+void flushTelemetry() {
+	if (rtcData.pending) { // Unpublished run available
+		publishState(false, rtcData.pendingTarget, rtcData.pendingVolume); // Publish result of the run
+		rtcData.pending = false; // Run has been published
+	}
+}
+
+/*
+ * Publish the K-factor table
+ *
+ * Every point is an array of its flow in l/min and the pulses
+ * per litre. The table is retained, so it can be checked at any
+ * time.
+ *
+ * Sample Payload:
+ * {
+ *   "points": [[0.502, 1897.3], [1.498, 1931.6]]
+ * }
+ */
+void publishCalibration() {
+	char buffer[24 + CALIBRATION_POINTS * 28]; // Define buffer for JSON message
+	size_t length = strlcpy_P(buffer, PSTR("{\"points\":["), sizeof(buffer)); // Encode JSON message
+	for (uint32_t i = 0; i < calibration.count; i++) {
+		uint32_t flow = (uint64_t) calibration.points[i].flow * 60 / 1000; // Flow in thousandths of l/min
+		length += snprintf_P(buffer + length, sizeof(buffer) - length, PSTR("%s[%u.%03u,%u.%01u]"), i ? "," : "", flow / 1000, flow % 1000,
+			calibration.points[i].kFactor / 1000, calibration.points[i].kFactor % 1000 / 100);
+	}
+	strlcpy_P(buffer + length, PSTR("]}"), sizeof(buffer) - length);
+	publish(TOPIC_CALIBRATION, buffer, true);
+}
+
+/*
+ * Add a calibration point
+ *
+ * The reference volume measured for the last calibration run
+ * gives the K-factor at the average flow while the pump was
+ * running. The share of the coast-down in the reference volume
+ * is taken from the pulses counted after switching off the pump. The point
+ * replaces an existing one within CALIBRATION_MERGE of its flow
+ * or, if the table is full, the point with the nearest flow.
+ */
+void calibrationAdd(float reference) {
+	uint32_t volume = microlitres(reference); // Reference volume in microlitres
+	if (!calibrationDone || volume == 0 || calibrationPulses == 0 || calibrationDuration == 0) { // No calibration run to complete
+		LOG_WARNING("No calibration run for the reference volume"); // Print debug info
+		return;
+	}
+	calibrationDone = false;
+	uint32_t flow = (uint64_t) volume * min(calibrationPumpPulses, calibrationPulses) / calibrationPulses * 1000 / calibrationDuration; // Average flow while the pump was running in microlitres per s, without the coast-down
+	uint32_t kFactor = (uint64_t) calibrationPulses * 1000000000 / volume; // Pulses per litre in thousandths
+	uint32_t nearest = 0; // Index of the point with the nearest flow
+	for (uint32_t i = 1; i < calibration.count; i++) {
+		if (abs((int32_t) (calibration.points[i].flow - flow)) < abs((int32_t) (calibration.points[nearest].flow - flow))) {
+			nearest = i;
+		}
+	}
+	if (calibration.count > 0 && (calibration.count == CALIBRATION_POINTS || abs((int32_t) (calibration.points[nearest].flow - flow)) < flow * CALIBRATION_MERGE)) { // Replace point
+		calibration.points[nearest] = {flow, kFactor};
+	} else { // Add point
+		calibration.points[calibration.count++] = {flow, kFactor};
+	}
+	for (uint32_t i = 1; i < calibration.count; i++) { // Keep points sorted by flow
+		for (uint32_t j = i; j > 0 && calibration.points[j - 1].flow > calibration.points[j].flow; j--) {
+			auto point = calibration.points[j];
+			calibration.points[j] = calibration.points[j - 1];
+			calibration.points[j - 1] = point;
+		}
+	}
+	pulseVolume = calibrationPulseVolume(meterFlow); // Use the new table from now on
+	LOG_INFO("Calibrated %u pulses/l at %u ul/s", kFactor / 1000, flow); // Print debug info
+	calibrationChanged = true; // Write table from loop()
+	publishCalibration();
+}
+
+/*
+ * Process a message on the calibration topic
+ *
+ * "start" starts a calibration run at the flow of the runs,
+ * "stop" stops it. After the coast-down, the volume collected
+ * during the run is measured and sent in ml, which adds a point
+ * to the K-factor table. "reset" clears the table, unless a
+ * calibration run is still waiting for its reference volume.
+ */
+void processCalibration(const char* message) {
+	if (strcmp_P(message, PSTR("start")) == 0) { // Start calibration run
+		if (state || runSettling) { // A run is in progress
+			LOG_WARNING("Calibration needs the pump to be off"); // Print debug info
+			return;
+		}
+		calibrating = true;
+		calibrationDone = false;
+		volumeTarget = CONFIG_CALIBRATION_LIMIT * 1000UL; // Safety limit of the run
+		state = true; // Run starts in loop()
+	} else if (strcmp_P(message, PSTR("stop")) == 0) { // Stop calibration run
+		if (calibrating) {
+			state = false; // Pump is switched off in loop()
+		}
+	} else if (strcmp_P(message, PSTR("reset")) == 0) { // Back to the nominal K-factor
+		if (calibrating || calibrationDone) { // Calibration run is not complete
+			LOG_WARNING("Calibration run in progress, send the reference volume first"); // Print debug info
+			return;
+		}
+		calibration.count = 0;
+		pulseVolume = calibrationPulseVolume(0); // Nominal volume per pulse
+		calibrationChanged = true; // Write table from loop()
+		publishCalibration();
+	} else { // Reference volume
+		calibrationAdd(strtod(message, NULL));
+	}
+	sendState(); // Update MQTT system status
 }
 
 /*
@@ -119,6 +2492,8 @@ void sendState() {
  * This function is called every time the set-topic
  * is changed. It processes the incoming new message
  * and sends the new system status to the MQTT broker.
+ * Messages on the set topic with the binary suffix are
+ * decoded as MessagePack.
  *
  * Sample Payload:
  * {
@@ -127,20 +2502,42 @@ void sendState() {
  * }
  */
 void callback(char* topic, byte* payload, unsigned int length) {
-	Serial.print("New meessage arrived: ["); // Print debug info
-	Serial.print(topic); // Print debug info
-	Serial.print("] "); // Print debug info
+	mqttPacket(topic, length); // Account buffer usage
+	captureMessage(CAPTURE_INBOUND, topic, payload, length, false); // Capture inbound message
+	if (CONFIG_TRACE) { // Trace is enabled
+		traceEvent(TRACE_CALLBACK_BEGIN, topicIndex(topic), length); // Trace inbound message
+	}
 
 	char message[length + 1]; // Create new empty character array
 	for (unsigned int i = 0; i < length; i++) { // Copy message to character array
 		message[i] = (char)payload[i]; // Copy byte to character array
 	}
 	message[length] = '\0'; // Terminate message
-	Serial.println(message); // Print debug info
+	LOG_DEBUG("Message arrived [%s] %s", topic, message); // Print debug info
+	if (strcmp_P(topic, TOPIC_PING) == 0) { // Latency measurement returned
+		processPing(message); // Evaluate latency measurement
+		traceEvent(TRACE_CALLBACK_END); // Trace end of the callback
+		return;
+	}
+	activity_time = millis(); // Keep system awake for further commands
+	if (CONFIG_CALIBRATION && strcmp_P(topic, TOPIC_CALIBRATE) == 0) { // Flow meter calibration
+		processCalibration(message); // Start, stop or complete calibration
+		traceEvent(TRACE_CALLBACK_END); // Trace end of the callback
+		return;
+	}
+	if (CONFIG_HISTORY && strcmp_P(topic, TOPIC_HISTORY_GET) == 0) { // Run history requested
+		historyAfter = strtoul(message, NULL, 10); // Publish runs after the requested job from loop()
+		historyRequested = true;
+		traceEvent(TRACE_CALLBACK_END); // Trace end of the callback
+		return;
+	}
 
-	if (processJson(message)) { // processing JSON successful
+	bool binary = CONFIG_MQTT_BINARY && strcmp_P(topic, TOPIC_SET_BINARY) == 0; // Command is encoded as MessagePack
+	if (binary ? processMsgPack(payload, length) : processJson(message)) { // processing command successful
+		stateBinary = binary; // Answer in the format of the command
 		sendState(); // Update MQTT system status
 	}
+	traceEvent(TRACE_CALLBACK_END); // Trace end of the callback
 }
 
 /*
@@ -150,22 +2547,50 @@ void callback(char* topic, byte* payload, unsigned int length) {
  * the given parameters. The last will for the MQTT connection
  * is setting the availability topic to offline.
  * Status information will be printed to the serial interface
- * for debugging purposes.
+ * for debugging purposes. A failed attempt is repeated after
+ * MQTT_RETRY_DELAY without blocking the loop, so a running
+ * pump is still stopped in time. In deep sleep mode, the
+ * connection is given up after a few attempts to save battery.
  */
 void MQTTconnect() {
-	while (!mqtt.connected()) { // Loop until connected
-		Serial.print("Attempting MQTT connection..."); // Print debug info
-		if (mqtt.connect(CONFIG_MQTT_CLIENT_ID, CONFIG_MQTT_USER, CONFIG_MQTT_PASS, CONFIG_MQTT_TOPIC_AVAILABILITY, 0, 1, CONFIG_MQTT_PAYLOAD_OFFLINE)) { // Connect was successful
-			Serial.println("connected"); // Print debug info
-			mqtt.publish(CONFIG_MQTT_TOPIC_AVAILABILITY, CONFIG_MQTT_PAYLOAD_ONLINE, true); // Set system availability to online
-			sendState(); // Update MQTT system status
-			mqtt.subscribe(CONFIG_MQTT_TOPIC_SET); // Subscripe to set value topic
-		} else { // Connect failed
-			Serial.print("failed, rc="); // Print debug info
-			Serial.print(mqtt.state()); // Print debug info
-			Serial.println(" try again in 5 seconds"); // Print debug info
-			delay(5000); // Wait 5 seconds before retrying
+	if (offline || (mqttAttempts > 0 && millis() - mqtt_time < MQTT_RETRY_DELAY)) { // Connection given up or retry not due yet
+		return;
+	}
+	if (mqttAttempts == 0) { // First attempt after losing the connection
+		captureEvent(CAPTURE_EVENT_DISCONNECTED); // Capture loss of the connection
+	}
+	mqtt_time = millis(); // Save current system time for the retry delay
+	LOG_INFO("Attempting MQTT connection"); // Print debug info
+	char willTopic[TOPIC_SIZE]; // Last will copied from flash
+	char willMessage[sizeof(CONFIG_MQTT_PAYLOAD_OFFLINE)];
+	strlcpy_P(willTopic, TOPIC_AVAILABILITY, sizeof(willTopic));
+	strcpy_P(willMessage, PAYLOAD_OFFLINE);
+	if (mqtt.connect(CONFIG_MQTT_CLIENT_ID, CONFIG_MQTT_USER, CONFIG_MQTT_PASS, willTopic, 0, 1, willMessage)) { // Connect was successful
+		LOG_INFO("MQTT connected"); // Print debug info
+		mqttAttempts = 0;
+		captureEvent(CAPTURE_EVENT_CONNECTED); // Capture connection
+		char online[sizeof(CONFIG_MQTT_PAYLOAD_ONLINE)]; // Availability payload copied from flash
+		strcpy_P(online, PAYLOAD_ONLINE);
+		publish(TOPIC_AVAILABILITY, online, true); // Set system availability to online
+		flushTelemetry(); // Publish runs finished while offline
+		sendState(); // Update MQTT system status
+		subscribe(TOPIC_SET); // Subscripe to set value topic
+		if (CONFIG_MQTT_BINARY) { // MessagePack commands are accepted
+			subscribe(TOPIC_SET_BINARY); // Subscribe to binary set value topic
+		}
+		subscribe(TOPIC_PING); // Subscribe to latency measurement topic
+		if (CONFIG_HISTORY) { // Run history is kept
+			subscribe(TOPIC_HISTORY_GET); // Subscribe to history request topic
 		}
+		if (CONFIG_CALIBRATION) { // Flow meter can be calibrated
+			subscribe(TOPIC_CALIBRATE); // Subscribe to calibration topic
+		}
+		backlog_time = millis(); // Publish the backlog after the current state
+	} else if (++mqttAttempts >= CONFIG_SLEEP_CONNECT_ATTEMPTS && CONFIG_SLEEP_ENABLED) { // Do not drain the battery
+		LOG_WARNING("MQTT connection failed, rc=%d, giving up, watering offline", mqtt.state()); // Print debug info
+		offline = true; // Skip MQTT until the next wake period
+	} else { // Connect failed
+		LOG_WARNING("MQTT connection failed, rc=%d, try again in 5 seconds", mqtt.state()); // Print debug info
 	}
 }
 
@@ -177,7 +2602,231 @@ void MQTTconnect() {
  * water volume.
  */
 void ICACHE_RAM_ATTR pulseCounter() { // link interrupt handler to RAM
-	volumeCurrent += 1000.0 / CONFIG_FLOW_METER_PULSES; // Increment flown water volume
+	uint32_t now = micros(); // Time stamp of the pulse
+	if (pulseCount++ == 0) { // Count flown water volume, converted by loop()
+		pulseFirst = now; // First pulse of the run
+	}
+	pulseLast = now;
+	if (CONFIG_CAPTURE) { // Capture is enabled
+		capturePulses[capturePulseHead % CAPTURE_PULSE_SLOTS] = now; // Store time stamp, the pulse is captured by loop()
+		capturePulseHead++; // Publish time stamp to loop()
+	}
+	if (CONFIG_TRACE) { // Trace is enabled
+		traceRecord(TRACE_PULSE, 0, 0); // Trace pulse
+	}
+}
+
+/*
+ * Measure the peak flow of the running pump
+ *
+ * The flow is averaged over FLOW_WINDOW, as single pulses
+ * arrive too seldom for a meaningful rate.
+ */
+void runMeasureFlow() {
+	unsigned long elapsed = millis() - flow_time; // Length of the current window in ms
+	if (elapsed >= FLOW_WINDOW) { // Window is complete
+		uint32_t volume = meterRead();
+		runSummary.flowPeak = max(runSummary.flowPeak, (uint32_t) ((uint64_t) (volume - flowVolume) * 1000 / elapsed)); // Flow of the window in microlitres per s
+		flowVolume = volume; // Start next window
+		flow_time = millis();
+	}
+}
+
+/*
+ * Control the pump speed
+ *
+ * A PID controller sets the PWM duty cycle of the pump every
+ * CONFIG_PUMP_CONTROL_INTERVAL, so the measured flow follows
+ * the flow of the run. The flow is measured from the time
+ * between the pulses, which resolves it much finer than the
+ * few pulses per update. The setpoint ramps up from the
+ * approach flow for a soft start and falls off linearly to it
+ * within the last CONFIG_PUMP_APPROACH_VOLUME ml, as a slow
+ * final flow reduces the coast-down and thus the overshoot.
+ * The derivative acts on the measured flow to avoid kicks when
+ * the setpoint changes, the integral is limited to the duty
+ * range against windup while the tubing fills.
+ */
+void pumpControl() {
+	unsigned long elapsed = millis() - pump_time; // Time since the previous update in ms
+	if (elapsed < CONFIG_PUMP_CONTROL_INTERVAL) { // Update not due
+		return;
+	}
+	pump_time = millis(); // Save current system time for the control interval
+	noInterrupts(); // Pulse count and time of the same pulse
+	uint32_t pulses = pulseCount;
+	uint32_t last = pulseLast;
+	interrupts();
+	uint32_t now = micros();
+
+	uint32_t flow; // Measured flow in microlitres per s
+	if (pulses != pumpPulses) { // Pulses since the previous update
+		flow = (uint64_t) (pulses - pumpPulses) * pulseVolume / 1000 * 1000000 / max(last - pumpPulseTime, (uint32_t) 1);
+		pumpPulses = pulses;
+		pumpPulseTime = last;
+	} else { // The next pulse is at least this far away
+		flow = min(pumpFlow, (uint32_t) ((uint64_t) pulseVolume * 1000 / max(now - pumpPulseTime, (uint32_t) 1)));
+	}
+
+	uint32_t setpoint = flowTarget; // Flow to reach in microlitres per s
+	uint32_t running = (now - runStart) / 1000; // Time since the pump was switched on in ms
+	if (running < CONFIG_PUMP_SOFT_START && setpoint > PUMP_APPROACH_FLOW) { // Soft start
+		setpoint = PUMP_APPROACH_FLOW + (uint64_t) (setpoint - PUMP_APPROACH_FLOW) * running / CONFIG_PUMP_SOFT_START;
+	}
+	uint32_t volume = meterRead() + shutoffVolume; // Volume at which the pump is switched off
+	uint32_t remaining = (volumeTarget > volume) ? volumeTarget - volume : 0; // Volume left until the pump is switched off
+	if (remaining < CONFIG_PUMP_APPROACH_VOLUME * 1000UL) { // Final approach
+		setpoint = min(setpoint, max(PUMP_APPROACH_FLOW, (uint32_t) ((uint64_t) flowTarget * remaining / (CONFIG_PUMP_APPROACH_VOLUME * 1000UL))));
+	}
+
+	float dt = elapsed / 1000.0; // Time since the previous update in s
+	float error = (float) setpoint - flow;
+	pumpIntegral = constrain(pumpIntegral + pumpKi * error * dt, 0.0f, (float) PUMP_DUTY_RANGE);
+	float output = pumpKp * error + pumpIntegral - pumpKd * ((float) flow - pumpFlow) / dt;
+	pumpFlow = flow;
+	analogWrite(CONFIG_PIN_PUMP, constrain((int) output, CONFIG_PUMP_MIN_DUTY, PUMP_DUTY_RANGE)); // Apply duty cycle
+}
+
+/*
+ * Append a number to the flow frame
+ */
+void flowNumber(uint32_t value) {
+	flowLength += backlogNumber(flowFrame + flowLength, value);
+}
+
+/*
+ * Publish the flow frame
+ *
+ * The sample count is filled into the header before publishing.
+ * A frame which cannot be published is dropped, the state
+ * updates of the backlog cover the outage instead.
+ */
+void flowPublish() {
+	if (flowLength == 0) { // No samples
+		return;
+	}
+	flowFrame[6] = flowSamples; // Number of samples, little-endian
+	flowFrame[7] = flowSamples >> 8;
+	if (mqtt.connected()) { // Frame can be sent
+		publish(TOPIC_FLOW, flowFrame, flowLength);
+	}
+	flowLength = 0; // Start next frame with the next sample
+	flowFrames++;
+}
+
+/*
+ * Record a flow sample
+ *
+ * While the pump is running and during the coast-down, the pulse
+ * count is sampled every CONFIG_FLOW_SAMPLE_RATE ms and collected
+ * in a frame, which is published every CONFIG_FLOW_SAMPLE_BATCH ms
+ * instead of a state update per sample. Each frame starts with
+ * the time and pulse count of the previous sample, so it can be
+ * decoded on its own, the samples store the difference to their
+ * predecessor as variable length integers, two bytes per sample
+ * at usual flows.
+ *
+ * Frame format, all numbers little-endian:
+ *   Header: magic 0xf1, version 1, uint16 volume per pulse in
+ *           microlitres, uint16 frame index within the run, uint16
+ *           number of samples, uint32 time since the pump was
+ *           switched on in ms, uint32 pulse count
+ *   Sample: varint time since the previous sample in ms, varint
+ *           pulses since the previous sample
+ */
+void flowSample(bool force) {
+	if (!force && millis() - sample_time < CONFIG_FLOW_SAMPLE_RATE) { // Sample not due
+		return;
+	}
+	sample_time = millis(); // Save current system time for the sample rate
+	uint32_t time = (micros() - runStart) / 1000; // Time since the pump was switched on
+	uint32_t pulses = pulseCount;
+	if (flowLength + FLOW_SAMPLE_SIZE > sizeof(flowFrame)) { // Frame is full
+		flowPublish();
+	}
+	if (flowLength == 0) { // Start frame at the previous sample
+		uint8_t header[FLOW_HEADER_SIZE] = {FLOW_MAGIC, FLOW_VERSION, (uint8_t) (pulseVolume / 1000), (uint8_t) (pulseVolume / 1000 >> 8),
+			(uint8_t) flowFrames, (uint8_t) (flowFrames >> 8)};
+		for (int i = 0; i < 4; i++) {
+			header[8 + i] = flowSampleTime >> (8 * i);
+			header[12 + i] = flowSamplePulses >> (8 * i);
+		}
+		memcpy(flowFrame, header, sizeof(header));
+		flowLength = sizeof(header);
+		flowSamples = 0;
+		frame_time = millis(); // Save current system time for the batch interval
+	}
+	flowNumber(time - flowSampleTime); // Append sample
+	flowNumber(pulses - flowSamplePulses);
+	flowSamples++;
+	flowSampleTime = time;
+	flowSamplePulses = pulses;
+	if (millis() - frame_time >= CONFIG_FLOW_SAMPLE_BATCH) { // Batch interval is over
+		flowPublish();
+	}
+}
+
+/*
+ * Record the end of a run
+ *
+ * This function is called after the pump has been switched
+ * off. The flow meter stays attached to count the coast-down
+ * until the run is completed by runComplete().
+ */
+void runEnd(uint8_t reason) {
+	runStop = micros(); // Save time the pump was switched off
+	uint32_t pulses = pulseCount;
+	runSummary.target = volumeTarget; // Target at the end of the run, it may have been changed
+	runSummary.reason = reason;
+	runSummary.duration = (runStop - runStart) / 1000; // Time the pump was running
+	runSummary.firstPulse = (pulses > 0) ? (pulseFirst - runStart) / 1000 : NO_PULSE;
+	runSummary.flowAverage = (runSummary.duration > 0) ? (uint64_t) meterRead() * 1000 / runSummary.duration : 0;
+	calibrationPumpPulses = pulses; // Pulses while the pump was running
+	pulseLast = runStop; // Settle time starts with switching off the pump
+	runSettling = true; // Count coast-down
+}
+
+/*
+ * Complete the run after the coast-down
+ *
+ * The run is completed once no pulse arrived for RUN_SETTLE_TIME
+ * or, with force, immediately, e.g. when the next run starts.
+ * The delivered volume is added to the lifetime totals and the
+ * summary is published.
+ */
+void runComplete(bool force) {
+	if (!runSettling) { // No run to complete
+		return;
+	}
+	uint32_t now = micros();
+	if (!force && now - pulseLast < RUN_SETTLE_TIME && now - runStop < RUN_SETTLE_LIMIT) { // Water is still flowing
+		return;
+	}
+	detachInterrupt(digitalPinToInterrupt(CONFIG_PIN_FLOW_METER)); // Detach interrupt for flow meter
+	runSettling = false;
+	if (CONFIG_FLOW_SAMPLES) { // Flow is sampled
+		flowSample(true); // Record the end of the coast-down
+		flowPublish(); // Publish the last frame
+	}
+	uint32_t pulses = pulseCount;
+	runSummary.delivered = meterRead();
+	totalsAdd(pulses, runSummary.delivered); // Account run in the lifetime totals
+	runSummary.job = totals.runs; // Number the run
+	if (calibrating) { // Wait for the reference volume of the calibration run
+		calibrating = false;
+		calibrationDone = true;
+		calibrationPulses = pulses;
+		calibrationDuration = runSummary.duration;
+		LOG_INFO("Calibration run complete, %u pulses", pulses); // Print debug info
+	}
+	if (CONFIG_HISTORY) { // Run history is kept
+		historyAdd(runSummary); // Store summary in flash
+	}
+	LOG_INFO("Run %u complete, %u ul delivered", runSummary.job, runSummary.delivered); // Print debug info
+	if (mqtt.connected()) { // Summary is not buffered
+		publishRun(runSummary); // Publish summary
+		totalsOutdated = CONFIG_TOTALIZER; // Publish the new totals in the next iteration, keeping the messages in separate capture chunks
+	}
 }
 
 /*
@@ -190,6 +2839,10 @@ void ICACHE_RAM_ATTR pulseCounter() { // link interrupt handler to RAM
 void setup() {
 	// Set up pin modes
 	pinMode(CONFIG_PIN_PUMP, OUTPUT); // Set pump pin mode to output
+	if (CONFIG_PUMP_PWM) { // Pump speed is controlled
+		analogWriteRange(PUMP_DUTY_RANGE); // Set duty cycle resolution
+		analogWriteFreq(CONFIG_PUMP_PWM_FREQ); // Set PWM frequency
+	}
 	if (!CONFIG_DEBUG) { // Debug mode is disabled
 		pinMode(CONFIG_PIN_FLOW_METER, INPUT_PULLDOWN_16); // Set flow meter pin mode to input
 	}
@@ -199,51 +2852,156 @@ void setup() {
 		Serial.begin(115200); // Set serial baudrate to 115200 baud/s
 	}
 
+	captureEvent(CAPTURE_EVENT_BOOT); // Capture system start
+
+	// Restore deep sleep data
+	bool scheduled = false; // Scheduled run is due
+	if (CONFIG_SLEEP_ENABLED) { // Deep sleep mode is enabled
+		scheduled = sleepRestore(); // Go back to sleep if the next scheduled run is not due yet
+	}
+	if (CONFIG_TOTALIZER) { // Lifetime totals are kept
+		totalsRestore(); // Read the totals from the flash journal
+	}
+	if (CONFIG_HISTORY) { // Run history is kept
+		historyRestore(); // Open the run history, continuing the job numbers
+	}
+	if (CONFIG_CALIBRATION) { // Flow meter can be calibrated
+		calibrationRestore(); // Read the K-factor table from the flash journal
+	}
+
 	// Set up WiFi and MQTT
 	setup_wifi(); // Execute WiFi setup
+	setPowerMode(powerProfile); // Apply WiFi power saving profile
 	mqtt.setServer(CONFIG_MQTT_HOST, CONFIG_MQTT_PORT); // Set MQTT server
 	mqtt.setCallback(callback); // Register MQTT callback function
+	mqtt.setBufferSize(MQTT_BUFFER_SIZE); // Set MQTT buffer size
+	if (CONFIG_CAPTURE && CONFIG_CAPTURE_SIZE + sizeof(CONFIG_MQTT_TOPIC_CAPTURE) + MQTT_MAX_HEADER_SIZE + 2 > mqtt.getBufferSize()) { // Capture chunks do not fit
+		mqtt.setBufferSize(CONFIG_CAPTURE_SIZE + sizeof(CONFIG_MQTT_TOPIC_CAPTURE) + MQTT_MAX_HEADER_SIZE + 2); // Fit capture chunks into a packet
+	}
+	if (CONFIG_LOG_MQTT && CONFIG_LOG_BATCH_SIZE + sizeof(CONFIG_MQTT_TOPIC_LOG) + MQTT_MAX_HEADER_SIZE + 2 > mqtt.getBufferSize()) { // Log batches do not fit
+		mqtt.setBufferSize(CONFIG_LOG_BATCH_SIZE + sizeof(CONFIG_MQTT_TOPIC_LOG) + MQTT_MAX_HEADER_SIZE + 2); // Fit log batches into a packet
+	}
+	if (CONFIG_HISTORY && HISTORY_PAGE_SIZE + sizeof(CONFIG_MQTT_TOPIC_HISTORY) + MQTT_MAX_HEADER_SIZE + 2 > mqtt.getBufferSize()) { // History pages do not fit
+		mqtt.setBufferSize(HISTORY_PAGE_SIZE + sizeof(CONFIG_MQTT_TOPIC_HISTORY) + MQTT_MAX_HEADER_SIZE + 2); // Fit history pages into a packet
+	}
+
+	if (scheduled) { // Start scheduled run
+		volumeTarget = CONFIG_SLEEP_VOLUME * 1000UL; // Set total volume
+		state = true; // Set state to on
+		LOG_INFO("Scheduled run due"); // Print debug message
+	}
+	activity_time = millis(); // Start deep sleep awake window
 }
 
 /*
  * Infinite loop
  */
 void loop() {
-	if (!mqtt.connected()) { // No longer connected to MQTT server
+	traceEvent(TRACE_LOOP_BEGIN); // Trace start of the iteration
+
+	if (!offline && !mqtt.connected()) { // No longer connected to MQTT server
 		MQTTconnect(); // Attempt to reconnect to the MQTT server
 	}
 
-	if (!mqtt.loop()) { // Maintaining connection to MQTT server failed
+	if (!offline && !mqtt.loop()) { // Maintaining connection to MQTT server failed
 		MQTTconnect(); // Attempt to reconnect to the MQTT server
 	}
 
 	mqtt.loop(); // Maintain connection to MQTT server
 	if (state) { // Plant watering is activated
-		if (volumeCurrent == -1.0) { // Pump is not activated yet
-			volumeCurrent = 0.0; // Reset currently flown volume
+		if (!pumpActive) { // Pump is not activated yet
+			runComplete(true); // Complete the previous run before counting the next one
+			calibrationDone = false; // Reference volume only applies to the run before
+			pulseCount = 0; // Reset currently flown volume
+			pumpActive = true; // Pump is running from now on
+			runSummary.flowPeak = 0; // Reset peak flow
+			flowVolume = 0;
+			meterVolume = meterPulses = 0; // Convert the pulses of the new run
+			meterPulseTime = micros();
+			flow_time = millis();
 			attachInterrupt(digitalPinToInterrupt(CONFIG_PIN_FLOW_METER), pulseCounter, FALLING); // Attach interrupt for flow meter
-			digitalWrite(CONFIG_PIN_PUMP, HIGH); // Activate pump
+			runStart = micros(); // Save time the pump was switched on
+			flowFrames = flowSampleTime = flowSamplePulses = 0; // First frame starts with the pump
+			sample_time = millis();
+			if (CONFIG_PUMP_PWM) { // Pump speed is controlled
+				pumpIntegral = CONFIG_PUMP_MIN_DUTY; // Start slowly
+				pumpFlow = pumpPulses = 0;
+				pumpPulseTime = runStart;
+				pump_time = millis();
+				analogWrite(CONFIG_PIN_PUMP, CONFIG_PUMP_MIN_DUTY); // Activate pump
+			} else {
+				digitalWrite(CONFIG_PIN_PUMP, HIGH); // Activate pump
+			}
+			traceEvent(TRACE_PUMP_ON); // Trace pump activation
+			setPowerMode(WIFI_NONE_SLEEP); // Keep WiFi awake during the run
       		millis_time = millis(); // Save current system time for status update delay
-			Serial.println("Watering plants."); // Print debug message
-		} else if (volumeCurrent >= volumeTotal) { // Volume limit reached
+			LOG_INFO("Watering plants"); // Print debug message
+		} else if (meterRead() + shutoffVolume >= volumeTarget) { // Volume limit reached
       		digitalWrite(CONFIG_PIN_PUMP, LOW); // Deactivate pump
-			detachInterrupt(digitalPinToInterrupt(CONFIG_PIN_FLOW_METER)); // Detach interrupt for flow meter
-			volumeCurrent = -1.0; // Set current volume to -1.0 to indicate pump deactivation
+			traceEvent(TRACE_PUMP_OFF); // Trace pump deactivation
+			runEnd(RUN_TARGET); // Count coast-down until the run is complete
+			pumpActive = false; // Indicate pump deactivation
 			state = false; // set pump state variable to off
+			setPowerMode(powerProfile); // Restore WiFi power saving profile
       		sendState(); // Update MQTT system status
-			Serial.println("Finished watering plants."); // Print debug message
-		} else if (millis() - millis_time >= CONFIG_MQTT_UPDATE_FREQ){ // Plant Watering is ongoing and status update is due
+			activity_time = millis(); // Start deep sleep awake window
+			LOG_INFO("Finished watering plants"); // Print debug message
+		} else if (millis() - millis_time >= updateInterval){ // Plant Watering is ongoing and status update is due
+			runMeasureFlow(); // Update peak flow
       		millis_time = millis(); // Save current system time for status update delay
-      		//volumeCurrent = volumeCurrent + 1.0; // Dummy increment current volume for testing purposes without flow meter
-      		sendState(); // Update MQTT system status
+      		//pulseCount++; // Dummy increment current volume for testing purposes without flow meter
+			if (!CONFIG_FLOW_SAMPLES || !mqtt.connected()) { // Progress is not published as flow frames
+				sendState(); // Update MQTT system status
+			}
 		}
 	} else { // Plant watering is deactivated
-		if (digitalRead(CONFIG_PIN_PUMP) == HIGH) { // pump is still active
+		if (pumpActive || digitalRead(CONFIG_PIN_PUMP) == HIGH) { // pump is still active, a PWM output may read LOW
 			digitalWrite(CONFIG_PIN_PUMP, LOW); // Deactivate pump
-			detachInterrupt(digitalPinToInterrupt(CONFIG_PIN_FLOW_METER)); // Detach interrupt for flow meter
-			volumeCurrent = -1.0; // Set current volume to -1.0 to indicate pump deactivation
+			traceEvent(TRACE_PUMP_OFF); // Trace pump deactivation
+			runEnd(RUN_STOPPED); // Count coast-down until the run is complete
+			pumpActive = false; // Indicate pump deactivation
 			state = false; // set pump state variable to off
+			setPowerMode(powerProfile); // Restore WiFi power saving profile
       		sendState(); // Update MQTT system status
+			activity_time = millis(); // Start deep sleep awake window
 		}
 	}
+
+	if (totalsOutdated) { // Run was completed in the previous iteration
+		totalsOutdated = false;
+		sendState(); // Update MQTT system status with the lifetime totals
+	}
+	if (CONFIG_PUMP_PWM && pumpActive) { // Pump speed is controlled
+		pumpControl(); // Update the duty cycle when due
+	}
+	if (CONFIG_FLOW_SAMPLES && (pumpActive || runSettling)) { // Flow is sampled until the run is complete
+		flowSample(false); // Record a flow sample when due
+	}
+	runComplete(false); // Publish the summary once the coast-down is counted
+	captureFlush(false); // Publish captured records when due
+	if (mqtt.connected()) { // Updates buffered while the broker was unreachable can be sent
+		backlogPublish(); // Publish a page of the backlog when due
+	}
+	totalsCommit(false); // Write the lifetime totals when due
+	historyCommit(false); // Write the last run summary when it was delayed
+	calibrationCommit(false); // Write a changed calibration
+	sendHistory(); // Publish a requested page of the run history
+
+	if (mqtt.connected() && millis() - ping_time >= CONFIG_DIAGNOSTICS_FREQ) { // Latency measurement is due
+		ping_time = millis(); // Save current system time for latency measurement delay
+		sendPing(); // Send latency measurement
+	}
+
+	traceFlush(); // Publish the trace ring when requested
+	logFlush(false); // Write debug output without blocking
+	logPublish(false); // Publish log lines when due
+	traceEvent(TRACE_LOOP_END); // Trace end of the iteration, idle time is not part of it
+
+	if (CONFIG_SLEEP_ENABLED && !state && !runSettling && (offline || millis() - activity_time >= CONFIG_SLEEP_AWAKE_TIME)) { // Nothing left to do
+		sleepUntilNextRun(); // Enter deep sleep until the next scheduled run
+	}
+
+	if (!state && powerMode != WIFI_NONE_SLEEP) { // System is idle
+		delay(CONFIG_WIFI_IDLE_DELAY); // Allow WiFi to enter power saving
+	}
 }
\ No newline at end of file